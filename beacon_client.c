@@ -1,14 +1,30 @@
 #include <czmq.h>
 #include <stdio.h>
 
+#include "wire.h"
+
+struct wire_decoder_t g_wire_decoder;
+
 int handler(zloop_t* loop, zsock_t* sock, void* data)
 {
-    uint32_t time;
-    int32_t value;
-    uint8_t type;
-    uint8_t number;
-    int recv_res = zsock_recv(sock, "4i11", &time, &value, &type, &number);
-    zsys_info("jsenven: %u, %i, %u, %u", time, value, type, number);
+    byte* frame = NULL;
+    size_t size = 0;
+    int recv_res = zsock_recv(sock, "b", &frame, &size);
+    if (recv_res != 0) {
+        return 0;
+    }
+    enum wire_result result = wire_decode_state(&g_wire_decoder, frame, size);
+    freen(frame);
+    if (result == WIRE_NEED_KEYFRAME) {
+        uint8_t request[WIRE_MAX_FRAME];
+        zsock_send(sock, "b", request, wire_encode_keyframe_request(request, sizeof(request)));
+    } else if (result == WIRE_APPLIED) {
+        const struct wire_state_t* state = &g_wire_decoder.state;
+        zsys_info("state %u: %u, buttons %08x, axes %i %i %i %i %i %i %i %i (gaps %lu)",
+            (unsigned)(g_wire_decoder.next_seq - 1), state->time, state->buttons, state->axes[0],
+            state->axes[1], state->axes[2], state->axes[3], state->axes[4], state->axes[5],
+            state->axes[6], state->axes[7], (unsigned long)g_wire_decoder.gaps);
+    }
     return 0;
 }
 
@@ -60,9 +76,6 @@ char* beacon_listen()
         freen(ip_addr);
         freen(magic);
 
-        zmsg_t* msg = zmsg_recv(listener);
-        zmsg_print(msg);
-
         errno = 0;
         recv_res = zsock_recv(listener, "ss", &ip_addr, &magic);
         int result_errno = errno;
@@ -110,6 +123,7 @@ cleanup:
 
 bool paired_streaming(zsock_t* socket)
 {
+    wire_decoder_init(&g_wire_decoder); // new session, new sequence
     zsys_info("sending:fisrt");
     zstr_send(socket, "MITCHPURDY");
     zsys_info("sent");
@@ -1,198 +1,630 @@
+#include <arpa/inet.h>
 #include <czmq.h>
 #include <linux/joystick.h>
+#include <netinet/in.h>
 #include <stdio.h>
+#include <sys/random.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
-enum BeaconServerState {
-    Beaconing = 0,
-    Paired = 1,
-};
+#include "clock.h"
+#include "evdev_pad.h"
+#include "frame_pool.h"
+#include "latency.h"
+#include "log.h"
+#include "wire.h"
 
-zsock_t* beacon()
-{
-    zactor_t* beacon = zactor_new(zbeacon, NULL);
-    zsock_send(beacon, "si", "CONFIGURE", 9999);
-    zstr_sendx(beacon, "VERBOSE", NULL);
+// js_events (input_events with -e) read per read() call while draining the pad.
+#define JS_EVENT_BATCH 64
 
-    zsock_t* listener = zsock_new(ZMQ_PAIR);
-    zactor_t* monitor = zactor_new(zmonitor, listener);
-    zstr_sendx(monitor, "VERBOSE", NULL);
-    zstr_sendx(monitor, "LISTEN", "LISTENING", "ACCEPTED", "CONNECTED", "DISCONNECTED", NULL);
-    zstr_sendx(monitor, "START", NULL);
-    int port = zsock_bind(listener, "tcp://*:*");
-    zsys_info("listening for replies on port: %i", port);
+// One process serves many pads. Each seat is one pad, one PAIR socket bound
+// to its own port and, while a device is paired, that device's session. All
+// seats share a single zloop, so a seat costs a few descriptors and its state,
+// not a process or a thread.
+#define SERVER_MAX_SEATS 8
 
-    const char* filter = "SWITCHCON";
-    char magic_port_str[20];
-    snprintf(magic_port_str, 20, "%s%i", filter, port);
+#define BEACON_PREFIX "SWITCHCON"
+#define PAIRING_MAGIC "MITCHPURDY"
 
-    zsys_info("starting broadcast: %s", magic_port_str);
-    zsock_send(beacon, "ssi", "PUBLISH", magic_port_str, 1000);
-    zsys_info("started broadcast");
+// Percentage of UDP state datagrams deliberately dropped, for loss testing.
+unsigned g_udp_loss_percent = 0;
+// Grab the evdev pads so nothing else sees their events.
+bool g_evdev_grab = false;
+// How often the beacon goes out while a seat is free; a device that lost its
+// session goes straight back to its seat, so this only bounds first pairing
+// and the fallback.
+unsigned g_beacon_interval_ms = 100;
 
-    char* response_magic = NULL;
-    while (true) {
-        int recv_res = zsock_recv(listener, "s", &response_magic);
-        int result_errno = errno;
-        if (recv_res == 0) {
-            const char* response_magic_truth = "MITCHPURDY";
-            if (strncmp(response_magic, response_magic_truth, strlen(response_magic_truth)) == 0) {
-                // PAIRED
-                goto cleanup;
-            }
-        } else if (result_errno == EINTR) {
-            zsys_warning("interrupted, quiting");
-            goto bad;
-        } else {
-            zsys_info("Server got a beacon response");
+// Force a keyframe this often even when the pad is idle.
+#define KEYFRAME_PERIOD_MS 1000
+
+struct server_t;
+
+// One seat: its pad and the session of the device paired to it.
+struct controller_handler_data_t {
+    struct server_t* server;
+    unsigned index;
+    const char* pad_path;
+    bool pad_is_evdev;
+    int fd; // -1 while the pad is missing
+    zmq_pollitem_t pad_pollitem;
+    struct evdev_pad_t evdev;
+    // js_event.time is jiffies-based, so pad->read is measured above its minimum
+    struct latency_offset_t pad_offset;
+    struct wire_state_t state;
+    // Axes as the pad reported them when opened (JS_EVENT_INIT, or EVIOCGABS
+    // for evdev): where its sticks and triggers rest. A lost pad is sent as
+    // these with nothing pressed; zeroed axes would be half-pulled triggers.
+    int16_t rest_axes[WIRE_MAX_AXES];
+    // PAIR, bound for the seat's lifetime; it takes the next device once the
+    // previous one disconnects.
+    zsock_t* output_sock;
+    struct frame_pool_t frames; // for sends on output_sock
+    uint8_t reply[WIRE_MAX_FRAME]; // and the last one received from it
+    int port;
+    zactor_t* monitor;
+    bool paired;
+    // Of the last session, kept after it drops so its device can resume it.
+    uint32_t session_token;
+    struct wire_encoder_t encoder;
+    // UDP transport: -1 unless the device asked for it, connected once its
+    // hello arrived. Until then state keeps flowing over output_sock.
+    int udp_fd;
+    bool udp_connected;
+    zmq_pollitem_t udp_pollitem;
+};
+
+struct server_t {
+    zloop_t* loop;
+    zactor_t* beacon;
+    int advertised_port; // 0 while the beacon is silent
+    unsigned seat_count;
+    struct controller_handler_data_t seats[SERVER_MAX_SEATS];
+};
+
+void server_update_beacon(struct server_t* server);
+
+void send_state(struct controller_handler_data_t* handler_data)
+{
+    if (!handler_data->paired) {
+        return;
+    }
+    uint8_t* frame = frame_pool_buffer(&handler_data->frames);
+    if (handler_data->udp_connected) {
+        // Each datagram stands alone: a lost one must not stall the next.
+        wire_encoder_request_keyframe(&handler_data->encoder);
+    }
+    size_t size
+        = wire_encode_state(&handler_data->encoder, &handler_data->state, frame, WIRE_MAX_FRAME);
+    if (size == 0) {
+        return;
+    }
+    if (!handler_data->udp_connected) {
+        if (!frame_pool_send(&handler_data->frames, handler_data->output_sock, size)) {
+            // the device fell a pipe behind; restart it from a whole state
+            wire_encoder_request_keyframe(&handler_data->encoder);
         }
+    } else if (g_udp_loss_percent == 0 || (unsigned)(random() % 100) >= g_udp_loss_percent) {
+        send(handler_data->udp_fd, frame, size, MSG_DONTWAIT);
     }
+}
 
-    goto cleanup;
+// Offer the device a UDP port to say hello on; see WIRE_UDP_OFFER.
+bool udp_offer(struct controller_handler_data_t* handler_data)
+{
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+        .sin_port = 0,
+    };
+    socklen_t address_size = sizeof(address);
+    handler_data->udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (handler_data->udp_fd < 0
+        || bind(handler_data->udp_fd, (struct sockaddr*)&address, sizeof(address)) < 0
+        || getsockname(handler_data->udp_fd, (struct sockaddr*)&address, &address_size) < 0) {
+        zsys_error("UDP transport unavailable, staying on PAIR: %s", strerror(errno));
+        if (handler_data->udp_fd >= 0) {
+            close(handler_data->udp_fd);
+            handler_data->udp_fd = -1;
+        }
+        return false;
+    }
 
-bad:
-    zsock_destroy(&listener);
-    freen(listener);
+    uint8_t* offer = frame_pool_buffer(&handler_data->frames);
+    size_t size = wire_encode_udp_offer(offer, WIRE_MAX_FRAME, ntohs(address.sin_port));
+    frame_pool_send(&handler_data->frames, handler_data->output_sock, size);
+    zsys_info("offered UDP transport on port %u", ntohs(address.sin_port));
+    return true;
+}
 
-cleanup:
+// The device's hello tells us where to stream; later datagrams are ignored.
+int udp_hello_handler(zloop_t* loop, zmq_pollitem_t* pollitem, void* handler_data_void)
+{
+    struct controller_handler_data_t* handler_data = handler_data_void;
+    uint8_t frame[WIRE_MAX_FRAME];
+    struct sockaddr_in peer;
+    socklen_t peer_size = sizeof(peer);
+    ssize_t size = recvfrom(handler_data->udp_fd, frame, sizeof(frame), MSG_DONTWAIT,
+        (struct sockaddr*)&peer, &peer_size);
+    if (size < 0 || wire_frame_kind(frame, size) != WIRE_UDP_HELLO || handler_data->udp_connected) {
+        return 0;
+    }
+    if (connect(handler_data->udp_fd, (struct sockaddr*)&peer, peer_size) < 0) {
+        zsys_error("UDP connect failed: %s", strerror(errno));
+        return 0;
+    }
+    char peer_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &peer.sin_addr, peer_ip, sizeof(peer_ip));
+    zsys_info("streaming over UDP to %s:%u", peer_ip, ntohs(peer.sin_port));
+    handler_data->udp_connected = true;
+    send_state(handler_data);
+    return 0;
+}
 
-    zactor_destroy(&monitor);
-    freen(response_magic);
-    zstr_sendx(beacon, "SILENCE", NULL);
-    zactor_destroy(&beacon);
-    zactor_destroy(&monitor);
+// Nonzero, and not one a device that never had the session could present.
+uint32_t session_token_new(void)
+{
+    uint32_t token = 0;
+    while (token == 0) {
+        if (getrandom(&token, sizeof(token), 0) != sizeof(token)) {
+            token = (uint32_t)monotonic_ns();
+        }
+    }
+    return token;
+}
 
-    return listener;
+// A device answered the beacon on this seat's socket, or came back to it.
+// With the token of the seat's last session it resumes that session: the
+// sequence carries on and the next frame is a delta from what it last got.
+// Otherwise a new session starts with a keyframe.
+void seat_pair(
+    struct controller_handler_data_t* handler_data, bool udp_requested, uint32_t resume_token)
+{
+    handler_data->paired = true;
+    if (resume_token != 0 && resume_token == handler_data->session_token) {
+        zsys_info("seat %u: resumed session %08x", handler_data->index, resume_token);
+    } else {
+        handler_data->session_token = session_token_new();
+        wire_encoder_init(&handler_data->encoder); // new session, new sequence
+        zsys_info("seat %u: paired, session %08x", handler_data->index,
+            handler_data->session_token);
+    }
+    uint8_t* session = frame_pool_buffer(&handler_data->frames);
+    size_t size = wire_encode_session(session, WIRE_MAX_FRAME, handler_data->session_token);
+    frame_pool_send(&handler_data->frames, handler_data->output_sock, size);
+    if (udp_requested && udp_offer(handler_data)) {
+        handler_data->udp_pollitem = (zmq_pollitem_t) {
+            .socket = NULL,
+            .fd = handler_data->udp_fd,
+            .events = ZMQ_POLLIN,
+            .revents = 0,
+        };
+        zloop_poller(handler_data->server->loop, &handler_data->udp_pollitem, udp_hello_handler,
+            handler_data);
+    }
+    send_state(handler_data);
+    server_update_beacon(handler_data->server);
 }
 
-struct controller_handler_data_t {
-    int fd;
-    zsock_t* output_sock;
-};
+void seat_unpair(struct controller_handler_data_t* handler_data)
+{
+    zsys_info("seat %u: device disconnected", handler_data->index);
+    if (handler_data->udp_fd >= 0) {
+        zloop_poller_end(handler_data->server->loop, &handler_data->udp_pollitem);
+        close(handler_data->udp_fd);
+        handler_data->udp_fd = -1;
+    }
+    handler_data->udp_connected = false;
+    handler_data->paired = false;
+    if (handler_data->pad_is_evdev && handler_data->fd >= 0) {
+        evdev_pad_rumble(&handler_data->evdev, 0, 0); // don't leave it shaking
+    }
+    server_update_beacon(handler_data->server);
+}
+
+// The host's rumble, on the pad; echoed back once it plays, for the device's
+// round trip. Pads that can't rumble (joystick interface, read-only, no
+// FF_RUMBLE) get nothing and the device no echo.
+void seat_rumble(struct controller_handler_data_t* handler_data, const struct wire_rumble_t* rumble,
+    uint64_t recv_ns)
+{
+    if (!handler_data->pad_is_evdev || handler_data->fd < 0
+        || !evdev_pad_rumble(&handler_data->evdev, rumble->strong, rumble->weak)) {
+        return;
+    }
+    latency_record(LATENCY_RUMBLE_APPLY, monotonic_ns() - recv_ns);
+    uint8_t* ack = frame_pool_buffer(&handler_data->frames);
+    size_t size = wire_encode_rumble(ack, WIRE_MAX_FRAME, WIRE_RUMBLE_ACK, rumble);
+    frame_pool_send(&handler_data->frames, handler_data->output_sock, size);
+}
+
+// Before pairing: the pairing reply, with the token of the session it resumes
+// if any. After: the device asks for a keyframe
+// when it sees a gap in the sequence, and forwards the host's rumble.
+int device_message_handler(zloop_t* loop, zsock_t* reader, void* handler_data_void)
+{
+    struct controller_handler_data_t* handler_data = handler_data_void;
+    const uint8_t* frame = handler_data->reply;
+    size_t size = frame_recv(reader, handler_data->reply);
+    if (size == 0) {
+        return 0;
+    }
+    uint64_t recv_ns = monotonic_ns();
+    struct wire_rumble_t rumble;
+    if (!handler_data->paired) {
+        char magic[48];
+        snprintf(magic, sizeof(magic), "%.*s", (int)size, (const char*)frame);
+        if (strncmp(magic, PAIRING_MAGIC, strlen(PAIRING_MAGIC)) == 0) {
+            const char* resume = strstr(magic, " RESUME ");
+            uint32_t token = resume != NULL ? strtoul(resume + strlen(" RESUME "), NULL, 16) : 0;
+            seat_pair(handler_data, strstr(magic, " UDP") != NULL, token);
+        }
+    } else if (wire_frame_kind(frame, size) == WIRE_KEYFRAME_REQUEST) {
+        zsys_info("seat %u: device requested a keyframe", handler_data->index);
+        wire_encoder_request_keyframe(&handler_data->encoder);
+        send_state(handler_data);
+    } else if (wire_decode_rumble(frame, size, WIRE_RUMBLE, &rumble)) {
+        seat_rumble(handler_data, &rumble, recv_ns);
+    }
+    return 0;
+}
 
 int monitor_handler(zloop_t* loop, zsock_t* reader, void* handler_data_void)
 {
+    struct controller_handler_data_t* handler_data = handler_data_void;
     char* msg = zstr_recv(reader);
-    if (strncmp(msg, "DISCONNECTED", strlen("DISCONNECTED")) == 0) {
-        freen(msg);
-        return -1;
+    if (msg != NULL && strncmp(msg, "DISCONNECTED", strlen("DISCONNECTED")) == 0
+        && handler_data->paired) {
+        seat_unpair(handler_data);
     }
     freen(msg);
     return 0;
 }
 
+// The pad went away: release everything it held, keep the session and look
+// for the pad again on every keyframe tick.
+void seat_close_pad(struct controller_handler_data_t* handler_data)
+{
+    zsys_warning("seat %u: lost pad %s", handler_data->index, handler_data->pad_path);
+    zloop_poller_end(handler_data->server->loop, &handler_data->pad_pollitem);
+    if (handler_data->pad_is_evdev) {
+        evdev_pad_close(&handler_data->evdev);
+    } else {
+        close(handler_data->fd);
+    }
+    handler_data->fd = -1;
+    handler_data->state.buttons = 0;
+    memcpy(handler_data->state.axes, handler_data->rest_axes, sizeof(handler_data->state.axes));
+    send_state(handler_data);
+    server_update_beacon(handler_data->server);
+}
+
 int controller_read_handler(zloop_t* loop, zmq_pollitem_t* pollitem, void* handler_data_void)
 {
-    fprintf(stderr, "Controllerhandler");
     if (pollitem->socket != NULL) {
         char* msg = zstr_recv(pollitem->socket);
         zsys_info("Msg: %s", msg);
         freen(msg);
     }
     struct controller_handler_data_t* handler_data = (struct controller_handler_data_t*)handler_data_void;
-    struct js_event event;
-    ssize_t bytes = read(handler_data->fd, &event, sizeof(event));
 
-    if (bytes == sizeof(event)) {
-        zsys_info("jsenven: %u, %i, %u, %u", event.time, event.value, event.type, event.number);
-        zsock_send(handler_data->output_sock, "4i11", event.time, (int)event.value, event.type,
-            event.number);
-        return 0;
-    } else {
-        zsys_info("DISCONNECT");
-        fprintf(stderr, ("DISCONNECT"));
-        return -1;
+    // Drain everything the pad has queued and send it as one state frame.
+    struct js_event events[JS_EVENT_BATCH];
+    size_t folded = 0;
+    uint64_t read_ns = 0;
+    while (true) {
+        ssize_t bytes = read(handler_data->fd, events, sizeof(events));
+        if (read_ns == 0) {
+            read_ns = monotonic_ns();
+        }
+        if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+            break;
+        }
+        if (bytes <= 0) {
+            seat_close_pad(handler_data);
+            return 0;
+        }
+        size_t count = bytes / sizeof(events[0]);
+        uint32_t read_ms = (uint32_t)(read_ns / 1000000);
+        for (size_t i = 0; i < count; ++i) {
+            wire_state_apply_js_event(&handler_data->state, &events[i]);
+            if (events[i].type == (JS_EVENT_INIT | JS_EVENT_AXIS)
+                && events[i].number < WIRE_MAX_AXES) {
+                handler_data->rest_axes[events[i].number] = events[i].value;
+            }
+            int32_t queued_ms = (int32_t)(read_ms - events[i].time);
+            latency_record_offset(LATENCY_PAD_TO_READ, &handler_data->pad_offset, queued_ms * 1000000ll);
+        }
+        folded += count;
+        if (count < JS_EVENT_BATCH) {
+            break;
+        }
+    }
+
+    if (folded > 0) {
+        LOG_DEBUG("state: %zu events, buttons %08x", folded, handler_data->state.buttons);
+        send_state(handler_data);
+        latency_record(LATENCY_READ_TO_SEND, monotonic_ns() - read_ns);
     }
+    return 0;
 }
 
-bool paired_streaming(zsock_t* socket)
+// evdev: drain in bulk, send once at the last SYN_REPORT seen. Events after
+// it belong to a frame the kernel hasn't finished and wait for the next read.
+int evdev_read_handler(zloop_t* loop, zmq_pollitem_t* pollitem, void* handler_data_void)
 {
-    int jsfd = open("/dev/input/js0", O_RDONLY);
-    struct controller_handler_data_t handler_data = {
-        .fd = jsfd,
-        .output_sock = socket,
-    };
-    zactor_t* monitor = zactor_new(zmonitor, socket);
-    zstr_sendx(monitor, "VERBOSE", NULL);
-    zstr_sendx(monitor, "LISTEN", "DISCONNECTED", NULL);
-    zstr_sendx(monitor, "START", NULL);
+    struct controller_handler_data_t* handler_data = handler_data_void;
+
+    struct input_event events[JS_EVENT_BATCH];
+    size_t frames = 0;
+    uint64_t read_ns = 0;
+    uint64_t frame_ns = 0;
+    while (true) {
+        ssize_t bytes = read(handler_data->fd, events, sizeof(events));
+        if (read_ns == 0) {
+            read_ns = monotonic_ns();
+        }
+        if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+            break;
+        }
+        if (bytes <= 0) {
+            seat_close_pad(handler_data);
+            return 0;
+        }
+        size_t count = bytes / sizeof(events[0]);
+        frames += evdev_pad_apply(
+            &handler_data->evdev, &handler_data->state, events, count, &frame_ns);
+        if (count < JS_EVENT_BATCH) {
+            break;
+        }
+    }
+
+    if (frames > 0) {
+        // same clock: no offset estimation needed
+        latency_record(LATENCY_PAD_TO_READ, read_ns - frame_ns);
+        LOG_DEBUG("state: %zu frames, buttons %08x", frames, handler_data->state.buttons);
+        send_state(handler_data);
+        latency_record(LATENCY_READ_TO_SEND, monotonic_ns() - read_ns);
+    }
+    return 0;
+}
 
-    zmq_pollitem_t socket_pollitem = {
+bool seat_open_pad(struct controller_handler_data_t* handler_data)
+{
+    zloop_fn* read_handler = controller_read_handler;
+    if (handler_data->pad_is_evdev) {
+        if (!evdev_pad_open(&handler_data->evdev, handler_data->pad_path, g_evdev_grab)) {
+            return false;
+        }
+        handler_data->fd = handler_data->evdev.fd;
+        handler_data->state = handler_data->evdev.pending;
+        memcpy(handler_data->rest_axes, handler_data->state.axes, sizeof(handler_data->rest_axes));
+        read_handler = evdev_read_handler;
+    } else {
+        handler_data->fd = open(handler_data->pad_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (handler_data->fd < 0) {
+            zsys_error("seat %u: %s: %s", handler_data->index, handler_data->pad_path,
+                strerror(errno));
+            return false;
+        }
+        uint8_t axis_count = 0;
+        uint8_t button_count = 0;
+        ioctl(handler_data->fd, JSIOCGAXES, &axis_count);
+        ioctl(handler_data->fd, JSIOCGBUTTONS, &button_count);
+        memset(&handler_data->state, 0, sizeof(handler_data->state));
+        memset(handler_data->rest_axes, 0, sizeof(handler_data->rest_axes));
+        handler_data->state.axis_count = axis_count < WIRE_MAX_AXES ? axis_count : WIRE_MAX_AXES;
+        handler_data->state.button_count
+            = button_count < WIRE_MAX_BUTTONS ? button_count : WIRE_MAX_BUTTONS;
+        handler_data->pad_offset.valid = false;
+    }
+
+    handler_data->pad_pollitem = (zmq_pollitem_t) {
         .socket = NULL,
-        .fd = jsfd,
+        .fd = handler_data->fd,
         .events = ZMQ_POLLIN,
         .revents = 0,
     };
+    zloop_poller(
+        handler_data->server->loop, &handler_data->pad_pollitem, read_handler, handler_data);
+    zsys_info("seat %u: reading %s", handler_data->index, handler_data->pad_path);
+    send_state(handler_data);
+    return true;
+}
 
-    // Create a new zloop reactor
-    zloop_t* loop = zloop_new();
-    zloop_reader(loop, (zsock_t*)monitor, monitor_handler, NULL);
-    zloop_poller(loop, &socket_pollitem, controller_read_handler, &handler_data);
-    zloop_start(loop);
+bool seat_listen(struct controller_handler_data_t* handler_data)
+{
+    handler_data->output_sock = zsock_new(ZMQ_PAIR);
+    frame_pool_setup_socket(handler_data->output_sock);
+    zsock_set_heartbeat_ivl(handler_data->output_sock, WIRE_HEARTBEAT_IVL_MS);
+    zsock_set_heartbeat_timeout(handler_data->output_sock, WIRE_HEARTBEAT_TIMEOUT_MS);
+    zsock_set_heartbeat_ttl(handler_data->output_sock, WIRE_HEARTBEAT_TIMEOUT_MS);
+    handler_data->port = zsock_bind(handler_data->output_sock, "tcp://*:*");
+    if (handler_data->port < 0) {
+        zsys_error("seat %u: bind failed: %s", handler_data->index, strerror(errno));
+        zsock_destroy(&handler_data->output_sock);
+        return false;
+    }
+    handler_data->monitor = zactor_new(zmonitor, handler_data->output_sock);
+    zstr_sendx(handler_data->monitor, "VERBOSE", NULL);
+    zstr_sendx(handler_data->monitor, "LISTEN", "DISCONNECTED", NULL);
+    zstr_sendx(handler_data->monitor, "START", NULL);
 
+    zloop_t* loop = handler_data->server->loop;
+    zloop_reader(loop, handler_data->output_sock, device_message_handler, handler_data);
+    zloop_reader(loop, (zsock_t*)handler_data->monitor, monitor_handler, handler_data);
+    zsys_info("seat %u: listening for replies on port %i", handler_data->index, handler_data->port);
     return true;
 }
 
-int main(int argc, char** argv)
+// Advertise the first seat that has a pad and no device, and go quiet while
+// there is none, so each answering device lands on a seat of its own.
+void server_update_beacon(struct server_t* server)
 {
-    zsys_set_logstream(stderr);
-    enum BeaconServerState state = Beaconing;
+    const struct controller_handler_data_t* free_seat = NULL;
+    for (unsigned n = 0; n < server->seat_count && free_seat == NULL; ++n) {
+        const struct controller_handler_data_t* seat = &server->seats[n];
+        if (!seat->paired && seat->fd >= 0 && seat->output_sock != NULL) {
+            free_seat = seat;
+        }
+    }
+    int port = free_seat != NULL ? free_seat->port : 0;
+    if (port == server->advertised_port) {
+        return;
+    }
+    server->advertised_port = port;
+    if (free_seat == NULL) {
+        zstr_sendx(server->beacon, "SILENCE", NULL);
+        zsys_info("no free seat, beacon silent");
+        return;
+    }
 
-    zsock_t* paired_socket = NULL;
+    char magic_port_str[20];
+    snprintf(magic_port_str, sizeof(magic_port_str), "%s%i", BEACON_PREFIX, port);
+    zsock_send(server->beacon, "ssi", "PUBLISH", magic_port_str, g_beacon_interval_ms);
+    zsys_info("seat %u free, broadcasting: %s", free_seat->index, magic_port_str);
+}
 
-    while (true) {
-        switch (state) {
-        case Beaconing: {
-            zsys_info("BEaAC");
-            paired_socket = beacon();
-            if (paired_socket != NULL) {
-                state = Paired;
-            } else {
-                return -1;
-            }
-            break;
+bool server_add_seat(struct server_t* server, const char* pad_path, bool pad_is_evdev)
+{
+    if (server->seat_count == SERVER_MAX_SEATS) {
+        fprintf(stderr, "at most %d pads\n", SERVER_MAX_SEATS);
+        return false;
+    }
+    struct controller_handler_data_t* seat = &server->seats[server->seat_count];
+    *seat = (struct controller_handler_data_t) {
+        .server = server,
+        .index = server->seat_count,
+        .pad_path = pad_path,
+        .pad_is_evdev = pad_is_evdev,
+        .fd = -1,
+        .udp_fd = -1,
+    };
+    ++server->seat_count;
+    return true;
+}
+
+bool server_start(struct server_t* server)
+{
+    server->loop = zloop_new();
+    server->beacon = zactor_new(zbeacon, NULL);
+    zsock_send(server->beacon, "si", "CONFIGURE", 9999);
+    char* hostname = zstr_recv(server->beacon);
+    if (hostname == NULL || *hostname == '\0') {
+        zsys_error("no interface to broadcast on");
+        freen(hostname);
+        return false;
+    }
+    freen(hostname);
+    zstr_sendx(server->beacon, "VERBOSE", NULL);
+
+    for (unsigned n = 0; n < server->seat_count; ++n) {
+        struct controller_handler_data_t* seat = &server->seats[n];
+        if (!seat_listen(seat)) {
+            return false;
         }
-        case Paired: {
-            zsys_info("PAIR");
-            paired_streaming(paired_socket);
-            state = Beaconing;
-            zsock_destroy(&paired_socket);
-            break;
+        // A missing pad is looked for again on every keyframe tick.
+        seat_open_pad(seat);
+    }
+    server_update_beacon(server);
+    return true;
+}
+
+void server_stop(struct server_t* server)
+{
+    for (unsigned n = 0; n < server->seat_count; ++n) {
+        struct controller_handler_data_t* seat = &server->seats[n];
+        zactor_destroy(&seat->monitor);
+        zsock_destroy(&seat->output_sock);
+        if (seat->udp_fd >= 0) {
+            close(seat->udp_fd);
         }
+        if (seat->fd >= 0) {
+            close(seat->fd);
         }
     }
+    if (server->beacon != NULL) {
+        zstr_sendx(server->beacon, "SILENCE", NULL);
+        zactor_destroy(&server->beacon);
+    }
+    zloop_destroy(&server->loop);
+}
 
-    zsys_set_logstream(stderr);
-    zactor_t* beacon = zactor_new(zbeacon, NULL);
-    zsock_send(beacon, "si", "CONFIGURE", 9999);
-    zstr_sendx(beacon, "VERBOSE", NULL);
-
-    zsock_t* listener = zsock_new(ZMQ_PAIR);
-    zactor_t* monitor = zactor_new(zmonitor, listener);
-    zstr_sendx(monitor, "VERBOSE", NULL);
-    zstr_sendx(monitor, "LISTEN", "LISTENING", "ACCEPTED", "CONNECTED", "DISCONNECTED", NULL);
-    zstr_sendx(monitor, "START", NULL);
-    int port = zsock_bind(listener, "tcp://*:*");
-    zsys_info("listening for replies on port: %i", port);
-
-    const char* filter = "SWITCHCON";
-    char magic_port_str[20];
-    snprintf(magic_port_str, 20, "%s%i", filter, port);
+// Keyframes for every paired seat, and another look for pads that are missing.
+int keyframe_timer_handler(zloop_t* loop, int timer_id, void* server_void)
+{
+    struct server_t* server = server_void;
+    bool pads_found = false;
+    for (unsigned n = 0; n < server->seat_count; ++n) {
+        struct controller_handler_data_t* seat = &server->seats[n];
+        if (seat->fd < 0 && access(seat->pad_path, R_OK) == 0) {
+            pads_found |= seat_open_pad(seat);
+        }
+        if (seat->paired) {
+            wire_encoder_request_keyframe(&seat->encoder);
+            send_state(seat);
+        }
+    }
+    if (pads_found) {
+        server_update_beacon(server);
+    }
+    return 0;
+}
 
-    zsys_info("starting broadcast: %s", magic_port_str);
-    zsock_send(beacon, "ssi", "PUBLISH", magic_port_str, 1000);
-    zsys_info("started broadcast");
+int main(int argc, char** argv)
+{
+    static struct server_t server;
+    int opt;
+    unsigned stats_interval = 0;
+    while ((opt = getopt(argc, argv, "L:i:e:j:gB:h")) != -1) {
+        switch (opt) {
+        case 'L':
+            g_udp_loss_percent = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            stats_interval = strtoul(optarg, NULL, 0);
+            break;
+        case 'e':
+        case 'j':
+            if (!server_add_seat(&server, optarg, opt == 'e')) {
+                return 1;
+            }
+            break;
+        case 'g':
+            g_evdev_grab = true;
+            break;
+        case 'B':
+            g_beacon_interval_ms = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr,
+                "usage: %s [-L percent] [-i seconds] [-g] [-B ms]\n"
+                "          [-j jsN-node | -e eventN-node]...\n"
+                "  -L  drop this percentage of UDP state datagrams (loss injection)\n"
+                "  -i  dump per-stage latency histograms every interval (always on SIGUSR1)\n"
+                "  -j  add a seat reading this joystick node (default: one, /dev/input/js0)\n"
+                "  -e  add a seat reading this evdev node, one state frame per SYN_REPORT batch\n"
+                "  -g  grab the evdev nodes so nothing else sees their events\n"
+                "  -B  beacon interval while a seat is free (default 100 ms)\n"
+                "Up to %d seats; each pairs with its own device.\n",
+                argv[0], SERVER_MAX_SEATS);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (server.seat_count == 0) {
+        server_add_seat(&server, "/dev/input/js0", false);
+    }
 
-    zsys_info("waiting for first msg");
-    char* msg = zstr_recv(listener);
-    zsys_info("first msg: %s", msg);
+    log_start();
+    latency_start_reporter(stats_interval);
 
-    while (true) {
-        zsys_info("sending: %s", "sendout");
-        zstr_send(listener, "sendout");
-        usleep(2000000);
+    zsys_set_logstream(stderr);
+    if (!server_start(&server)) {
+        server_stop(&server);
+        return 1;
     }
-
-    // zsock_destroy(&sock);
+    zloop_timer(server.loop, KEYFRAME_PERIOD_MS, 0, keyframe_timer_handler, &server);
+    zloop_start(server.loop);
+    server_stop(&server);
     return 0;
 }
@@ -0,0 +1,357 @@
+// Heap allocations on the streaming path, counted by interposing malloc.
+//
+// A server-side and a device-side PAIR socket are connected over loopback
+// TCP. Each round, the server encodes a state frame and sends it, the device
+// receives and decodes it and answers with a report ack, and the server
+// receives that, the way beacon_server, device.c and loadgen do. After a
+// warmup, every malloc, calloc, realloc and aligned allocation made by any
+// thread in the process (ZMQ's I/O threads included) is counted, first for
+// the frame_pool path and then for the zsock_send/zsock_recv "b" path it
+// replaced.
+//
+// Round trips never queue more than one frame, so a burst follows: the server
+// streams pool frames as fast as it can while the device drains them on a
+// thread of its own, pausing now and then, so the send pipe keeps filling up
+// to FRAME_POOL_HWM and every further send waits for the I/O thread to take a
+// frame off it. The ring wraps thousands of times with the pipe full, which
+// is when a buffer reused too early would show. Every received frame is
+// checked byte for byte against what was encoded into it.
+//
+// Exits non-zero if the pool path allocated at all, a burst frame came out
+// wrong, or the burst never found the pipe full.
+
+#define _GNU_SOURCE
+#include <czmq.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "frame_pool.h"
+#include "wire.h"
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* pointer, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+
+// Who allocated: ZMQ's own threads, the bench's sending thread or the burst's
+// receiving thread.
+enum bench_thread {
+    THREAD_ZMQ,
+    THREAD_SENDER,
+    THREAD_RECEIVER,
+    THREAD_COUNT,
+};
+
+static atomic_bool g_counting;
+static atomic_uint_fast64_t g_allocations;
+static atomic_uint_fast64_t g_thread_allocations[THREAD_COUNT];
+static _Thread_local enum bench_thread t_thread = THREAD_ZMQ;
+
+static void count_allocation(void)
+{
+    if (atomic_load_explicit(&g_counting, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&g_allocations, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&g_thread_allocations[t_thread], 1, memory_order_relaxed);
+    }
+}
+
+static void start_counting(void)
+{
+    atomic_store(&g_allocations, 0);
+    for (int n = 0; n < THREAD_COUNT; ++n) {
+        atomic_store(&g_thread_allocations[n], 0);
+    }
+    atomic_store(&g_counting, true);
+}
+
+void* malloc(size_t size)
+{
+    count_allocation();
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+    count_allocation();
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size)
+{
+    count_allocation();
+    return __libc_realloc(pointer, size);
+}
+
+int posix_memalign(void** pointer, size_t alignment, size_t size)
+{
+    count_allocation();
+    *pointer = __libc_memalign(alignment, size);
+    return *pointer != NULL ? 0 : ENOMEM;
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+    count_allocation();
+    return __libc_memalign(alignment, size);
+}
+
+enum bench_path {
+    PATH_POOL,
+    PATH_ZSOCK,
+};
+
+struct bench_t {
+    enum bench_path path;
+    zsock_t* server;
+    zsock_t* device;
+    struct frame_pool_t server_pool;
+    struct frame_pool_t device_pool;
+    uint8_t server_reply[WIRE_MAX_FRAME];
+    uint8_t device_frame[WIRE_MAX_FRAME];
+    struct wire_state_t state;
+    struct wire_encoder_t encoder;
+    struct wire_decoder_t decoder;
+};
+
+// Wait for a message on `socket` the way zloop would, without blocking in recv.
+static bool readable(zsock_t* socket)
+{
+    zmq_pollitem_t item = { .socket = zsock_resolve(socket), .events = ZMQ_POLLIN };
+    return zmq_poll(&item, 1, 1000) == 1;
+}
+
+static bool send_frame(struct bench_t* bench, zsock_t* socket, struct frame_pool_t* pool,
+    uint8_t* frame, size_t size)
+{
+    if (bench->path == PATH_POOL) {
+        return frame_pool_send(pool, socket, size);
+    }
+    return zsock_send(socket, "b", frame, size) == 0;
+}
+
+// Receive into `buffer`, returning the size; 0 on failure.
+static size_t recv_frame(struct bench_t* bench, zsock_t* socket, uint8_t* buffer)
+{
+    if (!readable(socket)) {
+        return 0;
+    }
+    if (bench->path == PATH_POOL) {
+        return frame_recv(socket, buffer);
+    }
+    byte* frame = NULL;
+    size_t size = 0;
+    if (zsock_recv(socket, "b", &frame, &size) != 0 || size > WIRE_MAX_FRAME) {
+        freen(frame);
+        return 0;
+    }
+    memcpy(buffer, frame, size);
+    freen(frame);
+    return size;
+}
+
+static bool round_trip(struct bench_t* bench, uint32_t n)
+{
+    bench->state.buttons = n & 0xff;
+    bench->state.axes[n % 4] = (int16_t)(n * 97);
+    bench->state.time = n;
+
+    uint8_t* frame = bench->path == PATH_POOL ? frame_pool_buffer(&bench->server_pool)
+                                              : bench->server_reply;
+    size_t size = wire_encode_state(&bench->encoder, &bench->state, frame, WIRE_MAX_FRAME);
+    if (size == 0 || !send_frame(bench, bench->server, &bench->server_pool, frame, size)) {
+        return false;
+    }
+
+    size = recv_frame(bench, bench->device, bench->device_frame);
+    if (size == 0
+        || wire_decode_state(&bench->decoder, bench->device_frame, size) != WIRE_APPLIED) {
+        return false;
+    }
+    struct wire_report_ack_t ack = { .header.seq = n, .frames = bench->decoder.frames };
+    uint8_t* reply = bench->path == PATH_POOL ? frame_pool_buffer(&bench->device_pool)
+                                              : bench->device_frame;
+    size = wire_encode_report_ack(reply, WIRE_MAX_FRAME, &ack);
+    if (!send_frame(bench, bench->device, &bench->device_pool, reply, size)) {
+        return false;
+    }
+
+    size = recv_frame(bench, bench->server, bench->server_reply);
+    return size != 0 && wire_decode_report_ack(bench->server_reply, size, &ack);
+}
+
+static bool run(struct bench_t* bench, unsigned warmup, unsigned rounds)
+{
+    wire_encoder_init(&bench->encoder);
+    wire_decoder_init(&bench->decoder);
+    for (unsigned n = 0; n < warmup; ++n) {
+        if (!round_trip(bench, n)) {
+            fprintf(stderr, "round trip failed in warmup\n");
+            return false;
+        }
+    }
+
+    start_counting();
+    uint64_t start = zclock_usecs();
+    for (unsigned n = 0; n < rounds; ++n) {
+        if (!round_trip(bench, warmup + n)) {
+            atomic_store(&g_counting, false);
+            fprintf(stderr, "round trip failed\n");
+            return false;
+        }
+    }
+    uint64_t elapsed = zclock_usecs() - start;
+    atomic_store(&g_counting, false);
+
+    uint64_t allocations = atomic_load(&g_allocations);
+    printf("%-6s %u round trips, %lu allocations (%.2f per frame), %.1f us per round trip\n",
+        bench->path == PATH_POOL ? "pool" : "zsock", rounds, (unsigned long)allocations,
+        allocations / (2.0 * rounds), (double)elapsed / rounds);
+    return true;
+}
+
+// Burst frames are a u32 index followed by bytes that depend on both the
+// index and their position, WIRE_MAX_FRAME in all.
+static void burst_fill(uint8_t* frame, uint32_t index)
+{
+    memcpy(frame, &index, sizeof(index));
+    for (size_t n = sizeof(index); n < WIRE_MAX_FRAME; ++n) {
+        frame[n] = (uint8_t)(index * 131 + n);
+    }
+}
+
+struct burst_t {
+    struct bench_t* bench;
+    uint32_t frames;
+    uint32_t received;
+    uint32_t corrupt;
+};
+
+// The device side: take the frames in order and check every byte; pause
+// every so often so the server runs into a full pipe again.
+static void* burst_receive(void* burst_void)
+{
+    struct burst_t* burst = burst_void;
+    uint8_t expected[WIRE_MAX_FRAME];
+    uint8_t frame[WIRE_MAX_FRAME];
+    t_thread = THREAD_RECEIVER;
+    usleep(20000); // let the pipe fill up first
+    while (burst->received < burst->frames) {
+        if (burst->received % 8192 == 0) {
+            usleep(1000);
+        }
+        if (!readable(burst->bench->device)) {
+            break;
+        }
+        size_t size = frame_recv(burst->bench->device, frame);
+        burst_fill(expected, burst->received);
+        if (size != WIRE_MAX_FRAME || memcmp(frame, expected, WIRE_MAX_FRAME) != 0) {
+            ++burst->corrupt;
+        }
+        ++burst->received;
+    }
+    return NULL;
+}
+
+static bool run_burst(struct bench_t* bench, uint32_t frames)
+{
+    struct burst_t burst = { .bench = bench, .frames = frames };
+    pthread_t receiver;
+    pthread_create(&receiver, NULL, burst_receive, &burst);
+    start_counting(); // after pthread_create, which allocates the thread's own state
+
+    uint64_t full = 0;
+    uint64_t start = zclock_usecs();
+    for (uint32_t n = 0; n < frames; ++n) {
+        burst_fill(frame_pool_buffer(&bench->server_pool), n);
+        while (!frame_pool_send(&bench->server_pool, bench->server, WIRE_MAX_FRAME)) {
+            ++full; // pipe at the high-water mark: wait for the I/O thread
+        }
+    }
+    pthread_join(receiver, NULL);
+    uint64_t elapsed = zclock_usecs() - start;
+    atomic_store(&g_counting, false);
+
+    uint64_t allocations = atomic_load(&g_allocations);
+    printf("burst  %u frames (ring wrapped %u times), %u received, %u corrupt, pipe full on "
+           "%lu sends, %.2f us per frame\n",
+        frames, frames / FRAME_POOL_SIZE, burst.received, burst.corrupt, (unsigned long)full,
+        (double)elapsed / frames);
+    printf("burst  %lu allocations: %lu by the sender, %lu by the receiver, %lu by ZMQ's threads\n",
+        (unsigned long)allocations,
+        (unsigned long)atomic_load(&g_thread_allocations[THREAD_SENDER]),
+        (unsigned long)atomic_load(&g_thread_allocations[THREAD_RECEIVER]),
+        (unsigned long)atomic_load(&g_thread_allocations[THREAD_ZMQ]));
+    return burst.received == frames && burst.corrupt == 0 && full > 0;
+}
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr,
+        "usage: %s [-n rounds] [-w warmup] [-b frames]\n"
+        "  -n  counted round trips per path (default 100000)\n"
+        "  -w  uncounted round trips first (default 1000)\n"
+        "  -b  frames in the burst (default 200000)\n",
+        argv0);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned rounds = 100000;
+    unsigned warmup = 1000;
+    uint32_t burst_frames = 200000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:w:b:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            rounds = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            warmup = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            burst_frames = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    t_thread = THREAD_SENDER;
+    static struct bench_t bench;
+    bench.server = zsock_new(ZMQ_PAIR);
+    frame_pool_setup_socket(bench.server);
+    int port = zsock_bind(bench.server, "tcp://127.0.0.1:*");
+    bench.device = zsock_new(ZMQ_PAIR);
+    frame_pool_setup_socket(bench.device);
+    if (port < 0 || zsock_connect(bench.device, "tcp://127.0.0.1:%i", port) != 0) {
+        fprintf(stderr, "loopback PAIR setup failed\n");
+        return 1;
+    }
+    // a PAIR socket without its peer yet can't take a frame
+    zmq_pollitem_t connected = { .socket = zsock_resolve(bench.server), .events = ZMQ_POLLOUT };
+    if (zmq_poll(&connected, 1, 1000) != 1) {
+        fprintf(stderr, "loopback PAIR never connected\n");
+        return 1;
+    }
+    bench.state.button_count = 8;
+    bench.state.axis_count = 4;
+
+    bench.path = PATH_POOL;
+    bool ok = run(&bench, warmup, rounds);
+    uint64_t pool_allocations = atomic_load(&g_allocations);
+    bench.path = PATH_ZSOCK;
+    ok = run(&bench, warmup, rounds) && ok;
+    ok = run_burst(&bench, burst_frames) && ok;
+
+    zsock_destroy(&bench.device);
+    zsock_destroy(&bench.server);
+    return ok && pool_allocations == 0 ? 0 : 1;
+}
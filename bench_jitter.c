@@ -0,0 +1,184 @@
+// Wakeup jitter of a periodic thread standing in for ep1, in the default mode
+// and in the real-time mode of rt.h (device -R).
+//
+// The measured thread sleeps to absolute deadlines one poll period apart and
+// records how late each wakeup was. Meanwhile load threads keep every CPU
+// busy at normal priority, and one of them churns freshly mapped memory to
+// put the page allocator and reclaim under pressure. The measured thread and
+// the load share one CPU (-c), the way ep1 shares a core on the board.
+//
+// The default run goes first: real-time mode locks the process's memory for
+// good, which would otherwise carry over.
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "rt.h"
+
+#define CHURN_BYTES (64 * 1024 * 1024)
+
+struct bench_t {
+    const struct rt_config_t* rt;
+    unsigned period_us;
+    double duration_s;
+    int cpu;
+    unsigned load_threads;
+    atomic_bool stop;
+
+    uint64_t* samples;
+    size_t sample_count;
+    size_t sample_capacity;
+};
+
+static void* measured(void* bench_void)
+{
+    struct bench_t* bench = bench_void;
+    uint64_t deadline = monotonic_ns();
+    while (!atomic_load(&bench->stop) && bench->sample_count < bench->sample_capacity) {
+        deadline += bench->period_us * 1000ull;
+        monotonic_sleep_until(deadline);
+        uint64_t now = monotonic_ns();
+        bench->samples[bench->sample_count++] = now > deadline ? now - deadline : 0;
+    }
+    return NULL;
+}
+
+static void* spin(void* bench_void)
+{
+    struct bench_t* bench = bench_void;
+    volatile uint64_t n = 0;
+    while (!atomic_load_explicit(&bench->stop, memory_order_relaxed)) {
+        ++n;
+    }
+    return NULL;
+}
+
+static void* churn(void* bench_void)
+{
+    struct bench_t* bench = bench_void;
+    long page = sysconf(_SC_PAGESIZE);
+    while (!atomic_load(&bench->stop)) {
+        uint8_t* block
+            = mmap(NULL, CHURN_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block == MAP_FAILED) {
+            break;
+        }
+        for (size_t offset = 0; offset < CHURN_BYTES; offset += page) {
+            block[offset] = 1;
+        }
+        munmap(block, CHURN_BYTES);
+    }
+    return NULL;
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void run(struct bench_t* bench, const char* name)
+{
+    bench->sample_count = 0;
+    atomic_store(&bench->stop, false);
+
+    static const struct rt_config_t normal = { .enabled = false };
+    pthread_t load[64];
+    unsigned loads = bench->load_threads < 64 ? bench->load_threads : 64;
+    for (unsigned n = 0; n < loads; ++n) {
+        // one spinner shares the measured thread's CPU, the rest roam
+        rt_thread_start(&normal, &load[n], n == 1 ? churn : spin, bench, n == 0 ? bench->cpu : -1,
+            RT_ROLE_IO);
+    }
+    pthread_t thread;
+    rt_thread_start(bench->rt, &thread, measured, bench, bench->cpu, RT_ROLE_IO);
+    pthread_join(thread, NULL);
+    atomic_store(&bench->stop, true);
+    for (unsigned n = 0; n < loads; ++n) {
+        pthread_join(load[n], NULL);
+    }
+
+    uint64_t* s = bench->samples;
+    size_t n = bench->sample_count;
+    qsort(s, n, sizeof(s[0]), compare_u64);
+    printf("%-8s wakeups %7zu  late us: p50 %7.1f  p99 %7.1f  p99.9 %8.1f  max %9.1f\n", name, n,
+        s[n / 2] / 1e3, s[n * 99 / 100] / 1e3, s[n * 999 / 1000] / 1e3, s[n - 1] / 1e3);
+}
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr,
+        "usage: %s [-p period_us] [-d seconds] [-c cpu] [-l threads] [-R spec]\n"
+        "  -p  wakeup period in microseconds (default 2000, a high-speed bInterval 5)\n"
+        "  -d  seconds per mode (default 5)\n"
+        "  -c  CPU for the measured thread and one load thread (default 0)\n"
+        "  -l  load threads, one of them churning memory (default: one per CPU)\n"
+        "  -R  real-time spec for the second run, as device -R (default on)\n",
+        argv0);
+}
+
+int main(int argc, char** argv)
+{
+    struct bench_t bench = {
+        .period_us = 2000,
+        .duration_s = 5,
+        .cpu = 0,
+        .load_threads = sysconf(_SC_NPROCESSORS_ONLN),
+    };
+    const char* rt_spec = "on";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:d:c:l:R:h")) != -1) {
+        switch (opt) {
+        case 'p':
+            bench.period_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            bench.duration_s = strtod(optarg, NULL);
+            break;
+        case 'c':
+            bench.cpu = strtol(optarg, NULL, 0);
+            break;
+        case 'l':
+            bench.load_threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'R':
+            rt_spec = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    struct rt_config_t rt = g_rt_config;
+    if (bench.period_us == 0 || !rt_parse(&rt, rt_spec)) {
+        usage(argv[0]);
+        return 1;
+    }
+    bench.sample_capacity = (size_t)(bench.duration_s * 1e6 / bench.period_us) + 1;
+    bench.samples = calloc(bench.sample_capacity, sizeof(uint64_t));
+
+    printf("wake every %u us on cpu %i, %u load threads, %.1f s per mode\n", bench.period_us,
+        bench.cpu, bench.load_threads, bench.duration_s);
+    struct rt_config_t normal = { .enabled = false };
+    bench.rt = &normal;
+    run(&bench, "default");
+    rt_setup_process(&rt);
+    bench.rt = &rt;
+    run(&bench, "rt");
+
+    free(bench.samples);
+    return 0;
+}
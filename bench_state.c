@@ -0,0 +1,213 @@
+// Contention benchmark for the controller state handoff between the comm thread
+// (writer) and the ep1 thread (reader): the old pthread_mutex scheme against the
+// joystick_seqlock_t that device.c uses now.
+//
+// The writer applies input updates at a fixed rate (1 kHz by default, 0 floods)
+// and, like handler() did, does some debug printing per update. In mutex mode it
+// holds the lock for the whole update, in seqlock mode it only publishes at the
+// end. The reader samples the state once per simulated host poll and records
+// how long obtaining a snapshot took.
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "joystick_state.h"
+
+enum bench_mode {
+    BENCH_MUTEX,
+    BENCH_SEQLOCK,
+};
+
+struct bench_t {
+    enum bench_mode mode;
+    unsigned writer_rate_hz;
+    unsigned poll_period_us;
+    double duration_s;
+
+    FILE* debug_sink;
+    atomic_bool stop;
+
+    struct USB_JoystickReport_Input_t mutex_data;
+    pthread_mutex_t mutex;
+    struct joystick_seqlock_t seqlock;
+
+    uint64_t* samples;
+    size_t sample_count;
+    size_t sample_capacity;
+    uint64_t updates;
+};
+
+static void sleep_until(struct timespec* deadline, uint64_t period_ns)
+{
+    deadline->tv_nsec += period_ns;
+    while (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_nsec -= 1000000000;
+        ++deadline->tv_sec;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL);
+}
+
+// What handler() does to the report for one HAT event, printf included.
+static void apply_update(struct bench_t* bench, struct USB_JoystickReport_Input_t* report,
+    uint32_t n)
+{
+    report->LX = n;
+    report->HAT = n % 9;
+    fprintf(bench->debug_sink, "HAT: %i, %u", report->HAT, n);
+    fprintf(bench->debug_sink, "l/r lrud: %i %i %i %i\n", n & 1, n & 2, n & 4, n & 8);
+    fflush(bench->debug_sink);
+}
+
+static void* writer(void* bench_void)
+{
+    struct bench_t* bench = bench_void;
+    struct USB_JoystickReport_Input_t working = { 0 };
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    for (uint32_t n = 1; !atomic_load(&bench->stop); ++n) {
+        if (bench->mode == BENCH_MUTEX) {
+            pthread_mutex_lock(&bench->mutex);
+            apply_update(bench, &bench->mutex_data, n);
+            pthread_mutex_unlock(&bench->mutex);
+        } else {
+            apply_update(bench, &working, n);
+            struct joystick_state_t state = {
+                .report = working,
+                .generation = n,
+                .stamp = monotonic_ns(),
+            };
+            joystick_seqlock_write(&bench->seqlock, &state);
+        }
+        ++bench->updates;
+        if (bench->writer_rate_hz != 0) {
+            sleep_until(&deadline, 1000000000ull / bench->writer_rate_hz);
+        }
+    }
+    return NULL;
+}
+
+static void* reader(void* bench_void)
+{
+    struct bench_t* bench = bench_void;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    while (!atomic_load(&bench->stop) && bench->sample_count < bench->sample_capacity) {
+        struct USB_JoystickReport_Input_t in;
+        uint64_t start = monotonic_ns();
+        if (bench->mode == BENCH_MUTEX) {
+            pthread_mutex_lock(&bench->mutex);
+            in = bench->mutex_data;
+            pthread_mutex_unlock(&bench->mutex);
+        } else {
+            struct joystick_state_t state;
+            joystick_seqlock_read(&bench->seqlock, &state);
+            in = state.report;
+        }
+        bench->samples[bench->sample_count++] = monotonic_ns() - start;
+        (void)in;
+        sleep_until(&deadline, bench->poll_period_us * 1000ull);
+    }
+    return NULL;
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void run(struct bench_t* bench)
+{
+    bench->sample_count = 0;
+    bench->updates = 0;
+    atomic_store(&bench->stop, false);
+
+    pthread_t writer_thread, reader_thread;
+    pthread_create(&writer_thread, NULL, writer, bench);
+    pthread_create(&reader_thread, NULL, reader, bench);
+    usleep((useconds_t)(bench->duration_s * 1e6));
+    atomic_store(&bench->stop, true);
+    pthread_join(writer_thread, NULL);
+    pthread_join(reader_thread, NULL);
+
+    uint64_t* s = bench->samples;
+    size_t n = bench->sample_count;
+    const char* name = bench->mode == BENCH_MUTEX ? "mutex" : "seqlock";
+    if (n == 0) {
+        printf("%-8s updates %8lu  no reads completed\n", name, (unsigned long)bench->updates);
+        return;
+    }
+    qsort(s, n, sizeof(s[0]), compare_u64);
+    printf("%-8s updates %8lu  reads %7zu  read ns: p50 %6lu  p99 %7lu  p99.9 %8lu  max %9lu\n",
+        name, (unsigned long)bench->updates, n, (unsigned long)s[n / 2],
+        (unsigned long)s[n * 99 / 100], (unsigned long)s[n * 999 / 1000], (unsigned long)s[n - 1]);
+}
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr,
+        "usage: %s [-r writer_hz] [-p poll_us] [-d seconds]\n"
+        "  -r  input updates per second, 0 floods (default 1000)\n"
+        "  -p  simulated host poll period in microseconds (default 125)\n"
+        "  -d  seconds per mode (default 3)\n",
+        argv0);
+}
+
+int main(int argc, char** argv)
+{
+    struct bench_t bench = {
+        .writer_rate_hz = 1000,
+        .poll_period_us = 125,
+        .duration_s = 3,
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:p:d:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            bench.writer_rate_hz = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            bench.poll_period_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            bench.duration_s = strtod(optarg, NULL);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    bench.debug_sink = fopen("/dev/null", "w");
+    if (bench.debug_sink == NULL || bench.poll_period_us == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    bench.sample_capacity = (size_t)(bench.duration_s * 1e6 / bench.poll_period_us) + 1;
+    bench.samples = calloc(bench.sample_capacity, sizeof(uint64_t));
+
+    printf("writer %u Hz, poll every %u us, %.1f s per mode\n", bench.writer_rate_hz,
+        bench.poll_period_us, bench.duration_s);
+    bench.mode = BENCH_MUTEX;
+    run(&bench);
+    bench.mode = BENCH_SEQLOCK;
+    run(&bench);
+
+    free(bench.samples);
+    fclose(bench.debug_sink);
+    return 0;
+}
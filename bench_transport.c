@@ -0,0 +1,380 @@
+// Loss-injection benchmark for the state transports: the TCP PAIR stream
+// against sequenced UDP datagrams.
+//
+// A sender produces one state update per tick (1 kHz by default) and sends it
+// the way beacon_server's send_state does: wire-encoded into a frame_pool and
+// sent on a PAIR socket over TCP, and as a standalone keyframe datagram on a
+// connected UDP socket. A receiver drains both each tick the way the device
+// does, through frame_recv and the wire decoder, asking for a keyframe when
+// the stream can't be applied, and records how old the newest state it holds
+// is, which is what the ep1 thread would hand the host at that moment.
+//
+// Loss is real: the bench moves into its own network namespace and routes
+// both transports through a TUN device it reflects back into the stack,
+// dropping -l percent of the IP packets in each direction, data and ACKs
+// alike. How long TCP takes to recover (fast retransmit, tail loss probes,
+// the RTO) is whatever the kernel does. Unprivileged runs need user
+// namespaces.
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <czmq.h>
+#include <fcntl.h>
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "frame_pool.h"
+#include "wire.h"
+
+// The namespace's only interface. Both ends live at LOCAL_ADDRESS and talk
+// to PEER_ADDRESS; the reflector turns a packet to one peer address into one
+// from the other, so each end sees the other at a peer address.
+#define TUN_NAME "bench0"
+#define LOCAL_ADDRESS 0x0a090001 // 10.9.0.1/16
+#define PEER_ADDRESS 0x0a090101 // 10.9.1.1, answered as 10.9.1.2
+
+struct reflector_t {
+    int fd;
+    atomic_uint loss_ppm; // 0 until both transports are up
+    atomic_bool stop;
+    uint64_t forwarded;
+    uint64_t dropped;
+};
+
+struct transport_stats_t {
+    const char* name;
+    struct wire_decoder_t decoder;
+    uint64_t delivered;
+    uint64_t stale;
+    uint64_t* ages;
+    size_t age_count;
+};
+
+static int compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static enum wire_result deliver(struct transport_stats_t* stats, const uint8_t* frame, size_t size)
+{
+    enum wire_result result = wire_decode_state(&stats->decoder, frame, size);
+    ++stats->delivered;
+    if (result == WIRE_IGNORED) {
+        ++stats->stale;
+    }
+    return result;
+}
+
+static void record_age(struct transport_stats_t* stats, uint64_t now_ns)
+{
+    if (stats->decoder.synced) {
+        uint32_t age_us = (uint32_t)(now_ns / 1000) - stats->decoder.sent_us;
+        stats->ages[stats->age_count++] = age_us * 1000ull;
+    }
+}
+
+static void report(struct transport_stats_t* stats)
+{
+    uint64_t* a = stats->ages;
+    size_t n = stats->age_count;
+    if (n == 0) {
+        printf("%-4s nothing delivered\n", stats->name);
+        return;
+    }
+    qsort(a, n, sizeof(a[0]), compare_u64);
+    printf("%-4s delivered %7lu  state age ms: p50 %7.3f  p99 %7.3f  p99.9 %7.3f  max %7.3f\n",
+        stats->name, (unsigned long)stats->delivered, a[n / 2] / 1e6, a[n * 99 / 100] / 1e6,
+        a[n * 999 / 1000] / 1e6, a[n - 1] / 1e6);
+}
+
+static uint16_t checksum(const void* data, size_t size, uint32_t sum)
+{
+    const uint8_t* bytes = data;
+    for (; size > 1; bytes += 2, size -= 2) {
+        sum += (uint32_t)bytes[0] << 8 | bytes[1];
+    }
+    if (size) {
+        sum += (uint32_t)bytes[0] << 8;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return htons(~sum & 0xffff);
+}
+
+// Turn LOCAL -> peer into other peer -> LOCAL and fix up the IP and TCP/UDP
+// checksums. False for anything that isn't ours to reflect.
+static bool reflect(uint8_t* packet, size_t size)
+{
+    if (size < 20 || packet[0] >> 4 != 4) {
+        return false;
+    }
+    size_t header_size = (packet[0] & 0xf) * 4;
+    size_t total = (size_t)packet[2] << 8 | packet[3];
+    if (header_size < 20 || total > size || total < header_size) {
+        return false;
+    }
+    uint32_t source, destination;
+    memcpy(&source, packet + 12, 4);
+    memcpy(&destination, packet + 16, 4);
+    destination ^= htonl(3); // 10.9.1.1 <-> 10.9.1.2
+    memcpy(packet + 12, &destination, 4);
+    memcpy(packet + 16, &source, 4);
+    memset(packet + 10, 0, 2);
+    uint16_t ip_sum = checksum(packet, header_size, 0);
+    memcpy(packet + 10, &ip_sum, 2);
+
+    uint8_t protocol = packet[9];
+    size_t sum_offset = protocol == IPPROTO_TCP ? 16 : protocol == IPPROTO_UDP ? 6 : 0;
+    uint8_t* payload = packet + header_size;
+    size_t payload_size = total - header_size;
+    if (sum_offset == 0 || payload_size < sum_offset + 2) {
+        return true;
+    }
+    memset(payload + sum_offset, 0, 2);
+    uint32_t pseudo = 0;
+    for (int i = 12; i < 20; i += 2) {
+        pseudo += (uint32_t)packet[i] << 8 | packet[i + 1];
+    }
+    pseudo += protocol + (uint32_t)payload_size;
+    uint16_t sum = checksum(payload, payload_size, pseudo);
+    if (protocol == IPPROTO_UDP && sum == 0) {
+        sum = 0xffff;
+    }
+    memcpy(payload + sum_offset, &sum, 2);
+    return true;
+}
+
+static void* reflector_thread(void* data)
+{
+    struct reflector_t* reflector = data;
+    uint8_t packet[65536];
+    unsigned seed = 1;
+    while (!atomic_load(&reflector->stop)) {
+        struct pollfd pollfd = { .fd = reflector->fd, .events = POLLIN };
+        if (poll(&pollfd, 1, 100) <= 0) {
+            continue;
+        }
+        ssize_t size = read(reflector->fd, packet, sizeof(packet));
+        if (size <= 0 || !reflect(packet, size)) {
+            continue;
+        }
+        if ((unsigned)rand_r(&seed) % 1000000 < atomic_load(&reflector->loss_ppm)) {
+            ++reflector->dropped;
+            continue;
+        }
+        ++reflector->forwarded;
+        if (write(reflector->fd, packet, size) < 0) {
+            perror("tun write");
+        }
+    }
+    return NULL;
+}
+
+// A private network namespace with the reflecting TUN device as its link to
+// PEER_ADDRESS. Must run before anything starts a thread.
+static bool reflector_open(struct reflector_t* reflector)
+{
+    int flags = CLONE_NEWNET | (geteuid() == 0 ? 0 : CLONE_NEWUSER);
+    if (unshare(flags) < 0) {
+        perror("unshare");
+        return false;
+    }
+    reflector->fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+    struct ifreq request = { .ifr_flags = IFF_TUN | IFF_NO_PI };
+    strcpy(request.ifr_name, TUN_NAME);
+    if (reflector->fd < 0 || ioctl(reflector->fd, TUNSETIFF, &request) < 0) {
+        perror("tun");
+        return false;
+    }
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in* address = (struct sockaddr_in*)&request.ifr_addr;
+    *address = (struct sockaddr_in) {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(LOCAL_ADDRESS),
+    };
+    bool ok = ioctl(sock, SIOCSIFADDR, &request) == 0;
+    address->sin_addr.s_addr = htonl(0xffff0000);
+    ok = ok && ioctl(sock, SIOCSIFNETMASK, &request) == 0;
+    request.ifr_flags = IFF_UP | IFF_RUNNING;
+    ok = ok && ioctl(sock, SIOCSIFFLAGS, &request) == 0;
+    close(sock);
+    if (!ok) {
+        perror("tun address");
+    }
+    return ok;
+}
+
+static bool udp_pair(int* sender, int* receiver)
+{
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(LOCAL_ADDRESS) };
+    socklen_t size = sizeof(address);
+    *receiver = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (*receiver < 0 || bind(*receiver, (struct sockaddr*)&address, size) < 0
+        || getsockname(*receiver, (struct sockaddr*)&address, &size) < 0) {
+        return false;
+    }
+    address.sin_addr.s_addr = htonl(PEER_ADDRESS);
+    *sender = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    return *sender >= 0 && connect(*sender, (struct sockaddr*)&address, size) == 0;
+}
+
+// Server side binds, device side connects, as in a session.
+static bool pair_pair(zsock_t** sender, zsock_t** receiver)
+{
+    *sender = zsock_new(ZMQ_PAIR);
+    frame_pool_setup_socket(*sender);
+    int port = zsock_bind(*sender, "tcp://%s:*", "10.9.0.1");
+    *receiver = zsock_new(ZMQ_PAIR);
+    if (port < 0 || zsock_connect(*receiver, "tcp://%s:%d", "10.9.1.1", port) < 0) {
+        return false;
+    }
+    zmq_pollitem_t item = { .socket = zsock_resolve(*sender), .events = ZMQ_POLLOUT };
+    return zmq_poll(&item, 1, 5000) == 1;
+}
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr,
+        "usage: %s [-r hz] [-d seconds] [-l loss_percent]\n"
+        "  -r  state updates per second (default 1000)\n"
+        "  -d  duration (default 10)\n"
+        "  -l  percentage of IP packets lost in each direction (default 1)\n",
+        argv0);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned rate_hz = 1000;
+    double duration_s = 10;
+    double loss_percent = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:d:l:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            rate_hz = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            duration_s = strtod(optarg, NULL);
+            break;
+        case 'l':
+            loss_percent = strtod(optarg, NULL);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (rate_hz == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct reflector_t reflector = { .fd = -1 };
+    if (!reflector_open(&reflector)) {
+        return 1;
+    }
+    pthread_t reflector_tid;
+    pthread_create(&reflector_tid, NULL, reflector_thread, &reflector);
+
+    zsock_t *pair_tx, *pair_rx;
+    int udp_tx, udp_rx;
+    if (!pair_pair(&pair_tx, &pair_rx) || !udp_pair(&udp_tx, &udp_rx)) {
+        perror("transports");
+        return 1;
+    }
+
+    size_t ticks = (size_t)(duration_s * rate_hz);
+    struct transport_stats_t tcp = { .name = "tcp", .ages = calloc(ticks, sizeof(uint64_t)) };
+    struct transport_stats_t udp = { .name = "udp", .ages = calloc(ticks, sizeof(uint64_t)) };
+    wire_decoder_init(&tcp.decoder);
+    wire_decoder_init(&udp.decoder);
+    static struct frame_pool_t frames;
+    struct wire_encoder_t pair_encoder, udp_encoder;
+    wire_encoder_init(&pair_encoder);
+    wire_encoder_init(&udp_encoder);
+    struct wire_state_t state = { .button_count = 14, .axis_count = 6 };
+    uint8_t frame[WIRE_MAX_FRAME];
+    uint64_t keyframe_requests = 0;
+    uint64_t pipe_full = 0;
+
+    atomic_store(&reflector.loss_ppm, (unsigned)(loss_percent * 10000));
+    uint64_t period_ns = 1000000000ull / rate_hz;
+    uint64_t deadline = monotonic_ns();
+
+    for (size_t tick = 1; tick <= ticks; ++tick) {
+        // a stick sweep: every update changes one axis, so PAIR carries deltas
+        state.time = (uint32_t)tick;
+        state.axes[0] = (int16_t)(tick * 64);
+
+        uint8_t* out = frame_pool_buffer(&frames);
+        size_t size = wire_encode_state(&pair_encoder, &state, out, WIRE_MAX_FRAME);
+        if (size > 0 && !frame_pool_send(&frames, pair_tx, size)) {
+            ++pipe_full;
+            wire_encoder_request_keyframe(&pair_encoder);
+        }
+        wire_encoder_request_keyframe(&udp_encoder);
+        size = wire_encode_state(&udp_encoder, &state, frame, sizeof(frame));
+        send(udp_tx, frame, size, MSG_DONTWAIT);
+
+        ssize_t got;
+        while ((got = recv(udp_rx, frame, sizeof(frame), 0)) >= 0) {
+            deliver(&udp, frame, got);
+        }
+        while ((got = frame_recv(pair_rx, frame)) > 0) {
+            if (deliver(&tcp, frame, got) == WIRE_NEED_KEYFRAME) {
+                ++keyframe_requests;
+                size = wire_encode_keyframe_request(frame, sizeof(frame));
+                zmq_send(zsock_resolve(pair_rx), frame, size, ZMQ_DONTWAIT);
+            }
+        }
+        while ((got = frame_recv(pair_tx, frame)) > 0) {
+            if (wire_frame_kind(frame, got) == WIRE_KEYFRAME_REQUEST) {
+                wire_encoder_request_keyframe(&pair_encoder);
+            }
+        }
+
+        uint64_t now = monotonic_ns();
+        record_age(&udp, now);
+        record_age(&tcp, now);
+
+        deadline += period_ns;
+        monotonic_sleep_until(deadline);
+    }
+    atomic_store(&reflector.loss_ppm, 0);
+    atomic_store(&reflector.stop, true);
+    pthread_join(reflector_tid, NULL);
+
+    printf("%u updates/s for %.1f s, %.2f%% packet loss: %lu packets dropped, %lu forwarded\n",
+        rate_hz, duration_s, loss_percent, (unsigned long)reflector.dropped,
+        (unsigned long)reflector.forwarded);
+    report(&tcp);
+    report(&udp);
+    printf("PAIR: %lu keyframe requests, %lu frames dropped on a full pipe\n",
+        (unsigned long)keyframe_requests, (unsigned long)pipe_full);
+
+    zsock_destroy(&pair_rx);
+    zsock_destroy(&pair_tx);
+    close(udp_tx);
+    close(udp_rx);
+    free(tcp.ages);
+    free(udp.ages);
+    return 0;
+}
@@ -0,0 +1,157 @@
+#define _GNU_SOURCE
+#include "capture.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "clock.h"
+
+// The file grows by this much whenever the mapping fills up.
+#define CAPTURE_GROW_BYTES (1 << 20)
+
+static size_t record_size(enum capture_kind kind)
+{
+    switch (kind) {
+    case CAPTURE_INPUT:
+        return offsetof(struct capture_record_t, pad) + sizeof(struct wire_state_t);
+    case CAPTURE_REPORT:
+        return offsetof(struct capture_record_t, report)
+            + sizeof(struct USB_JoystickReport_Input_t);
+    }
+    return 0;
+}
+
+static bool grow(struct capture_writer_t* writer)
+{
+    size_t size = writer->mapped + CAPTURE_GROW_BYTES;
+    if (ftruncate(writer->fd, size) < 0) {
+        perror("capture grow");
+        return false;
+    }
+    void* map = writer->map == NULL
+        ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, writer->fd, 0)
+        : mremap(writer->map, writer->mapped, size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+        perror("capture mmap");
+        return false;
+    }
+    writer->map = map;
+    writer->mapped = size;
+    writer->header = map;
+    return true;
+}
+
+bool capture_open(struct capture_writer_t* writer, const char* path, enum capture_kind kind)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->record_size = record_size(kind);
+    writer->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (writer->fd < 0) {
+        perror(path);
+        return false;
+    }
+    if (!grow(writer)) {
+        close(writer->fd);
+        return false;
+    }
+    memcpy(writer->header->magic, CAPTURE_MAGIC, sizeof(writer->header->magic));
+    writer->header->version = CAPTURE_VERSION;
+    writer->header->kind = kind;
+    writer->header->record_size = writer->record_size;
+    writer->header->start_ns = monotonic_ns();
+    writer->header->count = 0;
+    writer->used = sizeof(struct capture_header_t);
+    return true;
+}
+
+bool capture_append(struct capture_writer_t* writer, uint64_t ns, const void* payload)
+{
+    if (writer->used + writer->record_size > writer->mapped && !grow(writer)) {
+        return false;
+    }
+    uint8_t* record = writer->map + writer->used;
+    uint64_t offset = ns - writer->header->start_ns;
+    memcpy(record, &offset, sizeof(offset));
+    memcpy(record + sizeof(offset), payload, writer->record_size - sizeof(offset));
+    writer->used += writer->record_size;
+    ++writer->header->count; // only now is the record part of the capture
+    return true;
+}
+
+void capture_close(struct capture_writer_t* writer)
+{
+    if (writer->map != NULL) {
+        munmap(writer->map, writer->mapped);
+        writer->map = NULL;
+    }
+    if (writer->fd >= 0) {
+        if (ftruncate(writer->fd, writer->used) < 0) {
+            perror("capture trim");
+        }
+        close(writer->fd);
+        writer->fd = -1;
+    }
+}
+
+bool capture_map(struct capture_reader_t* reader, const char* path)
+{
+    memset(reader, 0, sizeof(*reader));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return false;
+    }
+    struct stat stat;
+    if (fstat(fd, &stat) < 0 || (size_t)stat.st_size < sizeof(struct capture_header_t)) {
+        fprintf(stderr, "%s: not a capture\n", path);
+        close(fd);
+        return false;
+    }
+    void* map = mmap(NULL, stat.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("capture mmap");
+        return false;
+    }
+    reader->map = map;
+    reader->size = stat.st_size;
+
+    const struct capture_header_t* header = map;
+    if (memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != CAPTURE_VERSION
+        || record_size(header->kind) == 0 || header->record_size != record_size(header->kind)) {
+        fprintf(stderr, "%s: not a version %d capture\n", path, CAPTURE_VERSION);
+        capture_unmap(reader);
+        return false;
+    }
+    reader->kind = header->kind;
+    reader->record_size = header->record_size;
+    // a capture cut short keeps every record its count covers that made it to disk
+    uint64_t fits = (reader->size - sizeof(*header)) / reader->record_size;
+    reader->count = header->count < fits ? header->count : fits;
+    return true;
+}
+
+void capture_unmap(struct capture_reader_t* reader)
+{
+    if (reader->map != NULL) {
+        munmap((void*)reader->map, reader->size);
+        reader->map = NULL;
+    }
+}
+
+bool capture_parse_kind(const char* name, enum capture_kind* kind)
+{
+    if (strcmp(name, "input") == 0) {
+        *kind = CAPTURE_INPUT;
+    } else if (strcmp(name, "report") == 0) {
+        *kind = CAPTURE_REPORT;
+    } else {
+        return false;
+    }
+    return true;
+}
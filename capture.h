@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "joystick_state.h"
+#include "wire.h"
+
+// Binary session captures, for replaying a session without a pad or server.
+//
+// A capture is a header followed by fixed-size records of one kind: either
+// the pad state of every state frame the device applied, before mapping, or
+// every report it published, after mapping. Each record carries its
+// CLOCK_MONOTONIC time relative to the start of the capture.
+//
+// The writer appends through a shared mapping of the file, so a record costs
+// a memcpy and the file is readable up to the last complete record even if
+// the process is killed mid-session: the header's record count is only bumped
+// once a record is in place. The file grows in 1 MB steps and capture_close
+// trims it back to the last record. The reader maps the file read-only and
+// hands out records in place.
+
+#define CAPTURE_MAGIC "FJCAPTUR"
+#define CAPTURE_VERSION 1
+
+enum capture_kind {
+    CAPTURE_INPUT = 1, // wire_state_t as received, replayed through the mapping
+    CAPTURE_REPORT = 2, // USB_JoystickReport_Input_t as published, replayed as is
+};
+
+struct capture_header_t {
+    char magic[8];
+    uint16_t version;
+    uint16_t kind;
+    uint32_t record_size;
+    uint64_t start_ns; // CLOCK_MONOTONIC when the capture was opened
+    uint64_t count; // complete records that follow
+} __attribute__((packed));
+
+struct capture_record_t {
+    uint64_t ns; // since start_ns
+    union {
+        struct wire_state_t pad;
+        struct USB_JoystickReport_Input_t report;
+    };
+} __attribute__((packed));
+
+struct capture_writer_t {
+    int fd;
+    uint8_t* map;
+    size_t mapped;
+    size_t used;
+    size_t record_size;
+    struct capture_header_t* header;
+};
+
+bool capture_open(struct capture_writer_t* writer, const char* path, enum capture_kind kind);
+// `payload` is a wire_state_t or a report, as the capture's kind says.
+bool capture_append(struct capture_writer_t* writer, uint64_t ns, const void* payload);
+void capture_close(struct capture_writer_t* writer);
+
+struct capture_reader_t {
+    const uint8_t* map;
+    size_t size;
+    enum capture_kind kind;
+    size_t record_size;
+    uint64_t count;
+};
+
+bool capture_map(struct capture_reader_t* reader, const char* path);
+void capture_unmap(struct capture_reader_t* reader);
+
+static inline const struct capture_record_t* capture_record(
+    const struct capture_reader_t* reader, uint64_t index)
+{
+    return (const struct capture_record_t*)(reader->map + sizeof(struct capture_header_t)
+        + index * reader->record_size);
+}
+
+bool capture_parse_kind(const char* name, enum capture_kind* kind);
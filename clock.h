@@ -0,0 +1,21 @@
+#pragma once
+
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+// Monotonic timestamp in nanoseconds, used for all latency accounting.
+static inline uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Sleep until monotonic_ns() reaches `ns`; returns at once if it already has.
+static inline void monotonic_sleep_until(uint64_t ns)
+{
+    struct timespec deadline = { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+    }
+}
@@ -7,41 +7,106 @@
 #include <linux/kernel.h>
 #include <linux/usb/ch9.h>
 #include <linux/usb/functionfs.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "capture.h"
+#include "clock.h"
+#include "ffs_aio.h"
+#include "frame_pool.h"
 #include "hid.h"
-
-#define HAT_TOP 0x00
-#define HAT_TOP_RIGHT 0x01
-#define HAT_RIGHT 0x02
-#define HAT_BOTTOM_RIGHT 0x03
-#define HAT_BOTTOM 0x04
-#define HAT_BOTTOM_LEFT 0x05
-#define HAT_LEFT 0x06
-#define HAT_TOP_LEFT 0x07
-#define HAT_CENTER 0x08
-
-const char* hat_mapping[9] = {
-    "HAT_TOP",
-    "HAT_TOP_RIGHT",
-    "HAT_RIGHT",
-    "HAT_BOTTOM_RIGHT",
-    "HAT_BOTTOM",
-    "HAT_BOTTOM_LEFT",
-    "HAT_LEFT",
-    "HAT_TOP_LEFT",
-    "HAT_CENTER",
-};
+#include "joystick_state.h"
+#include "latency.h"
+#include "log.h"
+#include "macro.h"
+#include "mapping.h"
+#include "output.h"
+#include "poll_phase.h"
+#include "procon.h"
+#include "profile.h"
+#include "rt.h"
+#include "wire.h"
 
 #define USB_FUNCTIONFS_EVENT_BUFFER 4
+// Entries in each instance's generation -> frame seq ring.
+#define UPLINK_SEQ_RING 256
+// Instance 0's FunctionFS; instance n > 0 is mounted at this path plus n.
 #define FUNCTIONFS_MOUNT_POINT "/tmp/mount_point"
+#define DEVICE_MAX_INSTANCES 8
+
+struct device_options_t {
+    // Keep the queued ep1 report replaced with the newest state instead of
+    // blocking in write() on a snapshot taken before the previous poll.
+    bool latest_state;
+    // Number of ep1 reports kept queued through AIO; 0 uses blocking threads.
+    size_t aio_depth;
+    // Run everything from one epoll loop on the main thread.
+    bool reactor;
+    // Ask the server to stream state over UDP instead of the PAIR socket.
+    bool udp;
+    // Dump latency histograms this often (s); 0 dumps only on SIGUSR1.
+    unsigned stats_interval;
+    // Where reports go; the options above only apply to FunctionFS.
+    const struct output_backend_t* backend;
+    // Mapping profile; NULL for the built-in one.
+    const char* mapping_path;
+    // Controllers emulated by this process, each with its own function
+    // instance, server session and threads.
+    unsigned instance_count;
+    // CPU each instance's threads are pinned to; -1 leaves them unpinned.
+    int cpus[DEVICE_MAX_INSTANCES];
+    // Capture every applied state frame or published report here.
+    const char* capture_path;
+    enum capture_kind capture_kind;
+    // Replay this capture instead of pairing with a server, this many times
+    // (0: forever).
+    const char* replay_path;
+    unsigned replay_passes;
+    // Play this macro from the host's first poll, ahead of any input.
+    const char* macro_path;
+    // Threaded ep1: sample each report this long (us) before the host's next
+    // poll is due instead of right after the previous one; 0 is off.
+    unsigned sample_lead_us;
+    // The controller presented on FunctionFS: descriptors and report layout.
+    const struct profile_t* profile;
+};
+
+static struct device_options_t g_options = {
+    .latest_state = false,
+    .aio_depth = 0,
+    .reactor = false,
+    .udp = false,
+    .stats_interval = 0,
+    .backend = &g_ffs_backend,
+    .mapping_path = NULL,
+    .instance_count = 1,
+    .cpus = { -1, -1, -1, -1, -1, -1, -1, -1 },
+    .capture_path = NULL,
+    .capture_kind = CAPTURE_INPUT,
+    .replay_path = NULL,
+    .replay_passes = 1,
+    .macro_path = NULL,
+    .sample_lead_us = 0,
+    .profile = &g_profile_horipad,
+};
+
+struct output_config_t g_output_config = {
+    .record_path = NULL,
+    .poll_us = 2000, // the high-speed IN endpoint's bInterval: 2^(5-1) microframes
+};
 
 #define cpu_to_le16(x) (x)
 #define cpu_to_le32(x) (x)
@@ -66,198 +131,10 @@ static const char* const names[] = {
 //5
 #define STRINGID_INTERFACE 0
 
-#define STRING_MFGR "HORI CO.,LTD."
-#define STRING_PRODUCT "POKKEN CONTROLLER"
 #define STRING_SERIAL "69420"
 #define STRING_CONFIG "fakejoycon"
 #define STRING_INTERFACE ""
 
-// const uint8_t hid_report_descriptor[] = {
-// 	HID_RI_USAGE_PAGE(8,1), /* Generic Desktop */
-// 	HID_RI_USAGE(8,5), /* Joystick */
-// 	HID_RI_COLLECTION(8,1), /* Application */
-// 		// Buttons (2 bytes)
-// 		HID_RI_LOGICAL_MINIMUM(8,0),
-// 		HID_RI_LOGICAL_MAXIMUM(8,1),
-// 		HID_RI_PHYSICAL_MINIMUM(8,0),
-// 		HID_RI_PHYSICAL_MAXIMUM(8,1),
-// 		// The Switch will allow us to expand the original HORI descriptors to a full 16 buttons.
-// 		// The Switch will make use of 14 of those buttons.
-// 		HID_RI_REPORT_SIZE(8,1),
-// 		HID_RI_REPORT_COUNT(8,16),
-// 		HID_RI_USAGE_PAGE(8,9),
-// 		HID_RI_USAGE_MINIMUM(8,1),
-// 		HID_RI_USAGE_MAXIMUM(8,16),
-// 		HID_RI_INPUT(8,2),
-// 		// HAT Switch (1 nibble)
-// 		HID_RI_USAGE_PAGE(8,1),
-// 		HID_RI_LOGICAL_MAXIMUM(8,7),
-// 		HID_RI_PHYSICAL_MAXIMUM(16,315),
-// 		HID_RI_REPORT_SIZE(8,4),
-// 		HID_RI_REPORT_COUNT(8,1),
-// 		HID_RI_UNIT(8,20),
-// 		HID_RI_USAGE(8,57),
-// 		HID_RI_INPUT(8,66),
-// 		// There's an additional nibble here that's utilized as part of the Switch Pro Controller.
-// 		// I believe this -might- be separate U/D/L/R bits on the Switch Pro Controller, as they're utilized as four button descriptors on the Switch Pro Controller.
-// 		HID_RI_UNIT(8,0),
-// 		HID_RI_REPORT_COUNT(8,1),
-// 		HID_RI_INPUT(8,1),
-// 		// Joystick (4 bytes)
-// 		HID_RI_LOGICAL_MAXIMUM(16,255),
-// 		HID_RI_PHYSICAL_MAXIMUM(16,255),
-// 		HID_RI_USAGE(8,48),
-// 		HID_RI_USAGE(8,49),
-// 		HID_RI_USAGE(8,50),
-// 		HID_RI_USAGE(8,53),
-// 		HID_RI_REPORT_SIZE(8,8),
-// 		HID_RI_REPORT_COUNT(8,4),
-// 		HID_RI_INPUT(8,2),
-// 		// ??? Vendor Specific (1 byte)
-// 		// This byte requires additional investigation.
-// 		HID_RI_USAGE_PAGE(16,65280),
-// 		HID_RI_USAGE(8,32),
-// 		HID_RI_REPORT_COUNT(8,1),
-// 		HID_RI_INPUT(8,2),
-// 		// Output (8 bytes)
-// 		// Original observation of this suggests it to be a mirror of the inputs that we sent.
-// 		// The Switch requires us to have these descriptors available.
-// 		HID_RI_USAGE(16,9761),
-// 		HID_RI_REPORT_COUNT(8,8),
-// 		HID_RI_OUTPUT(8,2),
-// 	HID_RI_END_COLLECTION(0),
-// };
-
-const uint8_t hid_report_descriptor[80] = {
-    0x05, 0x01,                    // USAGE_PAGE (Generic Desktop)
-    0x09, 0x05,                    // USAGE (Game Pad)
-    0xa1, 0x01,                    // COLLECTION (Application)
-    0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
-    0x25, 0x01,                    //   LOGICAL_MAXIMUM (1)
-    0x35, 0x00,                    //   PHYSICAL_MINIMUM (0)
-    0x45, 0x01,                    //   PHYSICAL_MAXIMUM (1)
-    0x75, 0x01,                    //   REPORT_SIZE (1)
-    0x95, 0x0e,                    //   REPORT_COUNT (14)
-    0x05, 0x09,                    //   USAGE_PAGE (Button)
-    0x19, 0x01,                    //   USAGE_MINIMUM (Button 1)
-    0x29, 0x0e,                    //   USAGE_MAXIMUM (Button 14)
-    0x81, 0x02,                    //   INPUT (Data,Var,Abs)
-    0x95, 0x02,                    //   REPORT_COUNT (2)
-    0x81, 0x01,                    //   INPUT (Cnst,Ary,Abs)
-    0x05, 0x01,                    //   USAGE_PAGE (Generic Desktop)
-    0x25, 0x07,                    //   LOGICAL_MAXIMUM (7)
-    0x46, 0x3b, 0x01,              //   PHYSICAL_MAXIMUM (315)
-    0x75, 0x04,                    //   REPORT_SIZE (4)
-    0x95, 0x01,                    //   REPORT_COUNT (1)
-    0x65, 0x14,                    //   UNIT (Eng Rot:Angular Pos)
-    0x09, 0x39,                    //   USAGE (Hat switch)
-    0x81, 0x42,                    //   INPUT (Data,Var,Abs,Null)
-    0x65, 0x00,                    //   UNIT (None)
-    0x95, 0x01,                    //   REPORT_COUNT (1)
-    0x81, 0x01,                    //   INPUT (Cnst,Ary,Abs)
-    0x26, 0xff, 0x00,              //   LOGICAL_MAXIMUM (255)
-    0x46, 0xff, 0x00,              //   PHYSICAL_MAXIMUM (255)
-    0x09, 0x30,                    //   USAGE (X)
-    0x09, 0x31,                    //   USAGE (Y)
-    0x09, 0x32,                    //   USAGE (Z)
-    0x09, 0x35,                    //   USAGE (Rz)
-    0x75, 0x08,                    //   REPORT_SIZE (8)
-    0x95, 0x04,                    //   REPORT_COUNT (4)
-    0x81, 0x02,                    //   INPUT (Data,Var,Abs)
-    0x75, 0x08,                    //   REPORT_SIZE (8)
-    0x95, 0x01,                    //   REPORT_COUNT (1)
-    0x81, 0x01,                    //   INPUT (Cnst,Ary,Abs)
-    0xc0                           // END_COLLECTION
-};
-
-// const uint8_t hid_report_descriptor[80] = {
-//     0x05, 0x01, // USAGE_PAGE (Generic Desktop)
-//     0x09, 0x05, // USAGE (Game Pad)
-//     0xa1, 0x01, // COLLECTION (Application)
-//     0x15, 0x00, //   LOGICAL_MINIMUM (0)
-//     0x25, 0x01, //   LOGICAL_MAXIMUM (1)
-//     0x35, 0x00, //   PHYSICAL_MINIMUM (0)
-//     0x45, 0x01, //   PHYSICAL_MAXIMUM (1)
-//     0x75, 0x01, //   REPORT_SIZE (1)
-//     0x95, 0x0e, //   REPORT_COUNT (14)
-//     0x05, 0x09, //   USAGE_PAGE (Button)
-//     0x19, 0x01, //   USAGE_MINIMUM (Button 1)
-//     0x29, 0x0e, //   USAGE_MAXIMUM (Button 14)
-//     0x81, 0x02, //   INPUT (Data,Var,Abs)
-//     0x95, 0x02, //   REPORT_COUNT (2)
-//     0x81, 0x01, //   INPUT (Cnst,Ary,Abs)
-//     0x05, 0x01, //   USAGE_PAGE (Generic Desktop)
-//     0x25, 0x07, //   LOGICAL_MAXIMUM (7)
-//     0x46, 0x3b, 0x01, //   PHYSICAL_MAXIMUM (315)
-//     0x75, 0x04, //   REPORT_SIZE (4)
-//     0x95, 0x01, //   REPORT_COUNT (1)
-//     0x65, 0x14, //   UNIT (Eng Rot:Angular Pos)
-//     0x09, 0x39, //   USAGE (Hat switch)
-//     0x81, 0x42, //   INPUT (Data,Var,Abs,Null)
-//     0x65, 0x00, //   UNIT (None)
-//     0x95, 0x01, //   REPORT_COUNT (1)
-//     0x81, 0x01, //   INPUT (Cnst,Ary,Abs)
-//     0x26, 0xff, 0x00, //   LOGICAL_MAXIMUM (255)
-//     0x46, 0xff, 0x00, //   PHYSICAL_MAXIMUM (255)
-//     0x09, 0x30, //   USAGE (X)
-//     0x09, 0x31, //   USAGE (Y)
-//     0x09, 0x32, //   USAGE (Z)
-//     0x09, 0x35, //   USAGE (Rz)
-//     0x75, 0x08, //   REPORT_SIZE (8)
-//     0x95, 0x04, //   REPORT_COUNT (4)
-//     0x81, 0x02, //   INPUT (Data,Var,Abs)
-//     0x75, 0x08, //   REPORT_SIZE (8)
-//     0x95, 0x01, //   REPORT_COUNT (1)
-//     0x81, 0x03, //   INPUT (Cnst,Var,Abs)
-//     0xc0 //     END_COLLECTION
-// };
-
- // const uint8_t hid_report_descriptor[] = {
- //     0x05, 0x01, // Usage Page (Generic Desktop Ctrls)
- //     0x09, 0x04, // Usage (Joystick)
- //     0xA1, 0x01, // Collection (Application)
- //     0x15, 0x00, //   Logical Minimum (0)
- //     0x25, 0x01, //   Logical Maximum (1)
- //     0x35, 0x00, //   Physical Minimum (0)
- //     0x45, 0x01, //   Physical Maximum (1)
- //     0x75, 0x01, //   Report Size (1)
- //     0x95, 0x10, //   Report Count (16)
- //     0x05, 0x09, //   Usage Page (Button)
- //     0x19, 0x01, //   Usage Minimum (0x01)
- //     0x29, 0x10, //   Usage Maximum (0x10)
- //     0x81, 0x02, //   Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position)
- //     0x05, 0x01, //   Usage Page (Generic Desktop Ctrls)
- //     0x25, 0x07, //   Logical Maximum (7)
- //     0x46, 0x3B, 0x01, //   Physical Maximum (315)
- //     0x75, 0x04, //   Report Size (4)
- //     0x95, 0x01, //   Report Count (1)
- //     0x65, 0x14, //   Unit (System: English Rotation, Length: Centimeter)
- //     0x09, 0x39, //   Usage (Hat switch)
- //     0x81, 0x42, //   Input (Data,Var,Abs,No Wrap,Linear,Preferred State,Null State)
- //     0x65, 0x00, //   Unit (None)
- //     0x95, 0x01, //   Report Count (1)
- //     0x81, 0x01, //   Input (Const,Array,Abs,No Wrap,Linear,Preferred State,No Null Position)
- //     0x26, 0xFF, 0x00, //   Logical Maximum (255)
- //     0x46, 0xFF, 0x00, //   Physical Maximum (255)
- //     0x09, 0x30, //   Usage (X)
- //     0x09, 0x31, //   Usage (Y)
- //     0x09, 0x32, //   Usage (Z)
- //     0x09, 0x35, //   Usage (Rz)
- //     0x75, 0x08, //   Report Size (8)
- //     0x95, 0x04, //   Report Count (4)
- //     0x81, 0x02, //   Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position)
- //     0x06, 0x00, 0xFF, //   Usage Page (Vendor Defined 0xFF00)
- //     0x09, 0x20, //   Usage (0x20)
- //     0x95, 0x01, //   Report Count (1)
- //     0x81, 0x02, //   Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position)
- //     0x0A, 0x21, 0x26, //   Usage (0x2621)
- //     0x95, 0x08, //   Report Count (8)
- //     0x91,
- //     0x02, //   Output (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
- //     0xC0, // End Collection
- // };
- // // 86 bytes
-
 struct hid_descriptor {
     __u8 bLength;
     __u8 bDescriptorType;
@@ -272,8 +149,6 @@ static const struct {
     struct usb_functionfs_strings_head header;
     struct {
         __le16 code;
-        //const char str1[sizeof STRING_MFGR];
-        //const char str2[sizeof STRING_PRODUCT];
         //const char str3[sizeof STRING_SERIAL];
         //const char str4[sizeof STRING_CONFIG];
         const char str5[sizeof STRING_INTERFACE];
@@ -287,8 +162,6 @@ static const struct {
     },
     .english_stringtab = {
         cpu_to_le16(0x0409), /* en-us */
-        //STRING_MFGR,
-        //STRING_PRODUCT,
         //STRING_SERIAL,
         //STRING_CONFIG,
         STRING_INTERFACE
@@ -305,7 +178,7 @@ static const struct {
 //     struct hid_class_descriptor desc[1];
 // } __attribute__((packed));
 
-static const struct {
+static const struct ffs_descriptors_t {
     struct usb_functionfs_descs_head_v2 header;
     __le32 hs_count;
     //__le32 ss_count;
@@ -340,7 +213,7 @@ static const struct {
              .bCountryCode = 0x00,
              .bNumDescriptors = 1,
              .bReportType = HID_DT_REPORT,
-             .wReportLength = __constant_cpu_to_le16(sizeof(hid_report_descriptor)),
+             .wReportLength = 0, // the profile's; see write_descriptors()
          },
         .hid_in_ep = {
             .bLength = sizeof descriptors.hs_descs.hid_in_ep,
@@ -348,7 +221,9 @@ static const struct {
             .bEndpointAddress = 0x81, // 1 | USB_DIR_IN,
             .bmAttributes = USB_ENDPOINT_XFER_INT,
             .wMaxPacketSize = cpu_to_le16(0x40), // switch mandates 64 bytes allegedly
-            .bInterval = 5, // TODO what does this mean, it's for interrupt endpoints
+            // 2^(5-1) microframes, so the host may poll every 2 ms at high speed; what it
+            // actually does is measured from the completions, see poll_phase.h
+            .bInterval = 5,
         },
         .hid_out_ep = {
             .bLength = sizeof descriptors.hs_descs.hid_out_ep,
@@ -356,18 +231,26 @@ static const struct {
             .bEndpointAddress = 4,//0x02,
             .bmAttributes = USB_ENDPOINT_XFER_INT,
             .wMaxPacketSize = cpu_to_le16(0x40), // switch mandates 64 bytes allegedly
-            .bInterval = 5 // TODO what does this mean, it's for interrupt endpoints
+            .bInterval = 5 // as hid_in_ep
         },
     },
 };
 
+// Hand FunctionFS the descriptors and strings, with the HID descriptor
+// pointing at the profile's report descriptor.
+void write_descriptors(int fd)
+{
+    struct ffs_descriptors_t profile_descriptors = descriptors;
+    profile_descriptors.hs_descs.hid_desc.wReportLength
+        = cpu_to_le16(g_options.profile->report_descriptor_size);
+    ssize_t written = write(fd, &profile_descriptors, sizeof profile_descriptors);
+    printf("wrote desc: %li\n", written);
+    written = write(fd, &strings, sizeof strings);
+    printf("wrote strings: %li\n", written);
+}
+
 void handle_setup(int fd, const struct usb_ctrlrequest* setup)
 {
-    printf("bRequestType = %d\n", setup->bRequestType);
-    printf("bRequest     = %d\n", setup->bRequest);
-    printf("wValue       = %d\n", le16_to_cpu(setup->wValue));
-    printf("wIndex       = %d\n", le16_to_cpu(setup->wIndex));
-    printf("wLength      = %d\n", le16_to_cpu(setup->wLength));
     int status;
     __u16 value, index, length;
 
@@ -375,10 +258,8 @@ void handle_setup(int fd, const struct usb_ctrlrequest* setup)
     index = __le16_to_cpu(setup->wIndex);
     length = __le16_to_cpu(setup->wLength);
 
-    fprintf(stderr,
-        "SETUP %02x.%02x "
-        "v%04x i%04x %d\n",
-        setup->bRequestType, setup->bRequest, value, index, length);
+    LOG_DEBUG("SETUP %02x.%02x v%04x i%04x %d", setup->bRequestType, setup->bRequest, value, index,
+        length);
 
     /*
     if ((setup->bRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD)
@@ -387,19 +268,20 @@ void handle_setup(int fd, const struct usb_ctrlrequest* setup)
 
     switch (setup->bRequest) { /* usb 2.0 spec ch9 requests */
     case USB_REQ_GET_DESCRIPTOR:
-        printf("USB_REQ_GET_DESCRIPTOR\n");
+        LOG_DEBUG("USB_REQ_GET_DESCRIPTOR");
         // if (setup->bRequestType != USB_DIR_IN)
         //    goto stall;
         switch (value >> 8) {
         case HID_DT_REPORT:
-            status = write(fd, hid_report_descriptor, sizeof(hid_report_descriptor));
+            status = write(fd, g_options.profile->report_descriptor,
+                g_options.profile->report_descriptor_size);
             if (status < 0) {
                 if (errno == EIDRM)
-                    printf("string timeout\n");
+                    LOG_WARNING("string timeout");
                 else
-                    printf("other errno: wrote report desc\n");
-            } else if (status != sizeof(hid_report_descriptor)) {
-                fprintf(stderr, "short string write, %d\n", status);
+                    LOG_WARNING("other errno: wrote report desc");
+            } else if (status != g_options.profile->report_descriptor_size) {
+                LOG_WARNING("short string write, %d", status);
             }
             break;
         default:
@@ -407,13 +289,12 @@ void handle_setup(int fd, const struct usb_ctrlrequest* setup)
         }
         break;
     case USB_REQ_SET_CONFIGURATION:
-        printf("USB_REQ_SET_CONFIGURATION\n");
-        printf("CONFIG #%d\n", value);
+        LOG_INFO("USB_REQ_SET_CONFIGURATION: CONFIG #%d", value);
         break;
     case USB_REQ_GET_INTERFACE:
-        printf("USB_REQ_GET_INTERFACE\n");
+        LOG_DEBUG("USB_REQ_GET_INTERFACE");
         if (setup->bRequestType != (USB_DIR_IN | USB_RECIP_INTERFACE) || index != 0 || length > 1) {
-            printf("Assumptoins violated\n");
+            LOG_WARNING("Assumptoins violated");
             goto stall;
         }
         char b = 0;
@@ -424,17 +305,17 @@ void handle_setup(int fd, const struct usb_ctrlrequest* setup)
             status = errno;
             perror ("reset source fd");
         }
-        printf("USB_REQ_SET_INTERFACE");
+        LOG_DEBUG("USB_REQ_SET_INTERFACE");
         break;
     default:
-        printf("OTHER SETUP");
+        LOG_DEBUG("OTHER SETUP");
         goto stall;
     }
 
     return;
 
 stall:
-    fprintf(stderr, "... protocol stall %02x.%02x\n", setup->bRequestType, setup->bRequest);
+    LOG_INFO("... protocol stall %02x.%02x", setup->bRequestType, setup->bRequest);
 
     /* non-iso endpoints are stalled by issuing an i/o request
      * in the "wrong" direction.  ep0 is special only because
@@ -445,7 +326,7 @@ stall:
     else
         status = write(fd, &status, 0);
     if (status != -1)
-        fprintf(stderr, "can't stall ep0 for %02x.%02x\n", setup->bRequestType, setup->bRequest);
+        LOG_ERROR("can't stall ep0 for %02x.%02x", setup->bRequestType, setup->bRequest);
     else
         perror("ep0 stall");
 }
@@ -477,44 +358,91 @@ void* thread_run_body(void* usb_endpoint_thread_void)
     return NULL;
 }
 
-void thread_run(struct usb_endpoint_thread_t* thread)
+// Start a thread, pinned to `cpu` unless it is negative, with the scheduling
+// -R gives its role.
+bool thread_start(pthread_t* pthread, void* (*body)(void*), void* arg, int cpu, enum rt_role role)
 {
-    pthread_create(&thread->pthread, 0, thread_run_body, (void*)thread);
+    return rt_thread_start(&g_rt_config, pthread, body, arg, cpu, role);
 }
 
-// Joystick HID report structure. We have an input and an output.
-struct USB_JoystickReport_Input_t {
-    uint16_t Button; // 16 buttons; see JoystickButtons_t for bit mapping
-    uint8_t HAT; // HAT switch; one nibble w/ unused nibble
-    uint8_t LX; // Left  Stick X
-    uint8_t LY; // Left  Stick Y
-    uint8_t RX; // Right Stick X
-    uint8_t RY; // Right Stick Y
-    uint8_t VendorSpec;
-};
+void thread_run(struct usb_endpoint_thread_t* thread, int cpu, enum rt_role role)
+{
+    thread_start(&thread->pthread, thread_run_body, thread, cpu, role);
+}
 
-// The output is structured as a mirror of the input.
-// This is based on initial observations of the Pokken Controller.
-struct USB_JoystickReport_Output_t {
-    uint16_t Button; // 16 buttons; see JoystickButtons_t for bit mapping
-    uint8_t HAT; // HAT switch; one nibble w/ unused nibble
-    uint8_t LX; // Left  Stick X
-    uint8_t LY; // Left  Stick Y
-    uint8_t RX; // Right Stick X
-    uint8_t RY; // Right Stick Y
+// Working state of one emulated controller. The channel comes first: the
+// output side only ever sees that part, and a setup_fn's &data holding the
+// channel is how the endpoint threads find their instance. The rest belongs
+// to the comm thread and starts on a cache line of its own.
+struct reactor_t;
+
+struct device_instance_t {
+    struct output_channel_t channel;
+    char mount_point[64];
+    int cpu;
+    const char* replay_path;
+
+    // Working copy of the controller state, owned by the comm thread. It is
+    // edited freely and then its report published through channel.state.
+    _Alignas(CACHE_LINE_SIZE) struct mapping_output_t joystick_data;
+    uint32_t joystick_data_generation;
+    // Raw pad state last applied, in joystick API numbering.
+    struct wire_state_t pad_state;
+    bool pad_state_valid;
+    struct wire_decoder_t wire_decoder;
+    struct latency_offset_t wire_offset;
+    uint64_t keyframe_requested_ns; // 0 unless a keyframe request is outstanding
+    // Generation -> frame seq, for the report acks; see report_delivered.
+    uint16_t published_seq[UPLINK_SEQ_RING];
+    uint32_t reports_acked; // channel.reports_delivered as of the last ack
+    uint32_t rumble_forwarded; // channel.rumble_changes as of the last WIRE_RUMBLE
+    // Address of the paired server, for the UDP transport.
+    char server_ip[64];
+    int udp_fd;
+    zmq_pollitem_t udp_pollitem;
+    zmq_pollitem_t uplink_pollitem;
+    // The session's socket, NULL between sessions, with the buffers frames
+    // are sent from and received into.
+    zsock_t* paired;
+    struct frame_pool_t frames;
+    uint8_t frame[WIRE_MAX_FRAME];
+    // Reactor mode only.
+    struct reactor_t* reactor;
+    // The server endpoint this instance is paired with; guarded by
+    // g_endpoints_lock, see endpoint_claim.
+    char endpoint[128];
+    // The server's session token, 0 before the first session; presented on
+    // every pairing so a dropped session resumes. See wire_session_t.
+    uint32_t session_token;
+    bool session_live; // the server confirmed a session on this connection
+    bool capturing;
+    struct capture_writer_t capture;
+    // Pro Controller protocol state, shared by the ep1 and ep2 threads; procon
+    // profile only.
+    struct procon_t procon;
 };
 
+struct device_instance_t g_instances[DEVICE_MAX_INSTANCES];
+
+// On entry a setup_fn's &data holds the channel of the instance it serves.
+struct device_instance_t* setup_instance(void* data)
+{
+    return (struct device_instance_t*)*(struct output_channel_t**)data;
+}
+
 struct ep2_data_t {
+    struct device_instance_t* instance;
     int fd;
 };
 
 bool ep2_setup(void* data)
 {
     struct ep2_data_t** ep2_data_ptr = data;
+    struct device_instance_t* instance = setup_instance(data);
     printf("ep2 setup\n");
 
     char* ep2_path;
-    int r = asprintf(&ep2_path, "%s/%s", FUNCTIONFS_MOUNT_POINT, "ep2");
+    int r = asprintf(&ep2_path, "%s/%s", instance->mount_point, "ep2");
     if (r <= 0) {
         printf("ep2_path alloc failed\n");
         return false;
@@ -530,6 +458,7 @@ bool ep2_setup(void* data)
 
     struct ep2_data_t* ep2_data;
     ep2_data = malloc(sizeof(struct ep2_data_t));
+    ep2_data->instance = instance;
     ep2_data->fd = fd;
 
     printf("ep2 thread finished initial setup: %i\n", ep2_data->fd);
@@ -557,37 +486,108 @@ void ep2_cleanup(void* data)
     *ep2_ptr_ptr = NULL;
 }
 
+// An OUT report from the host, on whichever thread serves ep2. The host
+// repeats its rumble in report after report; a change is noted in the channel
+// and the comm thread woken to forward it to the server.
+void output_received(struct output_channel_t* channel, const uint8_t* data, size_t size)
+{
+    profile_rumble_fn rumble = g_options.profile->rumble;
+    uint16_t strong, weak;
+    if (rumble == NULL || !rumble(data, size, &strong, &weak)) {
+        return;
+    }
+    uint32_t value = (uint32_t)strong << 16 | weak;
+    if (value == atomic_load_explicit(&channel->rumble, memory_order_relaxed)) {
+        return;
+    }
+    atomic_store_explicit(&channel->rumble_ns, monotonic_ns(), memory_order_relaxed);
+    atomic_store_explicit(&channel->rumble, value, memory_order_relaxed);
+    atomic_fetch_add_explicit(&channel->rumble_changes, 1, memory_order_release);
+    eventfd_write(channel->uplink_eventfd, 1);
+}
+
 bool ep2_loop(void* ep2_data_void)
 {
     struct ep2_data_t* ep2_data = ep2_data_void;
 
-    struct USB_JoystickReport_Output_t output = { 0 };
+    uint8_t output[PROFILE_MAX_REPORT];
 
-    printf("ep2 read start \n");
-    ssize_t bytes_read = read(ep2_data->fd, &output, sizeof(output));
-    printf("e2 bytes read: %lu \n", bytes_read);
+    ssize_t bytes_read = read(ep2_data->fd, output, sizeof(output));
+    LOG_DEBUG("e2 bytes read: %zi", bytes_read);
+    if (bytes_read > 0) {
+        output_received(&ep2_data->instance->channel, output, bytes_read);
+    }
     int status;
     write(ep2_data->fd, &status, 0);
 
     return true;
 }
 
-struct USB_JoystickReport_Input_t g_joystick_data;
-pthread_mutex_t g_joystick_data_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Pro Controller: every OUT report goes to the protocol, which queues the
+// replies for ep1.
+bool procon_ep2_loop(void* ep2_data_void)
+{
+    struct ep2_data_t* ep2_data = ep2_data_void;
+
+    uint8_t output[PROCON_REPORT_SIZE];
+    ssize_t bytes_read = read(ep2_data->fd, output, sizeof(output));
+    if (bytes_read < 0) {
+        LOG_ERROR("EP2: read failed: errno %d", errno);
+        return false;
+    }
+    LOG_DEBUG("e2 %02x %02x, %zi bytes", output[0], output[1], bytes_read);
+    procon_output(&ep2_data->instance->procon, output, bytes_read);
+    output_received(&ep2_data->instance->channel, output, bytes_read);
+    return true;
+}
+
+// For every input change that reaches the host: the time from handler()
+// publishing it to the completion of the first ep1 transfer carrying it.
+// Uplink back to the comm thread: once the server asks for report acks, every
+// delivered input change is noted in the channel and the comm thread woken to
+// tell the server about it.
+void report_delivered(struct output_channel_t* channel, uint32_t* delivered_generation,
+    uint32_t generation, uint64_t stamp)
+{
+    if (generation == *delivered_generation) {
+        return; // nothing new reached the host
+    }
+    *delivered_generation = generation;
+    latency_record(LATENCY_PUBLISH_TO_USB, monotonic_ns() - stamp);
+
+    if (atomic_load_explicit(&channel->report_acks, memory_order_relaxed)) {
+        atomic_store_explicit(&channel->delivered_generation, generation, memory_order_relaxed);
+        atomic_fetch_add_explicit(&channel->reports_delivered, 1, memory_order_relaxed);
+        eventfd_write(channel->uplink_eventfd, 1);
+    }
+}
+
+void next_report(struct output_channel_t* channel, uint32_t delivered_generation,
+    struct joystick_state_t* state)
+{
+    joystick_seqlock_read(&channel->state, state);
+    if (macro_next(&channel->macro, &state->report)) {
+        state->generation = delivered_generation;
+    }
+}
 
 struct ep1_data_t {
+    struct device_instance_t* instance;
     int fd;
     struct USB_JoystickReport_Input_t* joystick_data;
-    pthread_mutex_t* joystick_data_mutex;
+    profile_pack_fn pack;
+    uint32_t delivered_generation;
+    struct poll_phase_t phase;
 };
 
 bool ep1_setup(void* data)
 {
     struct ep1_data_t** ep1_data_ptr = data;
+    struct device_instance_t* instance = setup_instance(data);
     printf("ep1 setup\n");
 
     char* ep1_path;
-    int r = asprintf(&ep1_path, "%s/%s", FUNCTIONFS_MOUNT_POINT, "ep1");
+    int r = asprintf(&ep1_path, "%s/%s", instance->mount_point, "ep1");
     if (r <= 0) {
         printf("ep1_path alloc failed\n");
         return false;
@@ -602,9 +602,12 @@ bool ep1_setup(void* data)
     }
 
     struct ep1_data_t* ep1_data;
-    ep1_data = malloc(sizeof(struct ep1_data_t));
+    ep1_data = calloc(1, sizeof(struct ep1_data_t));
+    ep1_data->instance = instance;
     ep1_data->joystick_data = malloc(sizeof(struct USB_JoystickReport_Input_t));
     ep1_data->fd = fd;
+    ep1_data->pack = g_options.profile->pack;
+    poll_phase_init(&ep1_data->phase);
 
     printf("ep1 thread finished initial setup: %i, %p\n", ep1_data->fd, ep1_data->joystick_data);
 
@@ -626,6 +629,11 @@ void ep1_cleanup(void* data)
     if (ep1_data->fd >= 0) {
         close(ep1_data->fd);
     }
+    if (ep1_data->phase.polls > 0) {
+        printf("ep1: %lu polls, %lu missed, period %.3f ms +- %.3f\n",
+            (unsigned long)ep1_data->phase.polls, (unsigned long)ep1_data->phase.missed,
+            ep1_data->phase.period_ns / 1e6, ep1_data->phase.jitter_ns / 1e6);
+    }
 
     if (ep1_data->joystick_data != NULL) {
         free(ep1_data->joystick_data);
@@ -640,20 +648,31 @@ bool ep1_loop(void* ep1_data_void)
 {
     struct ep1_data_t* ep1_data = ep1_data_void;
 
-    struct USB_JoystickReport_Input_t in = { 0 };
-    //printf("EP1: lock\n");
-    pthread_mutex_lock(&g_joystick_data_mutex);
-    in = g_joystick_data;
-    pthread_mutex_unlock(&g_joystick_data_mutex);
-    //printf("EP1: unlock\n");
+    struct output_channel_t* channel = &ep1_data->instance->channel;
+    if (g_options.sample_lead_us != 0) {
+        uint64_t sample_ns
+            = poll_phase_sample_at(&ep1_data->phase, g_options.sample_lead_us * 1000ull);
+        if (sample_ns != 0) {
+            monotonic_sleep_until(sample_ns);
+        }
+    }
+    struct joystick_state_t state;
+    next_report(channel, ep1_data->delivered_generation, &state);
+    uint64_t sampled_ns = monotonic_ns();
+    uint8_t report[PROFILE_MAX_REPORT];
+    size_t report_size = ep1_data->pack(&state.report, report);
 
     //printf("EP1: prewrite\n");
-    ssize_t bytes_written = write(ep1_data->fd, &in, sizeof(in));
+    ssize_t bytes_written = write(ep1_data->fd, report, report_size);
     //printf("EP1: write: %li\n", bytes_written);
-    if (bytes_written < (ssize_t)sizeof(in)) {
-        printf("EP1: bailing\n");
+    if (bytes_written < (ssize_t)report_size) {
+        LOG_ERROR("EP1: bailing");
         return false;
     }
+    uint64_t done_ns = monotonic_ns();
+    poll_phase_complete(&ep1_data->phase, done_ns);
+    latency_record(LATENCY_SAMPLE_TO_USB, done_ns - sampled_ns);
+    report_delivered(channel, &ep1_data->delivered_generation, state.generation, state.stamp);
     int status;
     //printf("EP1: fake read\n");
     //ssize_t bytes_read = read(ep1_data->fd, &status, 0);
@@ -661,18 +680,209 @@ bool ep1_loop(void* ep1_data_void)
     return true;
 }
 
+// Pro Controller: replies as soon as ep2 queues them, 0x30 reports at the
+// controller's own cadence once the host has finished the handshake, nothing
+// before. Input is sampled per report, so macros count reports here.
+bool procon_ep1_loop(void* ep1_data_void)
+{
+    struct ep1_data_t* ep1_data = ep1_data_void;
+    struct device_instance_t* instance = ep1_data->instance;
+
+    procon_wait(&instance->procon, 0);
+    struct joystick_state_t state;
+    next_report(&instance->channel, ep1_data->delivered_generation, &state);
+    uint64_t sampled_ns = monotonic_ns();
+    const uint8_t* report = procon_input(&instance->procon, &state.report);
+
+    ssize_t bytes_written = write(ep1_data->fd, report, PROCON_REPORT_SIZE);
+    if (bytes_written < PROCON_REPORT_SIZE) {
+        LOG_ERROR("EP1: bailing");
+        return false;
+    }
+    uint64_t done_ns = monotonic_ns();
+    poll_phase_complete(&ep1_data->phase, done_ns);
+    latency_record(LATENCY_SAMPLE_TO_USB, done_ns - sampled_ns);
+    report_delivered(&instance->channel, &ep1_data->delivered_generation, state.generation,
+        state.stamp);
+    return true;
+}
+
+// AIO mode: one thread services ep1 and ep2 through an ffs_aio_engine_t,
+// keeping aio_depth IN reports queued ahead of the host polls and an OUT read
+// always armed. In latest-state mode the queued IN reports are cancelled on
+// every input change and refilled with the newest state as the cancellations
+// complete, so the host never polls a stale report.
+struct ep_aio_data_t {
+    struct device_instance_t* instance;
+    int ep1_fd;
+    int ep2_fd;
+    struct ffs_aio_engine_t engine;
+    profile_pack_fn pack;
+    uint32_t delivered_generation;
+    struct poll_phase_t phase; // stats only; the engine refills as soon as a slot completes
+};
+
+int open_endpoint(const struct device_instance_t* instance, const char* name)
+{
+    char* path;
+    if (asprintf(&path, "%s/%s", instance->mount_point, name) <= 0) {
+        printf("%s path alloc failed\n", name);
+        return -1;
+    }
+    int fd = open(path, O_RDWR);
+    printf("%s fd: %i\n", name, fd);
+    free(path);
+    if (fd < 0) {
+        printf("%s fd open failed\n", name);
+    }
+    return fd;
+}
+
+size_t ep_aio_fill_in(void* user, struct ffs_aio_slot_t* slot)
+{
+    struct ep_aio_data_t* ep_aio_data = user;
+    struct joystick_state_t state;
+    next_report(&ep_aio_data->instance->channel, ep_aio_data->delivered_generation, &state);
+    size_t size = ep_aio_data->pack(&state.report, slot->buf);
+    slot->generation = state.generation;
+    slot->stamp = state.stamp;
+    slot->sampled = monotonic_ns();
+    return size;
+}
+
+void ep_aio_in_done(void* user, const struct ffs_aio_slot_t* slot, long long res)
+{
+    struct ep_aio_data_t* ep_aio_data = user;
+    if (res == (long long)slot->length) {
+        uint64_t done_ns = monotonic_ns();
+        poll_phase_complete(&ep_aio_data->phase, done_ns);
+        latency_record(LATENCY_SAMPLE_TO_USB, done_ns - slot->sampled);
+        report_delivered(&ep_aio_data->instance->channel, &ep_aio_data->delivered_generation,
+            slot->generation, slot->stamp);
+    }
+}
+
+void ep_aio_out_done(void* user, const struct ffs_aio_slot_t* slot, long long res)
+{
+    struct ep_aio_data_t* ep_aio_data = user;
+    LOG_DEBUG("e2 bytes read: %lli", res);
+    if (res > 0) {
+        output_received(&ep_aio_data->instance->channel, slot->buf, res);
+    }
+}
+
+static const struct ffs_aio_ops_t ep_aio_ops = {
+    .fill_in = ep_aio_fill_in,
+    .in_done = ep_aio_in_done,
+    .out_done = ep_aio_out_done,
+};
+
+bool ep_aio_open(struct ep_aio_data_t* ep_aio_data)
+{
+    ep_aio_data->engine.eventfd = -1;
+    ep_aio_data->pack = g_options.profile->pack;
+    poll_phase_init(&ep_aio_data->phase);
+    ep_aio_data->ep1_fd = open_endpoint(ep_aio_data->instance, "ep1");
+    ep_aio_data->ep2_fd = open_endpoint(ep_aio_data->instance, "ep2");
+    if (ep_aio_data->ep1_fd < 0 || ep_aio_data->ep2_fd < 0) {
+        return false;
+    }
+
+    if (!ffs_aio_engine_init(&ep_aio_data->engine, ep_aio_data->ep1_fd, g_options.aio_depth,
+            ep_aio_data->ep2_fd, 1, &ep_aio_ops, ep_aio_data)) {
+        return false;
+    }
+    return ffs_aio_engine_start(&ep_aio_data->engine);
+}
+
+void ep_aio_close(struct ep_aio_data_t* ep_aio_data)
+{
+    ffs_aio_engine_destroy(&ep_aio_data->engine);
+
+    if (ep_aio_data->ep1_fd >= 0) {
+        close(ep_aio_data->ep1_fd);
+        ep_aio_data->ep1_fd = -1;
+    }
+    if (ep_aio_data->ep2_fd >= 0) {
+        close(ep_aio_data->ep2_fd);
+        ep_aio_data->ep2_fd = -1;
+    }
+}
+
+bool ep_aio_setup(void* data)
+{
+    struct ep_aio_data_t** ep_aio_data_ptr = data;
+    struct device_instance_t* instance = setup_instance(data);
+    printf("ep aio setup, depth %zu\n", g_options.aio_depth);
+
+    struct ep_aio_data_t* ep_aio_data = calloc(1, sizeof(struct ep_aio_data_t));
+    ep_aio_data->instance = instance;
+    *ep_aio_data_ptr = ep_aio_data;
+    return ep_aio_open(ep_aio_data);
+}
+
+void ep_aio_cleanup(void* data)
+{
+    printf("ep aio cleanup\n");
+    void** ep_aio_ptr_ptr = data;
+
+    struct ep_aio_data_t* ep_aio_data = *ep_aio_ptr_ptr;
+    if (ep_aio_data == NULL) {
+        return;
+    }
+
+    ep_aio_close(ep_aio_data);
+
+    free(ep_aio_data);
+    *ep_aio_ptr_ptr = NULL;
+}
+
+bool ep_aio_loop(void* ep_aio_data_void)
+{
+    struct ep_aio_data_t* ep_aio_data = ep_aio_data_void;
+    int state_eventfd = ep_aio_data->instance->channel.state_eventfd;
+
+    struct pollfd fds[2] = {
+        { .fd = ep_aio_data->engine.eventfd, .events = POLLIN },
+        { .fd = state_eventfd, .events = POLLIN },
+    };
+    if (poll(fds, 2, -1) < 0) {
+        return errno == EINTR;
+    }
+
+    if (fds[1].revents & POLLIN) {
+        eventfd_t changes;
+        eventfd_read(state_eventfd, &changes);
+        // a running macro owns the queued reports; they're already exact
+        if (!ep_aio_data->instance->channel.macro.running) {
+            ffs_aio_engine_cancel_in(&ep_aio_data->engine);
+        }
+    }
+
+    if (fds[0].revents & POLLIN) {
+        if (!ffs_aio_engine_process(&ep_aio_data->engine)) {
+            LOG_ERROR("EP AIO: bailing");
+            return false;
+        }
+    }
+
+    return true;
+}
+
 struct ep0_data_t {
     int fd;
     void* buffer;
     struct usb_endpoint_thread_t io_endpoints[2];
+    size_t io_endpoint_count;
 };
 
 bool ep0_setup(void* data)
 {
     struct ep0_data_t** ep0_data_ptr = data;
-    printf("ep0 setup\n");
+    struct device_instance_t* instance = setup_instance(data);
+    printf("ep0 setup, instance %u at %s\n", instance->channel.index, instance->mount_point);
     char* ep0_path;
-    int r = asprintf(&ep0_path, "%s/%s", FUNCTIONFS_MOUNT_POINT, "ep0");
+    int r = asprintf(&ep0_path, "%s/%s", instance->mount_point, "ep0");
     if (r <= 0) {
         printf("ep0_path alloc failed\n");
         return false;
@@ -696,24 +906,29 @@ bool ep0_setup(void* data)
 
     printf("ep0 thread finished initial setup: %i, %p\n", ep0_data->fd, ep0_data->buffer);
 
-    ssize_t written = write(ep0_data->fd, &descriptors, sizeof descriptors);
-    printf("wrote desc: %li\n", written);
-    written = write(ep0_data->fd, &strings, sizeof strings);
-    printf("wrote strings: %li\n", written);
-
-    {
-        ep0_data->io_endpoints[0].data = NULL;
+    write_descriptors(ep0_data->fd);
+
+    if (g_options.aio_depth > 0) {
+        ep0_data->io_endpoints[0].data = &instance->channel;
+        ep0_data->io_endpoints[0].setup_fn = ep_aio_setup;
+        ep0_data->io_endpoints[0].loop_fn = ep_aio_loop;
+        ep0_data->io_endpoints[0].cleanup_fn = ep_aio_cleanup;
+        thread_run(&ep0_data->io_endpoints[0], instance->cpu, RT_ROLE_IO);
+        ep0_data->io_endpoint_count = 1;
+    } else {
+        ep0_data->io_endpoints[0].data = &instance->channel;
+        bool procon = g_options.profile->protocol == PROFILE_PROTOCOL_PROCON;
         ep0_data->io_endpoints[0].setup_fn = ep1_setup;
-        ep0_data->io_endpoints[0].loop_fn = ep1_loop;
+        ep0_data->io_endpoints[0].loop_fn = procon ? procon_ep1_loop : ep1_loop;
         ep0_data->io_endpoints[0].cleanup_fn = ep1_cleanup;
-        thread_run(&ep0_data->io_endpoints[0]);
-    }
-    {
-        ep0_data->io_endpoints[1].data = NULL;
+        thread_run(&ep0_data->io_endpoints[0], instance->cpu, RT_ROLE_IO);
+
+        ep0_data->io_endpoints[1].data = &instance->channel;
         ep0_data->io_endpoints[1].setup_fn = ep2_setup;
-        ep0_data->io_endpoints[1].loop_fn = ep2_loop;
+        ep0_data->io_endpoints[1].loop_fn = procon ? procon_ep2_loop : ep2_loop;
         ep0_data->io_endpoints[1].cleanup_fn = ep2_cleanup;
-        thread_run(&ep0_data->io_endpoints[1]);
+        thread_run(&ep0_data->io_endpoints[1], instance->cpu, RT_ROLE_IO);
+        ep0_data->io_endpoint_count = 2;
     }
 
     *ep0_data_ptr = ep0_data;
@@ -740,7 +955,9 @@ void ep0_cleanup(void* data)
         ep0_data->buffer = NULL;
     }
 
-    pthread_cancel(ep0_data->io_endpoints[0].pthread);
+    for (size_t i = 0; i < ep0_data->io_endpoint_count; ++i) {
+        pthread_cancel(ep0_data->io_endpoints[i].pthread);
+    }
 
     free(ep0_data);
     *ep0_ptr_ptr = NULL;
@@ -752,13 +969,11 @@ bool ep0_loop(void* ep0_data_void)
 
     const size_t max_data_size
         = (USB_FUNCTIONFS_EVENT_BUFFER * sizeof(struct usb_functionfs_event));
-    printf("reading from ep0\n");
     ssize_t bytes_read = read(ep0_data->fd, ep0_data->buffer, max_data_size);
-    printf("done reading from ep0: %li %lu %lu \n", bytes_read,
-        bytes_read / sizeof(struct usb_functionfs_event),
-        bytes_read % sizeof(struct usb_functionfs_event));
+    LOG_DEBUG("done reading from ep0: %zi %zu", bytes_read,
+        bytes_read / sizeof(struct usb_functionfs_event));
     if (bytes_read < 0) {
-        printf("Reading ep0 failed: %i, %p\n", ep0_data->fd, ep0_data->buffer);
+        LOG_ERROR("Reading ep0 failed: %i, %p", ep0_data->fd, ep0_data->buffer);
         return false;
     }
     const struct usb_functionfs_event* event = ep0_data->buffer;
@@ -771,186 +986,406 @@ bool ep0_loop(void* ep0_data_void)
         case FUNCTIONFS_DISABLE:
         case FUNCTIONFS_SUSPEND:
         case FUNCTIONFS_RESUME:
-            printf("Event %s\n", names[event->type]);
+            LOG_INFO("Event %s", names[event->type]);
             break;
         case FUNCTIONFS_SETUP:
-            printf("Got a setup request\n");
             handle_setup(ep0_data->fd, &event->u.setup);
             break;
 
         default:
-            printf("Event %03u (unknown)\n", event->type);
+            LOG_WARNING("Event %03u (unknown)", event->type);
         }
     }
 
     return true;
 }
+
+const struct output_backend_t g_ffs_backend = {
+    .name = "ffs",
+    .needs_state_events = false, // only in latest-state mode
+    .setup_fn = ep0_setup,
+    .loop_fn = ep0_loop,
+    .cleanup_fn = ep0_cleanup,
+};
+
+static const struct output_backend_t* const backends[] = {
+    &g_ffs_backend,
+    &g_uinput_backend,
+    &g_mock_backend,
+};
 // client
 
-#define JS_EVENT_BUTTON 0x01 /* button pressed/released */
-#define JS_EVENT_AXIS 0x02 /* joystick moved */
-#define JS_EVENT_INIT 0x80 /* initial state of device */
-int handler(zloop_t* loop, zsock_t* sock, void* data)
+// Pad input -> report, from -m or the built-in profile. Shared by every
+// instance and read-only once loaded.
+struct mapping_t g_mapping;
+struct macro_t g_macro;
+
+// Fold every field of `pad` that differs from the previously applied state
+// into the working report. Returns whether the report changed.
+bool apply_pad(struct device_instance_t* instance, const struct wire_state_t* pad)
 {
-    uint32_t time;
-    int32_t value;
-    uint8_t type;
-    uint8_t number;
-    int recv_res = zsock_recv(sock, "4i11", &time, &value, &type, &number);
-    // zsys_info("jsenven: %u, %i, %u, %u", time, value, type, number);
-    pthread_mutex_lock(&g_joystick_data_mutex);
-    if ((type & ~JS_EVENT_INIT) == JS_EVENT_BUTTON) {
-        const uint8_t mapping[12] = {
-            1, // Xbox B (0)
-            2, // Xbox A (1)
-            0, // Xbox Y (2)
-            3, // Xbox X (3)
-            4, // Xbox LS (4)
-            5, // Xbox RS (5)
-            8, // Xbox M (6)
-            9, // Xbox P (7)
-            12, // Xbox H (8)
-            10, // Xbox Lth (9)
-            11, // Xbox Rth (10)
-        };
-        uint16_t mapped_button = mapping[number];
-        uint16_t mask = 1 << mapped_button;
-        if (value)
-            g_joystick_data.Button |= mask;
-        else
-            g_joystick_data.Button &= ~mask;
-    } else if ((type & ~JS_EVENT_INIT) == JS_EVENT_AXIS) {
-        uint8_t shaped_axis = ((int32_t)value + 32768) >> 8;
-        switch (number) {
-        // Left Stick
-        case 0:
-            g_joystick_data.LX = shaped_axis;
-            break;
-        case 1:
-            g_joystick_data.LY = shaped_axis;
-            break;
-            // Right Stick
-        case 3:
-            g_joystick_data.RX = shaped_axis;
-            break;
-        case 4:
-            g_joystick_data.RY = shaped_axis;
-            break;
-        // Left Trigger
-        case 2: {
-            bool triggered = value > -29000; // provide some deadzone
-            uint16_t mask = 1 << 6;
-            if (triggered)
-                g_joystick_data.Button |= mask;
-            else
-                g_joystick_data.Button &= ~mask;
-            break;
+    const struct wire_state_t* applied = &instance->pad_state;
+    bool changed = false;
+    for (uint8_t n = 0; n < pad->button_count; ++n) {
+        bool pressed = (pad->buttons >> n) & 1;
+        if (!instance->pad_state_valid || pressed != ((applied->buttons >> n) & 1)) {
+            mapping_apply(&g_mapping, &instance->joystick_data, MAPPING_BUTTON, n, pressed);
+            changed = true;
         }
-            // Right Trigger
-        case 5: {
-            bool triggered = value > -29000; // provide some deadzone
-            uint16_t mask = 1 << 7;
-            if (triggered)
-                g_joystick_data.Button |= mask;
-            else
-                g_joystick_data.Button &= ~mask;
-            break;
+    }
+    for (uint8_t n = 0; n < pad->axis_count; ++n) {
+        if (!instance->pad_state_valid || pad->axes[n] != applied->axes[n]) {
+            mapping_apply(&g_mapping, &instance->joystick_data, MAPPING_AXIS, n, pad->axes[n]);
+            changed = true;
         }
-        // POV HAT
-        case 6: {
-            // Get the current u/d movement
-            bool up = g_joystick_data.HAT == HAT_TOP || g_joystick_data.HAT == HAT_TOP_RIGHT
-                || g_joystick_data.HAT == HAT_TOP_LEFT;
-            bool down = g_joystick_data.HAT == HAT_BOTTOM || g_joystick_data.HAT == HAT_BOTTOM_RIGHT
-                || g_joystick_data.HAT == HAT_BOTTOM_LEFT;
-
-            bool left = value == -32767;
-            bool right = value == 32767;
-            printf("HAT: %i, %s", g_joystick_data.HAT, hat_mapping[g_joystick_data.HAT]);
-            printf("l/r lrud: %i %i %i %i\n", left, right, up, down);
-
-            if (up) {
-                if (left) {
-                    printf("up left, topleft\n");
-                    g_joystick_data.HAT = HAT_TOP_LEFT;
-                } else if (right) {
-                    printf("up right, topright\n");
-                    g_joystick_data.HAT = HAT_TOP_RIGHT;
-                } else {
-                    printf("up nlnr, top\n");
-                    g_joystick_data.HAT = HAT_TOP;
-                }
-            } else if (down) {
-                if (left) {
-                    printf("down left, bottomleft\n");
-                    g_joystick_data.HAT = HAT_BOTTOM_LEFT;
-                } else if (right) {
-                    printf("down right, bottomright\n");
-                    g_joystick_data.HAT = HAT_BOTTOM_RIGHT;
-                } else {
-                    printf("down nlnr, bottom\n");
-                    g_joystick_data.HAT = HAT_BOTTOM;
+    }
+    instance->pad_state = *pad;
+    instance->pad_state_valid = true;
+    return changed;
+}
+
+// Hand the working report to the output side.
+void publish_report(struct device_instance_t* instance, uint64_t recv_ns)
+{
+    struct joystick_state_t state = {
+        .report = instance->joystick_data.report,
+        .generation = ++instance->joystick_data_generation,
+        .stamp = monotonic_ns(),
+    };
+    joystick_seqlock_write(&instance->channel.state, &state);
+    latency_record(LATENCY_RECV_TO_PUBLISH, state.stamp - recv_ns);
+    instance->published_seq[state.generation % UPLINK_SEQ_RING]
+        = instance->wire_decoder.next_seq - 1;
+    if (instance->channel.state_eventfd >= 0) {
+        eventfd_write(instance->channel.state_eventfd, 1);
+    }
+    if (instance->capturing && g_options.capture_kind == CAPTURE_REPORT) {
+        capture_append(&instance->capture, state.stamp, &state.report);
+    }
+}
+
+// Decode a state frame and fold every field that differs from the previously
+// applied state into the working report, which is then published once.
+enum wire_result apply_frame(
+    struct device_instance_t* instance, const uint8_t* frame, size_t size, uint64_t recv_ns)
+{
+    struct wire_decoder_t* decoder = &instance->wire_decoder;
+    enum wire_result result = wire_decode_state(decoder, frame, size);
+    if (result != WIRE_APPLIED) {
+        return result;
+    }
+    // applied, so in sync: an outstanding keyframe request has been answered
+    instance->keyframe_requested_ns = 0;
+    int32_t transit_us = (int32_t)((uint32_t)(recv_ns / 1000) - decoder->sent_us);
+    latency_record_offset(LATENCY_WIRE, &instance->wire_offset, transit_us * 1000ll);
+    if (instance->capturing && g_options.capture_kind == CAPTURE_INPUT) {
+        capture_append(&instance->capture, recv_ns, &decoder->state);
+    }
+    if (apply_pad(instance, &decoder->state)) {
+        publish_report(instance, recv_ns);
+    }
+    return result;
+}
+
+// The comm side is the capture's only writer. Once it stops, close the capture,
+// which trims the file's growth padding back to the last record.
+void capture_stop(struct device_instance_t* instance)
+{
+    if (instance->capturing) {
+        instance->capturing = false;
+        capture_close(&instance->capture);
+    }
+}
+
+// Feed a capture into the instance in place of a server session, each record
+// at its captured offset from the first. Deadlines are absolute, so time
+// spent applying a record never delays the ones after it.
+void* replay(void* data)
+{
+    struct device_instance_t* instance = data;
+    const char* path = instance->replay_path;
+    struct capture_reader_t reader;
+    if (!capture_map(&reader, path)) {
+        capture_stop(instance);
+        return NULL;
+    }
+    printf("instance %u: replaying %llu %s records from %s\n", instance->channel.index,
+        (unsigned long long)reader.count, reader.kind == CAPTURE_INPUT ? "input" : "report",
+        path);
+
+    uint64_t late_total_ns = 0;
+    uint64_t late_max_ns = 0;
+    uint64_t replayed = 0;
+    unsigned passes = g_options.replay_passes;
+    for (unsigned pass = 0; reader.count > 0 && (passes == 0 || pass < passes); ++pass) {
+        uint64_t first_ns = capture_record(&reader, 0)->ns;
+        uint64_t start_ns = monotonic_ns();
+        for (uint64_t i = 0; i < reader.count; ++i) {
+            const struct capture_record_t* record = capture_record(&reader, i);
+            uint64_t deadline_ns = start_ns + (record->ns - first_ns);
+            monotonic_sleep_until(deadline_ns);
+
+            uint64_t now_ns = monotonic_ns();
+            late_total_ns += now_ns - deadline_ns;
+            late_max_ns = now_ns - deadline_ns > late_max_ns ? now_ns - deadline_ns : late_max_ns;
+            ++replayed;
+            if (reader.kind == CAPTURE_INPUT) {
+                struct wire_state_t pad = record->pad; // records are packed
+                if (apply_pad(instance, &pad)) {
+                    publish_report(instance, now_ns);
                 }
             } else {
-                if (left) {
-                    printf("nund left, left\n");
-                    g_joystick_data.HAT = HAT_LEFT;
-                } else if (right) {
-                    printf("nund right, right\n");
-                    g_joystick_data.HAT = HAT_RIGHT;
-                } else {
-                    printf("nund nlnr, center\n");
-                    g_joystick_data.HAT = HAT_CENTER;
-                }
+                instance->joystick_data.report = record->report;
+                publish_report(instance, now_ns);
             }
-            break;
         }
-        case 7: {
-            bool left = g_joystick_data.HAT == HAT_TOP_LEFT || g_joystick_data.HAT == HAT_LEFT
-                || g_joystick_data.HAT == HAT_BOTTOM_LEFT;
-            bool right = g_joystick_data.HAT == HAT_TOP_RIGHT || g_joystick_data.HAT == HAT_RIGHT
-                || g_joystick_data.HAT == HAT_BOTTOM_RIGHT;
-            bool up = value == -32767;
-            bool down = value == 32767;
-            printf("HAT: %i, %s", g_joystick_data.HAT, hat_mapping[g_joystick_data.HAT]);
-            printf("u/d lrud: %i %i %i %i\n", left, right, up, down);
-            if (up) {
-                if (left) {
-                    g_joystick_data.HAT = HAT_TOP_LEFT;
-                } else if (right) {
-                    g_joystick_data.HAT = HAT_TOP_RIGHT;
-                } else {
-                    g_joystick_data.HAT = HAT_TOP;
-                }
-            } else if (down) {
-                if (left) {
-                    g_joystick_data.HAT = HAT_BOTTOM_LEFT;
-                } else if (right) {
-                    g_joystick_data.HAT = HAT_BOTTOM_RIGHT;
-                } else {
-                    g_joystick_data.HAT = HAT_BOTTOM;
-                }
-            } else {
-                if (left) {
-                    g_joystick_data.HAT = HAT_LEFT;
-                } else if (right) {
-                    g_joystick_data.HAT = HAT_RIGHT;
-                } else {
-                    g_joystick_data.HAT = HAT_CENTER;
-                }
-            }
-            break;
+        LOG_INFO("replay pass %u done", pass + 1);
+    }
+    printf("instance %u: replayed %llu records, late by %.1f us on average, %.1f us at most\n",
+        instance->channel.index, (unsigned long long)replayed,
+        replayed > 0 ? late_total_ns / 1e3 / replayed : 0.0, late_max_ns / 1e3);
+    capture_unmap(&reader);
+    capture_stop(instance);
+    return NULL;
+}
+
+// Every datagram is a sequenced keyframe; the decoder discards stale ones.
+int udp_handler(zloop_t* loop, zmq_pollitem_t* item, void* data)
+{
+    struct device_instance_t* instance = data;
+    uint8_t frame[WIRE_MAX_FRAME];
+    ssize_t size;
+    while ((size = recv(instance->udp_fd, frame, sizeof(frame), MSG_DONTWAIT)) >= 0) {
+        apply_frame(instance, frame, size, monotonic_ns());
+    }
+    return 0;
+}
+
+void udp_send_hello(struct device_instance_t* instance)
+{
+    uint8_t hello[WIRE_MAX_FRAME];
+    send(instance->udp_fd, hello, wire_encode_udp_hello(hello, sizeof(hello)), MSG_DONTWAIT);
+}
+
+bool udp_open(struct device_instance_t* instance, uint16_t port)
+{
+    struct sockaddr_in server = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+    };
+    if (inet_pton(AF_INET, instance->server_ip, &server.sin_addr) != 1) {
+        zsys_error("can't stream over UDP from %s", instance->server_ip);
+        return false;
+    }
+    instance->udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (instance->udp_fd < 0
+        || connect(instance->udp_fd, (struct sockaddr*)&server, sizeof(server)) < 0) {
+        zsys_error("UDP transport setup failed: %s", strerror(errno));
+        if (instance->udp_fd >= 0) {
+            close(instance->udp_fd);
+            instance->udp_fd = -1;
         }
+        return false;
+    }
+    zsys_info("instance %u: streaming over UDP from %s:%u", instance->channel.index,
+        instance->server_ip, port);
+    udp_send_hello(instance);
+    return true;
+}
+
+void udp_close(struct device_instance_t* instance)
+{
+    if (instance->udp_fd >= 0) {
+        close(instance->udp_fd);
+        instance->udp_fd = -1;
+    }
+}
+
+// Acks are off until the server of the new session asks for them. A rumble
+// still going is forwarded to it.
+void uplink_reset(struct device_instance_t* instance)
+{
+    struct output_channel_t* channel = &instance->channel;
+    eventfd_t count;
+    atomic_store_explicit(&channel->report_acks, false, memory_order_relaxed);
+    atomic_store_explicit(&channel->reports_delivered, 0, memory_order_relaxed);
+    instance->reports_acked = 0;
+    eventfd_read(channel->uplink_eventfd, &count);
+
+    uint32_t changes = atomic_load_explicit(&channel->rumble_changes, memory_order_acquire);
+    bool rumbling = atomic_load_explicit(&channel->rumble, memory_order_relaxed) != 0;
+    instance->rumble_forwarded = rumbling ? changes - 1 : changes;
+    if (rumbling) {
+        eventfd_write(channel->uplink_eventfd, 1);
+    }
+}
+
+// Tell the server which frame the newest delivered report carried. Several
+// deliveries between wakeups collapse into one ack for the latest.
+void uplink_send_ack(struct device_instance_t* instance)
+{
+    struct output_channel_t* channel = &instance->channel;
+    uint32_t reports = atomic_load_explicit(&channel->reports_delivered, memory_order_relaxed);
+    if (reports == instance->reports_acked) {
+        return;
+    }
+    instance->reports_acked = reports;
+    uint32_t generation
+        = atomic_load_explicit(&channel->delivered_generation, memory_order_relaxed);
+    struct wire_report_ack_t ack = {
+        .header.seq = instance->published_seq[generation % UPLINK_SEQ_RING],
+        .frames = instance->wire_decoder.frames,
+        .dropped = instance->wire_decoder.dropped,
+        .published = instance->joystick_data_generation,
+        .reports = reports,
+    };
+    uint8_t* frame = frame_pool_buffer(&instance->frames);
+    size_t size = wire_encode_report_ack(frame, WIRE_MAX_FRAME, &ack);
+    frame_pool_send(&instance->frames, instance->paired, size); // the next ack covers a drop
+}
+
+// Forward the host's newest rumble; several changes between wakeups collapse
+// into the latest. The server echoes it back once the pad plays it.
+void uplink_send_rumble(struct device_instance_t* instance)
+{
+    struct output_channel_t* channel = &instance->channel;
+    uint32_t changes = atomic_load_explicit(&channel->rumble_changes, memory_order_acquire);
+    if (changes == instance->rumble_forwarded) {
+        return;
+    }
+    instance->rumble_forwarded = changes;
+    uint32_t value = atomic_load_explicit(&channel->rumble, memory_order_relaxed);
+    struct wire_rumble_t rumble = {
+        .header.seq = changes,
+        .strong = value >> 16,
+        .weak = value & 0xffff,
+        .sent_us = atomic_load_explicit(&channel->rumble_ns, memory_order_relaxed) / 1000,
+    };
+    uint8_t* frame = frame_pool_buffer(&instance->frames);
+    size_t size = wire_encode_rumble(frame, WIRE_MAX_FRAME, WIRE_RUMBLE, &rumble);
+    frame_pool_send(&instance->frames, instance->paired, size);
+}
+
+// The ep side woke the comm thread: acks and rumble for the server.
+void uplink_send(struct device_instance_t* instance)
+{
+    eventfd_t count;
+    if (eventfd_read(instance->channel.uplink_eventfd, &count) < 0 || instance->paired == NULL) {
+        return;
+    }
+    uplink_send_ack(instance);
+    uplink_send_rumble(instance);
+}
+
+int uplink_handler(zloop_t* loop, zmq_pollitem_t* item, void* data)
+{
+    uplink_send(data);
+    return 0;
+}
+
+void reactor_watch_udp(struct reactor_t* reactor);
+
+// After a gap every delta is out of sync until the keyframe arrives, and the
+// server answers every request with a keyframe of its own. So there is one
+// request outstanding at a time, repeated only if its keyframe hasn't come
+// within this long.
+#define KEYFRAME_REQUEST_RETRY_MS 100
+
+void request_keyframe(struct device_instance_t* instance, zsock_t* sock, uint64_t now_ns)
+{
+    if (instance->keyframe_requested_ns != 0
+        && now_ns - instance->keyframe_requested_ns < KEYFRAME_REQUEST_RETRY_MS * 1000000ull) {
+        return;
+    }
+    uint8_t* request = frame_pool_buffer(&instance->frames);
+    size_t request_size = wire_encode_keyframe_request(request, WIRE_MAX_FRAME);
+    if (frame_pool_send(&instance->frames, sock, request_size)) {
+        instance->keyframe_requested_ns = now_ns;
+    }
+}
+
+// The server's answer to the pairing, before any state. The token we
+// presented means the seat kept our session: its sequence carries on and the
+// next delta brings the state up to date. Any other starts a new session.
+void session_started(struct device_instance_t* instance, uint32_t token)
+{
+    if (token == instance->session_token) {
+        zsys_info("instance %u: resumed session %08x", instance->channel.index, token);
+    } else {
+        zsys_info("instance %u: new session %08x", instance->channel.index, token);
+        wire_decoder_init(&instance->wire_decoder); // new session, new sequence
+        instance->wire_offset.valid = false;
+        instance->session_token = token;
+    }
+    instance->keyframe_requested_ns = 0; // went with the previous connection
+    instance->session_live = true;
+}
+
+// Messages on the PAIR socket: the session, state frames, the server's UDP
+// offer, its request for report acks and its echoes of our rumble. `data` is
+// the instance.
+int handler(zloop_t* loop, zsock_t* sock, void* data)
+{
+    struct device_instance_t* instance = data;
+    const uint8_t* frame = instance->frame;
+    size_t size = frame_recv(sock, instance->frame);
+    if (size == 0) {
+        return 0;
+    }
+    uint64_t recv_ns = monotonic_ns();
+
+    uint32_t token;
+    if (wire_decode_session(frame, size, &token)) {
+        session_started(instance, token);
+        return 0;
+    }
+
+    uint16_t udp_port;
+    if (wire_decode_udp_offer(frame, size, &udp_port)) {
+        if (instance->udp_fd < 0 && udp_open(instance, udp_port)) {
+            if (loop != NULL) {
+                instance->udp_pollitem
+                    = (zmq_pollitem_t) { .fd = instance->udp_fd, .events = ZMQ_POLLIN };
+                zloop_poller(loop, &instance->udp_pollitem, udp_handler, instance);
+            } else if (instance->reactor != NULL) {
+                reactor_watch_udp(instance->reactor);
+            }
         }
+        return 0;
+    }
+
+    struct wire_rumble_t rumble;
+    if (wire_decode_rumble(frame, size, WIRE_RUMBLE_ACK, &rumble)) {
+        uint32_t round_trip_us = (uint32_t)(recv_ns / 1000) - rumble.sent_us;
+        latency_record(LATENCY_RUMBLE_ROUND_TRIP, round_trip_us * 1000ull);
+        return 0;
+    }
+
+    if (wire_frame_kind(frame, size) == WIRE_ACK_REQUEST) {
+        zsys_info("instance %u: acknowledging delivered reports", instance->channel.index);
+        atomic_store_explicit(&instance->channel.report_acks, true, memory_order_relaxed);
+        return 0;
+    }
+
+    enum wire_result result = apply_frame(instance, frame, size, recv_ns);
+    if (result == WIRE_NEED_KEYFRAME) {
+        request_keyframe(instance, sock, recv_ns);
+    } else if (result == WIRE_MALFORMED) {
+        zsys_warning("dropping malformed state frame of %zu bytes", size);
+    } else if (result == WIRE_APPLIED && instance->udp_fd >= 0) {
+        udp_send_hello(instance); // still arriving over PAIR: the hello was lost
     }
-    pthread_mutex_unlock(&g_joystick_data_mutex);
     return 0;
 }
 
-int monitor_handler(zloop_t* loop, zsock_t* reader, void* handler_data_void)
+// Until the session is up a disconnect is the server turning us away while
+// it still holds the previous connection; ZMQ retries, and the session
+// timeout decides.
+int monitor_handler(zloop_t* loop, zsock_t* reader, void* data)
 {
+    struct device_instance_t* instance = data;
     char* msg = zstr_recv(reader);
-    if (strncmp(msg, "DISCONNECTED", strlen("DISCONNECTED")) == 0) {
+    if (strncmp(msg, "DISCONNECTED", strlen("DISCONNECTED")) == 0 && instance->session_live) {
         freen(msg);
         return -1;
     }
@@ -958,12 +1393,71 @@ int monitor_handler(zloop_t* loop, zsock_t* reader, void* handler_data_void)
     return 0;
 }
 
+// A connection the server hasn't answered with a session this soon is given
+// up: the server is gone, or the seat went to another device.
+#define SESSION_TIMEOUT_MS 250
+// How soon ZMQ retries a refused connection, well below the session timeout.
+#define PAIR_RECONNECT_IVL_MS 10
+
+int session_timeout_handler(zloop_t* loop, int timer_id, void* data)
+{
+    struct device_instance_t* instance = data;
+    return instance->session_live ? 0 : -1;
+}
+
+// After a drop the device goes straight back to the server it was paired
+// with, presenting its session token, and only falls back to listening for
+// beacons if that doesn't bring the session back.
 enum BeaconClientState {
     Beaconing = 0,
     Paired = 1,
+    Resuming = 2,
 };
 
-char* beacon_listen()
+#define BEACON_PREFIX "SWITCHCON"
+
+// Beacons carry the server's PAIR port after the prefix.
+bool beacon_parse_port(const char* magic, unsigned int* port)
+{
+    if (strlen(magic) <= strlen(BEACON_PREFIX)) {
+        zsys_error("malformed packet, missing port?");
+        return false;
+    }
+    const char* port_str = magic + strlen(BEACON_PREFIX);
+    if (sscanf(port_str, "%u", port) != 1) {
+        zsys_error("malformed packet");
+        return false;
+    }
+    return true;
+}
+
+// Every instance listens to the same beacons, and a server advertises one
+// free seat at a time. An instance only answers a beacon no sibling is
+// already paired through, so two instances never race for one seat.
+pthread_mutex_t g_endpoints_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool endpoint_claim(struct device_instance_t* instance, const char* endpoint)
+{
+    pthread_mutex_lock(&g_endpoints_lock);
+    bool taken = false;
+    for (unsigned n = 0; n < g_options.instance_count; ++n) {
+        taken |= &g_instances[n] != instance && strcmp(g_instances[n].endpoint, endpoint) == 0;
+    }
+    if (!taken) {
+        snprintf(instance->endpoint, sizeof(instance->endpoint), "%s", endpoint);
+    }
+    pthread_mutex_unlock(&g_endpoints_lock);
+    return !taken;
+}
+
+void endpoint_release(struct device_instance_t* instance)
+{
+    pthread_mutex_lock(&g_endpoints_lock);
+    instance->endpoint[0] = '\0';
+    pthread_mutex_unlock(&g_endpoints_lock);
+}
+
+char* beacon_listen(struct device_instance_t* instance)
 {
     char* endpoint = NULL;
     char* ip_addr = NULL;
@@ -976,7 +1470,7 @@ char* beacon_listen()
     zactor_t* listener = zactor_new(zbeacon, NULL);
     zsock_send(listener, "si", "CONFIGURE", 9999);
 
-    const char* beacon_prefix = "SWITCHCON";
+    const char* beacon_prefix = BEACON_PREFIX;
     zsock_send(listener, "sb", "SUBSCRIBE", beacon_prefix, strlen(beacon_prefix));
 
     // read listening ip
@@ -995,26 +1489,23 @@ char* beacon_listen()
         freen(ip_addr);
         freen(magic);
 
-        zmsg_t* msg = zmsg_recv(listener);
-        zmsg_print(msg);
-
         errno = 0;
         recv_res = zsock_recv(listener, "ss", &ip_addr, &magic);
         int result_errno = errno;
         zsys_info("Got a beacon: %s | %s", ip_addr, magic);
 
         if (recv_res == 0) {
-            if (strlen(magic) <= strlen(beacon_prefix)) {
-                zsys_error("malformed packet, missing port?, quiting");
-                goto bad;
-            }
-            char* port_str = magic + strlen(beacon_prefix);
-            int conv_result = sscanf(port_str, "%u", &port);
-            if (conv_result != 1) {
-                zsys_error("malformed packet, quiting");
+            if (!beacon_parse_port(magic, &port)) {
+                zsys_error("quiting");
                 goto bad;
             }
             zsys_info("Got a beacon: %s | %s, | %u", ip_addr, magic, port);
+            endpoint = (char*)malloc(128);
+            snprintf(endpoint, 128, "tcp://%s:%u", ip_addr, port);
+            if (!endpoint_claim(instance, endpoint)) {
+                freen(endpoint);
+                continue; // a sibling's seat, wait for the server to advertise the next
+            }
             break;
         } else if (result_errno == EINTR) {
             zsys_warning("interrupted, quiting");
@@ -1025,8 +1516,7 @@ char* beacon_listen()
 
     } while (recv_res < 0 || strncmp(magic, "FUCKBOI", strlen("FUCKBOI") != 0));
 
-    endpoint = (char*)malloc(128);
-    snprintf(endpoint, 128, "tcp://%s:%u", ip_addr, port);
+    snprintf(instance->server_ip, sizeof(instance->server_ip), "%s", ip_addr);
 
     zsys_info("Got a matching magic: %s %s %s %u", endpoint, ip_addr, magic, port);
 
@@ -1043,10 +1533,46 @@ cleanup:
     return endpoint;
 }
 
-bool paired_streaming(zsock_t* socket)
+// The pairing reply; asks for the UDP transport when enabled and presents
+// the last session's token, if any.
+void send_pairing_magic(struct device_instance_t* instance, zsock_t* socket)
+{
+    char magic[48] = "MITCHPURDY";
+    if (g_options.udp) {
+        strcat(magic, " UDP");
+    }
+    if (instance->session_token != 0) {
+        snprintf(magic + strlen(magic), sizeof(magic) - strlen(magic), " RESUME %08x",
+            instance->session_token);
+    }
+    zstr_send(socket, magic);
+}
+
+// The session's PAIR socket, set up for frame_pool_send().
+zsock_t* pair_connect(const char* endpoint)
 {
+    zsock_t* socket = zsock_new(ZMQ_PAIR);
+    if (socket == NULL) {
+        return NULL;
+    }
+    frame_pool_setup_socket(socket);
+    zsock_set_reconnect_ivl(socket, PAIR_RECONNECT_IVL_MS);
+    zsock_set_heartbeat_ivl(socket, WIRE_HEARTBEAT_IVL_MS);
+    zsock_set_heartbeat_timeout(socket, WIRE_HEARTBEAT_TIMEOUT_MS);
+    zsock_set_heartbeat_ttl(socket, WIRE_HEARTBEAT_TIMEOUT_MS);
+    if (zsock_connect(socket, "%s", endpoint) != 0) {
+        zsock_destroy(&socket);
+    }
+    return socket;
+}
+
+bool paired_streaming(struct device_instance_t* instance, zsock_t* socket)
+{
+    instance->session_live = false;
+    uplink_reset(instance);
+    instance->paired = socket;
     zsys_info("sending:fisrt");
-    zstr_send(socket, "MITCHPURDY");
+    send_pairing_magic(instance, socket);
     zsys_info("sent");
 
     zactor_t* monitor = zactor_new(zmonitor, socket);
@@ -1056,13 +1582,23 @@ bool paired_streaming(zsock_t* socket)
 
     // Create a new zloop reactor
     zloop_t* loop = zloop_new();
-    zloop_reader(loop, (zsock_t*)monitor, monitor_handler, NULL);
-    zloop_reader(loop, socket, handler, NULL);
-    return zloop_start(loop) == -1; // if 0 then it was interupted
+    zloop_reader(loop, (zsock_t*)monitor, monitor_handler, instance);
+    zloop_reader(loop, socket, handler, instance);
+    zloop_timer(loop, SESSION_TIMEOUT_MS, 1, session_timeout_handler, instance);
+    instance->uplink_pollitem
+        = (zmq_pollitem_t) { .fd = instance->channel.uplink_eventfd, .events = ZMQ_POLLIN };
+    zloop_poller(loop, &instance->uplink_pollitem, uplink_handler, instance);
+    bool disconnected = zloop_start(loop) == -1; // if 0 then it was interupted
+    zloop_destroy(&loop);
+    zactor_destroy(&monitor);
+    udp_close(instance);
+    instance->paired = NULL;
+    return disconnected;
 }
 
 void* comm(void* data)
 {
+    struct device_instance_t* instance = data;
     zsys_set_logstream(stderr);
 
     enum BeaconClientState state = Beaconing;
@@ -1074,27 +1610,48 @@ void* comm(void* data)
         case Beaconing: {
             zsys_info("BEaAC");
 
-            char* endpoint = beacon_listen();
+            char* endpoint = beacon_listen(instance);
             if (endpoint != NULL) {
                 state = Paired;
             } else {
+                capture_stop(instance);
                 return NULL;
             }
             zsys_info("connecting to: %s", endpoint);
-            paired_socket = zsock_new_pair(endpoint);
+            paired_socket = pair_connect(endpoint);
             freen(endpoint);
 
             break;
         }
         case Paired: {
             zsys_info("PAIR");
-            if (!paired_streaming(paired_socket)) {
+            if (paired_socket == NULL) {
+                endpoint_release(instance);
+                state = Beaconing;
+                break;
+            }
+            if (!paired_streaming(instance, paired_socket)) {
                 zsock_destroy(&paired_socket);
+                endpoint_release(instance);
+                capture_stop(instance);
                 return NULL;
             }
 
             zsock_destroy(&paired_socket);
-            state = Beaconing;
+            if (instance->session_live) {
+                state = Resuming;
+            } else {
+                zsys_info("no session from %s, back to beaconing", instance->endpoint);
+                endpoint_release(instance);
+                state = Beaconing;
+            }
+            break;
+        }
+        case Resuming: {
+            // still claimed, so no sibling takes the seat meanwhile
+            zsys_info("disconnected, resuming at %s", instance->endpoint);
+            paired_socket = pair_connect(instance->endpoint);
+            state = Paired;
             break;
         }
         }
@@ -1106,21 +1663,721 @@ void* comm(void* data)
 // client
 //
 
-int main()
+// Reactor mode: ep0, the AIO endpoint engine, the beacon/PAIR/monitor sockets
+// and a housekeeping timer are all serviced by one epoll loop on the main
+// thread. An input message is applied and the queued ep1 reports replaced in
+// the same iteration, with no cross-thread handoff.
+enum reactor_source {
+    REACTOR_EP0,
+    REACTOR_ENDPOINTS,
+    REACTOR_BEACON,
+    REACTOR_PAIR,
+    REACTOR_MONITOR,
+    REACTOR_TIMER,
+    REACTOR_UDP,
+    REACTOR_UPLINK,
+};
+
+// ZMQ_FD only signals edges; the timer re-drains the sockets in case one was
+// missed between a ZMQ_EVENTS check and epoll_wait.
+#define REACTOR_TIMER_INTERVAL_MS 100
+
+struct reactor_t {
+    struct device_instance_t* instance;
+    int epoll_fd;
+    int timer_fd;
+    int ep0_fd;
+    struct usb_functionfs_event events[USB_FUNCTIONFS_EVENT_BUFFER];
+    struct ep_aio_data_t endpoints;
+    bool endpoints_open;
+
+    enum BeaconClientState state;
+    zactor_t* beacon;
+    zactor_t* monitor; // the session's socket is instance->paired
+    uint64_t session_deadline_ns; // see SESSION_TIMEOUT_MS
+};
+
+bool reactor_watch(struct reactor_t* reactor, int fd, enum reactor_source source, uint32_t events)
+{
+    struct epoll_event event = {
+        .events = events,
+        .data.u32 = source,
+    };
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        perror("epoll add");
+        return false;
+    }
+    return true;
+}
+
+void reactor_unwatch(struct reactor_t* reactor, int fd)
+{
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+bool reactor_start_beacon(struct reactor_t* reactor)
+{
+    zsys_info("Listening for beacons on udp 9999");
+    reactor->beacon = zactor_new(zbeacon, NULL);
+    zsock_send(reactor->beacon, "si", "CONFIGURE", 9999);
+
+    char* self_ip_addr = zstr_recv(reactor->beacon);
+    if (self_ip_addr == NULL) {
+        zsys_error("Couldn't get listening interface");
+        zactor_destroy(&reactor->beacon);
+        return false;
+    }
+    zsys_info("Using interface at %s", self_ip_addr);
+    freen(self_ip_addr);
+
+    zsock_send(reactor->beacon, "sb", "SUBSCRIBE", BEACON_PREFIX, strlen(BEACON_PREFIX));
+    reactor->state = Beaconing;
+    return reactor_watch(reactor, zsock_fd(reactor->beacon), REACTOR_BEACON, EPOLLIN | EPOLLET);
+}
+
+void reactor_stop_beacon(struct reactor_t* reactor)
+{
+    reactor_unwatch(reactor, zsock_fd(reactor->beacon));
+    zstr_sendx(reactor->beacon, "UNSUBSCRIBE", NULL);
+    zactor_destroy(&reactor->beacon);
+}
+
+bool reactor_pair(struct reactor_t* reactor, const char* endpoint)
+{
+    struct device_instance_t* instance = reactor->instance;
+    zsys_info("connecting to: %s", endpoint);
+    instance->paired = pair_connect(endpoint);
+    if (instance->paired == NULL) {
+        endpoint_release(instance);
+        return false;
+    }
+    instance->session_live = false;
+    reactor->session_deadline_ns = monotonic_ns() + SESSION_TIMEOUT_MS * 1000000ull;
+    uplink_reset(instance);
+    send_pairing_magic(instance, instance->paired);
+
+    reactor->monitor = zactor_new(zmonitor, instance->paired);
+    zstr_sendx(reactor->monitor, "LISTEN", "DISCONNECTED", NULL);
+    zstr_sendx(reactor->monitor, "START", NULL);
+    zsock_wait(reactor->monitor);
+
+    reactor->state = Paired;
+    return reactor_watch(reactor, zsock_fd(instance->paired), REACTOR_PAIR, EPOLLIN | EPOLLET)
+        && reactor_watch(reactor, zsock_fd(reactor->monitor), REACTOR_MONITOR, EPOLLIN | EPOLLET);
+}
+
+void reactor_watch_udp(struct reactor_t* reactor)
+{
+    reactor_watch(reactor, reactor->instance->udp_fd, REACTOR_UDP, EPOLLIN);
+}
+
+void reactor_unpair(struct reactor_t* reactor)
+{
+    struct device_instance_t* instance = reactor->instance;
+    if (instance->udp_fd >= 0) {
+        reactor_unwatch(reactor, instance->udp_fd);
+        udp_close(instance);
+    }
+    reactor_unwatch(reactor, zsock_fd(reactor->monitor));
+    reactor_unwatch(reactor, zsock_fd(instance->paired));
+    zactor_destroy(&reactor->monitor);
+    zsock_destroy(&instance->paired);
+}
+
+bool reactor_on_beacon(struct reactor_t* reactor)
+{
+    while (reactor->beacon != NULL && (zsock_events(reactor->beacon) & ZMQ_POLLIN)) {
+        char* ip_addr = NULL;
+        char* magic = NULL;
+        unsigned int port = 0;
+        if (zsock_recv(reactor->beacon, "ss", &ip_addr, &magic) == 0
+            && beacon_parse_port(magic, &port)) {
+            char endpoint[128];
+            snprintf(endpoint, sizeof(endpoint), "tcp://%s:%u", ip_addr, port);
+            zsys_info("Got a beacon: %s | %s, | %u", ip_addr, magic, port);
+            if (!endpoint_claim(reactor->instance, endpoint)) {
+                freen(ip_addr);
+                freen(magic);
+                continue; // a sibling's seat
+            }
+            snprintf(reactor->instance->server_ip, sizeof(reactor->instance->server_ip), "%s",
+                ip_addr);
+            freen(ip_addr);
+            freen(magic);
+            reactor_stop_beacon(reactor);
+            return reactor_pair(reactor, endpoint);
+        }
+        freen(ip_addr);
+        freen(magic);
+    }
+    return true;
+}
+
+// Input was just applied; replace the queued reports right away.
+void reactor_input_applied(struct reactor_t* reactor, uint32_t generation)
+{
+    if (g_options.latest_state && reactor->endpoints_open
+        && !reactor->instance->channel.macro.running
+        && generation != reactor->instance->joystick_data_generation) {
+        ffs_aio_engine_cancel_in(&reactor->endpoints.engine);
+    }
+}
+
+void reactor_on_pair(struct reactor_t* reactor)
+{
+    struct device_instance_t* instance = reactor->instance;
+    uint32_t generation = instance->joystick_data_generation;
+    while (instance->paired != NULL && (zsock_events(instance->paired) & ZMQ_POLLIN)) {
+        handler(NULL, instance->paired, instance);
+    }
+    reactor_input_applied(reactor, generation);
+}
+
+void reactor_on_udp(struct reactor_t* reactor)
+{
+    uint32_t generation = reactor->instance->joystick_data_generation;
+    udp_handler(NULL, NULL, reactor->instance);
+    reactor_input_applied(reactor, generation);
+}
+
+bool reactor_on_monitor(struct reactor_t* reactor)
+{
+    while (reactor->monitor != NULL && (zsock_events(reactor->monitor) & ZMQ_POLLIN)) {
+        char* msg = zstr_recv(reactor->monitor);
+        bool disconnected = msg != NULL && strncmp(msg, "DISCONNECTED", strlen("DISCONNECTED")) == 0;
+        freen(msg);
+        // before the session is up, reactor_check_session decides
+        if (disconnected && reactor->instance->session_live) {
+            zsys_info("disconnected, resuming at %s", reactor->instance->endpoint);
+            reactor_unpair(reactor);
+            return reactor_pair(reactor, reactor->instance->endpoint);
+        }
+    }
+    return true;
+}
+
+// A connection still without a session at its deadline is given up, and the
+// seat with it.
+bool reactor_check_session(struct reactor_t* reactor)
+{
+    struct device_instance_t* instance = reactor->instance;
+    if (reactor->state != Paired || instance->session_live
+        || monotonic_ns() < reactor->session_deadline_ns) {
+        return true;
+    }
+    zsys_info("no session from %s, back to beaconing", instance->endpoint);
+    reactor_unpair(reactor);
+    endpoint_release(instance);
+    return reactor_start_beacon(reactor);
+}
+
+void reactor_close_endpoints(struct reactor_t* reactor)
+{
+    if (reactor->endpoints_open) {
+        reactor_unwatch(reactor, reactor->endpoints.engine.eventfd);
+        ep_aio_close(&reactor->endpoints);
+        reactor->endpoints_open = false;
+    }
+}
+
+// Endpoint I/O blocks until the function is enabled, so the engine is only
+// brought up on ENABLE and torn down again on DISABLE/UNBIND.
+void reactor_open_endpoints(struct reactor_t* reactor)
+{
+    if (reactor->endpoints_open) {
+        return;
+    }
+    if (!ep_aio_open(&reactor->endpoints)) {
+        ep_aio_close(&reactor->endpoints);
+        return;
+    }
+    reactor->endpoints_open = true;
+    reactor_watch(reactor, reactor->endpoints.engine.eventfd, REACTOR_ENDPOINTS, EPOLLIN);
+}
+
+bool reactor_on_ep0(struct reactor_t* reactor)
+{
+    ssize_t bytes_read = read(reactor->ep0_fd, reactor->events, sizeof(reactor->events));
+    if (bytes_read < 0) {
+        return errno == EAGAIN || errno == EINTR;
+    }
+    const struct usb_functionfs_event* event = reactor->events;
+    for (size_t n = 0; n < bytes_read / sizeof(*event); ++n, ++event) {
+        switch (event->type) {
+        case FUNCTIONFS_ENABLE:
+            LOG_INFO("Event %s", names[event->type]);
+            reactor_open_endpoints(reactor);
+            break;
+        case FUNCTIONFS_DISABLE:
+        case FUNCTIONFS_UNBIND:
+            LOG_INFO("Event %s", names[event->type]);
+            reactor_close_endpoints(reactor);
+            break;
+        case FUNCTIONFS_BIND:
+        case FUNCTIONFS_SUSPEND:
+        case FUNCTIONFS_RESUME:
+            LOG_INFO("Event %s", names[event->type]);
+            break;
+        case FUNCTIONFS_SETUP:
+            handle_setup(reactor->ep0_fd, &event->u.setup);
+            break;
+        default:
+            LOG_WARNING("Event %03u (unknown)", event->type);
+        }
+    }
+    return true;
+}
+
+bool reactor_init(struct reactor_t* reactor, struct device_instance_t* instance)
 {
-    pthread_t comm_thread;
-    pthread_create(&comm_thread, 0, comm, NULL);
+    memset(reactor, 0, sizeof(*reactor));
+    reactor->instance = instance;
+    instance->reactor = reactor;
+    reactor->ep0_fd = -1;
+    reactor->timer_fd = -1;
+    reactor->endpoints.instance = instance;
+    reactor->endpoints.ep1_fd = -1;
+    reactor->endpoints.ep2_fd = -1;
+
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epoll_fd < 0) {
+        perror("epoll_create1");
+        return false;
+    }
 
-    struct usb_endpoint_thread_t ep0_thread = {
-        .data = NULL,
-        .setup_fn = ep0_setup,
-        .loop_fn = ep0_loop,
-        .cleanup_fn = ep0_cleanup,
+    char* ep0_path;
+    if (asprintf(&ep0_path, "%s/%s", instance->mount_point, "ep0") <= 0) {
+        return false;
+    }
+    reactor->ep0_fd = open(ep0_path, O_RDWR | O_NONBLOCK);
+    free(ep0_path);
+    if (reactor->ep0_fd < 0) {
+        printf("ep0 fd open failed\n");
+        return false;
+    }
+    write_descriptors(reactor->ep0_fd);
+
+    reactor->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec interval = {
+        .it_interval = { .tv_nsec = REACTOR_TIMER_INTERVAL_MS * 1000000 },
+        .it_value = { .tv_nsec = REACTOR_TIMER_INTERVAL_MS * 1000000 },
     };
-    thread_run(&ep0_thread);
+    if (reactor->timer_fd < 0 || timerfd_settime(reactor->timer_fd, 0, &interval, NULL) < 0) {
+        perror("timerfd");
+        return false;
+    }
+
+    return reactor_watch(reactor, reactor->ep0_fd, REACTOR_EP0, EPOLLIN)
+        && reactor_watch(reactor, reactor->timer_fd, REACTOR_TIMER, EPOLLIN)
+        && reactor_watch(reactor, instance->channel.uplink_eventfd, REACTOR_UPLINK, EPOLLIN)
+        && reactor_start_beacon(reactor);
+}
+
+void reactor_cleanup(struct reactor_t* reactor)
+{
+    reactor_close_endpoints(reactor);
+    if (reactor->instance->paired != NULL) {
+        reactor_unpair(reactor);
+        endpoint_release(reactor->instance);
+    }
+    if (reactor->beacon != NULL) {
+        reactor_stop_beacon(reactor);
+    }
+    if (reactor->timer_fd >= 0) {
+        close(reactor->timer_fd);
+    }
+    if (reactor->ep0_fd >= 0) {
+        close(reactor->ep0_fd);
+    }
+    if (reactor->epoll_fd >= 0) {
+        close(reactor->epoll_fd);
+    }
+}
+
+// One reactor per instance, each on its own (optionally pinned) thread.
+void* reactor_run(void* instance_void)
+{
+    zsys_set_logstream(stderr);
+
+    struct reactor_t reactor;
+    bool ok = reactor_init(&reactor, instance_void);
+    while (ok) {
+        struct epoll_event events[8];
+        int count = epoll_wait(reactor.epoll_fd, events, 8, -1);
+        if (count < 0) {
+            ok = errno == EINTR;
+            continue;
+        }
+        for (int i = 0; i < count && ok; ++i) {
+            switch ((enum reactor_source)events[i].data.u32) {
+            case REACTOR_EP0:
+                ok = reactor_on_ep0(&reactor);
+                break;
+            case REACTOR_ENDPOINTS:
+                if (!ffs_aio_engine_process(&reactor.endpoints.engine)) {
+                    printf("EP AIO: endpoint error, waiting for re-enable\n");
+                    reactor_close_endpoints(&reactor);
+                }
+                break;
+            case REACTOR_BEACON:
+                ok = reactor_on_beacon(&reactor);
+                break;
+            case REACTOR_PAIR:
+                reactor_on_pair(&reactor);
+                break;
+            case REACTOR_MONITOR:
+                ok = reactor_on_monitor(&reactor);
+                break;
+            case REACTOR_UDP:
+                reactor_on_udp(&reactor);
+                break;
+            case REACTOR_UPLINK:
+                uplink_send(reactor.instance);
+                break;
+            case REACTOR_TIMER: {
+                uint64_t expirations;
+                if (read(reactor.timer_fd, &expirations, sizeof(expirations)) < 0) {
+                    break;
+                }
+                reactor_on_pair(&reactor);
+                ok = reactor_on_monitor(&reactor) && reactor_check_session(&reactor)
+                    && reactor_on_beacon(&reactor);
+                break;
+            }
+            }
+        }
+    }
+    reactor_cleanup(&reactor);
+    capture_stop(instance_void);
+    return NULL;
+}
+
+// Files named on the command line are shared as is by a single instance and
+// get a .n suffix per instance otherwise.
+const char* instance_path(const char* path, unsigned index)
+{
+    char* suffixed;
+    if (path == NULL || g_options.instance_count == 1) {
+        return path;
+    }
+    if (asprintf(&suffixed, "%s.%u", path, index) <= 0) {
+        return NULL;
+    }
+    return suffixed;
+}
+
+bool instance_init(struct device_instance_t* instance, unsigned index, bool state_events)
+{
+    instance->channel.index = index;
+    instance->channel.state_eventfd = -1;
+    instance->channel.uplink_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (instance->channel.uplink_eventfd < 0) {
+        perror("uplink eventfd");
+        return false;
+    }
+    if (state_events) {
+        instance->channel.state_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (instance->channel.state_eventfd < 0) {
+            perror("state eventfd");
+            return false;
+        }
+    }
+    if (g_options.profile->protocol == PROFILE_PROTOCOL_PROCON
+        && !procon_init(&instance->procon, index)) {
+        perror("procon eventfd");
+        return false;
+    }
+    instance->channel.record_path = instance_path(g_output_config.record_path, index);
+    instance->replay_path = instance_path(g_options.replay_path, index);
+    const char* capture_path = instance_path(g_options.capture_path, index);
+    if (capture_path != NULL) {
+        if (!capture_open(&instance->capture, capture_path, g_options.capture_kind)) {
+            return false;
+        }
+        instance->capturing = true;
+    }
+
+    if (index == 0) {
+        snprintf(instance->mount_point, sizeof(instance->mount_point), "%s",
+            FUNCTIONFS_MOUNT_POINT);
+    } else {
+        snprintf(instance->mount_point, sizeof(instance->mount_point), "%s%u",
+            FUNCTIONFS_MOUNT_POINT, index);
+    }
+    instance->cpu = g_options.cpus[index];
+    macro_start(&instance->channel.macro, g_options.macro_path != NULL ? &g_macro : NULL);
+    instance->joystick_data = (struct mapping_output_t)MAPPING_OUTPUT_INIT;
+    // Neutral until the first frame: a zeroed report holds the HAT up. As
+    // generation 0 it never counts as an input change.
+    joystick_seqlock_write(&instance->channel.state,
+        &(struct joystick_state_t) { .report = instance->joystick_data.report });
+    instance->udp_fd = -1;
+    return true;
+}
+
+// The option that puts the endpoints on the AIO engine, as given on the
+// command line: -l and -r imply -a. NULL for the blocking ep threads.
+const char* aio_option_given(void)
+{
+    if (g_options.latest_state) {
+        return "-l";
+    }
+    if (g_options.reactor) {
+        return "-r";
+    }
+    return g_options.aio_depth != 0 ? "-a" : NULL;
+}
+
+void usage(const char* argv0)
+{
+    fprintf(stderr,
+        "usage: %s [-b backend] [-m profile] [-l] [-a depth] [-r] [-U] [-i seconds] [-P us]\n"
+        "          [-o file] [-n count] [-c cpu[,cpu...]] [-w file [-k kind]]\n"
+        "          [-p file [-x passes]] [-M macro] [-S us] [-R spec] [-C controller] [-G]\n"
+        "  -b  report output: ffs (USB gadget, default), uinput (virtual gamepad) or mock\n"
+        "  -m  button/axis mapping profile (default: built-in, as profiles/xbox_pokken.map)\n"
+        "  -l  latest-state reports: replace the queued ep1 report on every input change\n"
+        "  -a  service ep1/ep2 through AIO from one thread, keeping depth reports queued\n"
+        "  -r  single-threaded epoll reactor for ep0, ep1, ep2 and the input socket\n"
+        "  -U  stream state over UDP datagrams instead of the TCP PAIR socket\n"
+        "  -i  dump per-stage latency histograms every interval (always on SIGUSR1)\n"
+        "  -P  mock: host polling interval (default 2000 us)\n"
+        "  -o  mock: record every polled report to this file or FIFO (FILE.n per instance)\n"
+        "  -n  emulate this many controllers, instance n on FunctionFS at %s[n]\n"
+        "  -c  pin each instance's threads to these CPUs, in instance order\n"
+        "  -w  capture the session to this file (FILE.n per instance)\n"
+        "  -k  what -w captures: input (state frames, before mapping; default) or report\n"
+        "  -p  replay a capture instead of pairing with a server (FILE.n per instance)\n"
+        "  -x  replay passes, 0 for endless (default 1); the last state is then held\n"
+        "  -M  play this macro, timed in host polls, from the first poll (see macro.h)\n"
+        "  -S  threaded ep1: sample each report this long before the host's next poll\n"
+        "  -R  real-time mode: lock memory, prefault, and schedule threads per spec:\n"
+        "      on, a policy for all (fifo:80, rr:50, other) or per role (io=fifo:80,\n"
+        "      control=fifo:50,comm=fifo:70; those are the defaults); see rt.h\n"
+        "  -C  controller on FunctionFS: horipad (default), core-plus or procon; see profile.h\n"
+        "  -G  print the controller's gadget IDs and strings for setup.sh, and exit\n",
+        argv0, FUNCTIONFS_MOUNT_POINT);
+}
+
+// The profile's gadget identity as shell assignments, for setup.sh.
+void gadget_print(const struct profile_t* profile)
+{
+    printf("vendor_id=0x%04x\n", profile->vendor_id);
+    printf("product_id=0x%04x\n", profile->product_id);
+    printf("bcd_device=0x%04x\n", profile->bcd_device);
+    printf("manufacturer='%s'\n", profile->manufacturer);
+    printf("product='%s'\n", profile->product);
+    printf("serial='%s'\n", profile->serial != NULL ? profile->serial : "");
+}
 
-    pthread_join(ep0_thread.pthread, NULL);
-    pthread_join(comm_thread, NULL);
+int main(int argc, char** argv)
+{
+    bool print_gadget = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:m:la:rUi:P:o:n:c:w:k:p:x:M:S:R:C:Gh")) != -1) {
+        switch (opt) {
+        case 'b': {
+            g_options.backend = NULL;
+            for (size_t n = 0; n < sizeof(backends) / sizeof(backends[0]); ++n) {
+                if (strcmp(optarg, backends[n]->name) == 0) {
+                    g_options.backend = backends[n];
+                }
+            }
+            if (g_options.backend == NULL) {
+                fprintf(stderr, "unknown backend %s\n", optarg);
+                return 1;
+            }
+            break;
+        }
+        case 'm':
+            g_options.mapping_path = optarg;
+            break;
+        case 'l':
+            g_options.latest_state = true;
+            break;
+        case 'a':
+            g_options.aio_depth = strtoul(optarg, NULL, 0);
+            if (g_options.aio_depth == 0 || g_options.aio_depth > FFS_AIO_MAX_DEPTH) {
+                fprintf(stderr, "aio depth must be 1..%i\n", FFS_AIO_MAX_DEPTH);
+                return 1;
+            }
+            break;
+        case 'r':
+            g_options.reactor = true;
+            break;
+        case 'U':
+            g_options.udp = true;
+            break;
+        case 'i':
+            g_options.stats_interval = strtoul(optarg, NULL, 0);
+            break;
+        case 'P':
+            g_output_config.poll_us = strtoul(optarg, NULL, 0);
+            if (g_output_config.poll_us == 0) {
+                fprintf(stderr, "polling interval must be at least 1 us\n");
+                return 1;
+            }
+            break;
+        case 'o':
+            g_output_config.record_path = optarg;
+            break;
+        case 'n':
+            g_options.instance_count = strtoul(optarg, NULL, 0);
+            if (g_options.instance_count == 0 || g_options.instance_count > DEVICE_MAX_INSTANCES) {
+                fprintf(stderr, "instance count must be 1..%i\n", DEVICE_MAX_INSTANCES);
+                return 1;
+            }
+            break;
+        case 'w':
+            g_options.capture_path = optarg;
+            break;
+        case 'k':
+            if (!capture_parse_kind(optarg, &g_options.capture_kind)) {
+                fprintf(stderr, "capture kind is input or report\n");
+                return 1;
+            }
+            break;
+        case 'p':
+            g_options.replay_path = optarg;
+            break;
+        case 'x':
+            g_options.replay_passes = strtoul(optarg, NULL, 0);
+            break;
+        case 'M':
+            g_options.macro_path = optarg;
+            break;
+        case 'S':
+            g_options.sample_lead_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'R':
+            if (!rt_parse(&g_rt_config, optarg)) {
+                fprintf(stderr, "bad real-time spec %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'C':
+            g_options.profile = profile_find(optarg);
+            if (g_options.profile == NULL) {
+                fprintf(stderr, "unknown controller %s; one of:", optarg);
+                for (size_t n = 0; n < g_profile_count; ++n) {
+                    fprintf(stderr, " %s", g_profiles[n]->name);
+                }
+                fprintf(stderr, "\n");
+                return 1;
+            }
+            break;
+        case 'G':
+            print_gadget = true;
+            break;
+        case 'c': {
+            char* cpu = optarg;
+            for (unsigned n = 0; n < DEVICE_MAX_INSTANCES && *cpu != '\0'; ++n) {
+                g_options.cpus[n] = strtol(cpu, &cpu, 0);
+                cpu += *cpu == ',';
+            }
+            break;
+        }
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (print_gadget) {
+        gadget_print(g_options.profile);
+        return 0;
+    }
+
+    bool mapped = g_options.mapping_path != NULL
+        ? mapping_load(&g_mapping, g_options.mapping_path)
+        : mapping_parse(&g_mapping, mapping_default_profile, "built-in profile");
+    if (!mapped) {
+        return 1;
+    }
+    if (g_options.macro_path != NULL) {
+        if (g_options.backend == &g_uinput_backend) {
+            fprintf(stderr, "uinput has no host polls to time a macro by\n");
+            return 1;
+        }
+        if (!macro_load(&g_macro, g_options.macro_path)) {
+            return 1;
+        }
+    }
+
+    rt_setup_process(&g_rt_config);
+    log_start();
+    latency_start_reporter(g_options.stats_interval);
+
+    // Checked against the options as given, before -l and -r imply -a, so the
+    // message names the option that was actually passed.
+    const char* aio_option = aio_option_given();
+    if (g_options.profile->protocol == PROFILE_PROTOCOL_PROCON
+        && (g_options.backend != &g_ffs_backend || aio_option != NULL
+            || g_options.sample_lead_us != 0)) {
+        fprintf(stderr, "%s: the Pro Controller runs on FunctionFS with the blocking ep threads\n",
+            g_options.backend != &g_ffs_backend ? "-b" : aio_option != NULL ? aio_option : "-S");
+        return 1;
+    }
+    if (g_options.sample_lead_us != 0 && aio_option != NULL) {
+        fprintf(stderr, "-S schedules the blocking ep1 write; %s keeps reports queued in AIO\n",
+            aio_option);
+        return 1;
+    }
+
+    g_output_config.latest_state = g_options.latest_state;
+    if (g_options.reactor || g_options.latest_state) {
+        // both run the endpoints through the AIO engine
+        if (g_options.aio_depth == 0) {
+            g_options.aio_depth = 1;
+        }
+    }
+
+    if (g_options.reactor && g_options.backend != &g_ffs_backend) {
+        fprintf(stderr, "the reactor drives FunctionFS endpoints only\n");
+        return 1;
+    }
+    if (g_options.reactor && g_options.replay_path != NULL) {
+        fprintf(stderr, "replay feeds the threaded output path, not the reactor\n");
+        return 1;
+    }
+    bool state_events = !g_options.reactor
+        && (g_options.latest_state || g_options.backend->needs_state_events);
+    for (unsigned n = 0; n < g_options.instance_count; ++n) {
+        if (!instance_init(&g_instances[n], n, state_events)) {
+            return 1;
+        }
+    }
+
+    static pthread_t comm_threads[DEVICE_MAX_INSTANCES];
+    static struct usb_endpoint_thread_t output_threads[DEVICE_MAX_INSTANCES];
+    printf("output: %s x%u\n", g_options.backend->name, g_options.instance_count);
+    for (unsigned n = 0; n < g_options.instance_count; ++n) {
+        struct device_instance_t* instance = &g_instances[n];
+        if (g_options.reactor) {
+            // the one thread polls ep1 too
+            thread_start(&comm_threads[n], reactor_run, instance, instance->cpu, RT_ROLE_IO);
+            continue;
+        }
+        thread_start(&comm_threads[n], instance->replay_path != NULL ? replay : comm, instance,
+            instance->cpu, RT_ROLE_COMM);
+        output_threads[n] = (struct usb_endpoint_thread_t) {
+            .data = &instance->channel,
+            .setup_fn = g_options.backend->setup_fn,
+            .loop_fn = g_options.backend->loop_fn,
+            .cleanup_fn = g_options.backend->cleanup_fn,
+        };
+        // FunctionFS starts at ep0, which starts the endpoint threads; the
+        // other backends deliver reports from this thread
+        thread_run(&output_threads[n], instance->cpu,
+            g_options.backend == &g_ffs_backend ? RT_ROLE_CONTROL : RT_ROLE_IO);
+    }
+
+    for (unsigned n = 0; n < g_options.instance_count; ++n) {
+        if (!g_options.reactor) {
+            pthread_join(output_threads[n].pthread, NULL);
+        }
+        pthread_join(comm_threads[n], NULL);
+    }
 
     printf("join done\n");
 
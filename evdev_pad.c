@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+#include "evdev_pad.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BITS_PER_LONG (sizeof(unsigned long) * 8)
+#define BITS_LONGS(n) (((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+static bool test_bit(const unsigned long* bits, unsigned bit)
+{
+    return (bits[bit / BITS_PER_LONG] >> (bit % BITS_PER_LONG)) & 1;
+}
+
+static int16_t scale_axis(const struct evdev_pad_t* pad, uint8_t axis, int32_t value)
+{
+    if (pad->abs_range[axis] == 0) {
+        return 0;
+    }
+    int64_t scaled = (int64_t)(value - pad->abs_min[axis]) * 65534 / pad->abs_range[axis] - 32767;
+    return scaled < -32767 ? -32767 : scaled > 32767 ? 32767 : scaled;
+}
+
+static void add_button(struct evdev_pad_t* pad, unsigned code)
+{
+    if (pad->button_count < WIRE_MAX_BUTTONS) {
+        pad->buttons[pad->button_count] = code;
+        pad->key_index[code] = ++pad->button_count;
+    }
+}
+
+// Read the full current state, as after open or a SYN_DROPPED.
+static bool sync_state(struct evdev_pad_t* pad)
+{
+    unsigned long keys[BITS_LONGS(KEY_CNT)] = { 0 };
+    if (ioctl(pad->fd, EVIOCGKEY(sizeof(keys)), keys) < 0) {
+        return false;
+    }
+    pad->pending.buttons = 0;
+    for (uint8_t n = 0; n < pad->button_count; ++n) {
+        pad->pending.buttons |= (uint32_t)test_bit(keys, pad->buttons[n]) << n;
+    }
+    for (uint8_t n = 0; n < pad->axis_count; ++n) {
+        struct input_absinfo abs;
+        if (ioctl(pad->fd, EVIOCGABS(pad->axes[n]), &abs) < 0) {
+            return false;
+        }
+        pad->pending.axes[n] = scale_axis(pad, n, abs.value);
+    }
+    return true;
+}
+
+bool evdev_pad_open(struct evdev_pad_t* pad, const char* path, bool grab)
+{
+    memset(pad, 0, sizeof(*pad));
+    pad->rumble_effect = -1;
+    bool writable = true;
+    pad->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (pad->fd < 0 && errno == EACCES) {
+        writable = false;
+        pad->fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    }
+    if (pad->fd < 0) {
+        perror(path);
+        return false;
+    }
+
+    int clock = CLOCK_MONOTONIC;
+    unsigned long keys[BITS_LONGS(KEY_CNT)] = { 0 };
+    unsigned long abs[BITS_LONGS(ABS_CNT)] = { 0 };
+    if (ioctl(pad->fd, EVIOCSCLOCKID, &clock) < 0
+        || ioctl(pad->fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys) < 0
+        || ioctl(pad->fd, EVIOCGBIT(EV_ABS, sizeof(abs)), abs) < 0) {
+        perror("evdev setup");
+        evdev_pad_close(pad);
+        return false;
+    }
+    unsigned long ff[BITS_LONGS(FF_CNT)] = { 0 };
+    pad->can_rumble = writable && ioctl(pad->fd, EVIOCGBIT(EV_FF, sizeof(ff)), ff) >= 0
+        && test_bit(ff, FF_RUMBLE);
+    if (grab && ioctl(pad->fd, EVIOCGRAB, 1) < 0) {
+        perror("EVIOCGRAB");
+        evdev_pad_close(pad);
+        return false;
+    }
+
+    // joydev's order: BTN_MISC and above first, then the keys below it
+    for (unsigned code = BTN_MISC; code < KEY_CNT; ++code) {
+        if (test_bit(keys, code)) {
+            add_button(pad, code);
+        }
+    }
+    for (unsigned code = 0; code < BTN_MISC; ++code) {
+        if (test_bit(keys, code)) {
+            add_button(pad, code);
+        }
+    }
+    for (unsigned code = 0; code < ABS_CNT && pad->axis_count < WIRE_MAX_AXES; ++code) {
+        struct input_absinfo info;
+        if (!test_bit(abs, code) || ioctl(pad->fd, EVIOCGABS(code), &info) < 0) {
+            continue;
+        }
+        uint8_t axis = pad->axis_count++;
+        pad->axes[axis] = code;
+        pad->abs_index[code] = axis + 1;
+        pad->abs_min[axis] = info.minimum;
+        pad->abs_range[axis] = info.maximum - info.minimum;
+    }
+
+    pad->pending.button_count = pad->button_count;
+    pad->pending.axis_count = pad->axis_count;
+    if (!sync_state(pad)) {
+        perror("evdev state");
+        evdev_pad_close(pad);
+        return false;
+    }
+
+    char name[128] = "?";
+    ioctl(pad->fd, EVIOCGNAME(sizeof(name)), name);
+    printf("evdev %s: %s, %u buttons, %u axes%s%s\n", path, name, pad->button_count,
+        pad->axis_count, pad->can_rumble ? ", rumble" : "", grab ? ", grabbed" : "");
+    return true;
+}
+
+void evdev_pad_close(struct evdev_pad_t* pad)
+{
+    if (pad->fd >= 0) {
+        close(pad->fd);
+        pad->fd = -1;
+    }
+}
+
+bool evdev_pad_rumble(struct evdev_pad_t* pad, uint16_t strong, uint16_t weak)
+{
+    if (!pad->can_rumble) {
+        return false;
+    }
+    // replay.length 0: plays until stopped; uploading over a playing effect
+    // changes it without a restart
+    struct ff_effect effect = {
+        .type = FF_RUMBLE,
+        .id = pad->rumble_effect,
+        .u.rumble = { .strong_magnitude = strong, .weak_magnitude = weak },
+    };
+    if (ioctl(pad->fd, EVIOCSFF, &effect) < 0) {
+        return false;
+    }
+    pad->rumble_effect = effect.id;
+    bool rumbling = strong != 0 || weak != 0;
+    if (rumbling != pad->rumbling) {
+        struct input_event play = { .type = EV_FF, .code = effect.id, .value = rumbling };
+        if (write(pad->fd, &play, sizeof(play)) != sizeof(play)) {
+            return false;
+        }
+        pad->rumbling = rumbling;
+    }
+    return true;
+}
+
+size_t evdev_pad_apply(struct evdev_pad_t* pad, struct wire_state_t* state,
+    const struct input_event* events, size_t count, uint64_t* frame_ns)
+{
+    size_t frames = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const struct input_event* event = &events[i];
+        if (event->type == EV_SYN) {
+            if (event->code == SYN_DROPPED) {
+                pad->dropped = true;
+            } else if (event->code == SYN_REPORT) {
+                if (pad->dropped) {
+                    pad->dropped = false;
+                    sync_state(pad);
+                }
+                *frame_ns = event->input_event_sec * 1000000000ull
+                    + event->input_event_usec * 1000ull;
+                pad->pending.time = (uint32_t)(*frame_ns / 1000000);
+                *state = pad->pending;
+                ++frames;
+            }
+            continue;
+        }
+        if (pad->dropped) {
+            continue;
+        }
+        if (event->type == EV_KEY && event->code < KEY_CNT && pad->key_index[event->code] != 0) {
+            uint32_t bit = 1u << (pad->key_index[event->code] - 1);
+            uint32_t held = pad->pending.buttons & ~bit;
+            pad->pending.buttons = event->value ? held | bit : held;
+        } else if (event->type == EV_ABS && event->code < ABS_CNT
+            && pad->abs_index[event->code] != 0) {
+            uint8_t axis = pad->abs_index[event->code] - 1;
+            pad->pending.axes[axis] = scale_axis(pad, axis, event->value);
+        }
+    }
+    return frames;
+}
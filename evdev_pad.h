@@ -0,0 +1,55 @@
+#pragma once
+
+#include <linux/input.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "wire.h"
+
+// A pad read through evdev instead of the joystick interface. Buttons and
+// axes are numbered the way joydev numbers them (BTN_MISC and up, then the
+// keys below; axes in ABS code order) and axes are scaled to -32767..32767,
+// so the state matches what js0 would have produced and mapping profiles
+// carry over.
+//
+// The kernel marks the end of every input frame with SYN_REPORT. Events are
+// folded into `pending` and only committed to the caller's state at a
+// SYN_REPORT, so a frame is never sent half-applied. Timestamps are switched
+// to CLOCK_MONOTONIC, microsecond resolution and directly comparable with
+// monotonic_ns().
+
+struct evdev_pad_t {
+    int fd;
+    uint8_t button_count;
+    uint8_t axis_count;
+    // evdev code -> joydev number + 1; 0 for codes we don't report
+    uint8_t key_index[KEY_CNT];
+    uint8_t abs_index[ABS_CNT];
+    uint16_t buttons[WIRE_MAX_BUTTONS]; // joydev number -> evdev code
+    uint16_t axes[WIRE_MAX_AXES];
+    int32_t abs_min[WIRE_MAX_AXES];
+    int32_t abs_range[WIRE_MAX_AXES];
+    struct wire_state_t pending;
+    bool dropped; // SYN_DROPPED: skip to the next SYN_REPORT, then resync
+    // Opened read-write and the pad does FF_RUMBLE.
+    bool can_rumble;
+    bool rumbling;
+    int16_t rumble_effect; // -1 until the first upload
+};
+
+// Opens read-write when allowed, for force feedback. With `grab`, nothing
+// else (joydev, the console, a compositor) sees the pad's events.
+bool evdev_pad_open(struct evdev_pad_t* pad, const char* path, bool grab);
+void evdev_pad_close(struct evdev_pad_t* pad);
+
+// Play FF_RUMBLE at these motor magnitudes until the next call; both zero
+// stops it. One effect is kept uploaded and updated in place. False if the
+// pad can't rumble or the kernel refused.
+bool evdev_pad_rumble(struct evdev_pad_t* pad, uint16_t strong, uint16_t weak);
+
+// Fold `count` events; at every SYN_REPORT the pending state is committed to
+// `state` and `frame_ns` set to that frame's timestamp. Returns the number of
+// frames committed.
+size_t evdev_pad_apply(struct evdev_pad_t* pad, struct wire_state_t* state,
+    const struct input_event* events, size_t count, uint64_t* frame_ns);
@@ -0,0 +1,162 @@
+#include "ffs_aio.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+
+static void prep_slot(struct ffs_aio_engine_t* engine, struct ffs_aio_slot_t* slot)
+{
+    if (slot->direction == FFS_AIO_IN) {
+        slot->length = engine->ops.fill_in(engine->user, slot);
+        io_prep_ffs(&slot->iocb, engine->in_fd, IOCB_CMD_PWRITE, slot->buf, slot->length,
+            engine->eventfd);
+    } else {
+        slot->length = sizeof(slot->buf);
+        io_prep_ffs(&slot->iocb, engine->out_fd, IOCB_CMD_PREAD, slot->buf, slot->length,
+            engine->eventfd);
+    }
+    // io_prep_ffs points aio_data at the iocb, which is the first member.
+    slot->queued = true;
+    slot->cancelling = false;
+}
+
+static bool submit(struct ffs_aio_engine_t* engine, struct iocb** iocbs, long count)
+{
+    while (count > 0) {
+        int submitted = io_submit(engine->ctx, count, iocbs);
+        if (submitted < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("ffs aio submit");
+            return false;
+        }
+        iocbs += submitted;
+        count -= submitted;
+    }
+    return true;
+}
+
+static bool is_cancellation(long long res)
+{
+    return res == -ECONNRESET || res == -ECANCELED;
+}
+
+bool ffs_aio_engine_init(struct ffs_aio_engine_t* engine, int in_fd, size_t in_depth, int out_fd,
+    size_t out_depth, const struct ffs_aio_ops_t* ops, void* user)
+{
+    memset(engine, 0, sizeof(*engine));
+    engine->eventfd = -1;
+    engine->in_fd = in_fd;
+    engine->out_fd = out_fd;
+    engine->in_depth = in_fd >= 0 ? in_depth : 0;
+    engine->out_depth = out_fd >= 0 ? out_depth : 0;
+    engine->ops = *ops;
+    engine->user = user;
+
+    if (engine->in_depth > FFS_AIO_MAX_DEPTH || engine->out_depth > FFS_AIO_MAX_DEPTH) {
+        fprintf(stderr, "ffs aio: depth limited to %i\n", FFS_AIO_MAX_DEPTH);
+        return false;
+    }
+
+    for (size_t i = 0; i < FFS_AIO_MAX_DEPTH; ++i) {
+        engine->in_slots[i].direction = FFS_AIO_IN;
+        engine->out_slots[i].direction = FFS_AIO_OUT;
+    }
+
+    engine->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (engine->eventfd < 0) {
+        perror("ffs aio eventfd");
+        return false;
+    }
+    if (io_setup(engine->in_depth + engine->out_depth, &engine->ctx) < 0) {
+        perror("ffs aio setup");
+        close(engine->eventfd);
+        engine->eventfd = -1;
+        return false;
+    }
+    return true;
+}
+
+bool ffs_aio_engine_start(struct ffs_aio_engine_t* engine)
+{
+    struct iocb* iocbs[2 * FFS_AIO_MAX_DEPTH];
+    long count = 0;
+    for (size_t i = 0; i < engine->in_depth; ++i) {
+        prep_slot(engine, &engine->in_slots[i]);
+        iocbs[count++] = &engine->in_slots[i].iocb;
+    }
+    for (size_t i = 0; i < engine->out_depth; ++i) {
+        prep_slot(engine, &engine->out_slots[i]);
+        iocbs[count++] = &engine->out_slots[i].iocb;
+    }
+    return submit(engine, iocbs, count);
+}
+
+bool ffs_aio_engine_process(struct ffs_aio_engine_t* engine)
+{
+    eventfd_t completions;
+    eventfd_read(engine->eventfd, &completions);
+
+    struct io_event events[2 * FFS_AIO_MAX_DEPTH];
+    struct timespec no_wait = { 0 };
+    int count = io_getevents(engine->ctx, 0, 2 * FFS_AIO_MAX_DEPTH, events, &no_wait);
+    if (count < 0) {
+        if (errno == EINTR) {
+            return true;
+        }
+        perror("ffs aio getevents");
+        return false;
+    }
+
+    bool ok = true;
+    struct iocb* iocbs[2 * FFS_AIO_MAX_DEPTH];
+    long resubmit = 0;
+    for (int i = 0; i < count; ++i) {
+        struct ffs_aio_slot_t* slot = (struct ffs_aio_slot_t*)(uintptr_t)events[i].data;
+        long long res = events[i].res;
+        slot->queued = false;
+
+        if (slot->direction == FFS_AIO_IN) {
+            engine->ops.in_done(engine->user, slot, res);
+        } else if (!is_cancellation(res)) {
+            engine->ops.out_done(engine->user, slot, res);
+        }
+
+        if (res < 0 && !is_cancellation(res)) {
+            ok = false;
+            continue;
+        }
+        prep_slot(engine, slot);
+        iocbs[resubmit++] = &slot->iocb;
+    }
+
+    return submit(engine, iocbs, resubmit) && ok;
+}
+
+void ffs_aio_engine_cancel_in(struct ffs_aio_engine_t* engine)
+{
+    for (size_t i = 0; i < engine->in_depth; ++i) {
+        struct ffs_aio_slot_t* slot = &engine->in_slots[i];
+        if (!slot->queued || slot->cancelling) {
+            continue;
+        }
+        // Whether or not the cancel wins the race with the host poll, the
+        // outcome is reported through the eventfd like any other completion.
+        struct io_event ignored;
+        io_cancel(engine->ctx, &slot->iocb, &ignored);
+        slot->cancelling = true;
+    }
+}
+
+void ffs_aio_engine_destroy(struct ffs_aio_engine_t* engine)
+{
+    if (engine->ctx != 0) {
+        io_destroy(engine->ctx); // cancels and reaps anything still queued
+        engine->ctx = 0;
+    }
+    if (engine->eventfd >= 0) {
+        close(engine->eventfd);
+        engine->eventfd = -1;
+    }
+}
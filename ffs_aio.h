@@ -0,0 +1,116 @@
+#pragma once
+
+// Thin wrappers around the native Linux AIO syscalls. FunctionFS endpoint files
+// support them directly; glibc does not expose them and we don't want to pull in
+// libaio just for five syscalls.
+
+#include <linux/aio_abi.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static inline int io_setup(unsigned nr_events, aio_context_t* ctx)
+{
+    return syscall(__NR_io_setup, nr_events, ctx);
+}
+
+static inline int io_destroy(aio_context_t ctx)
+{
+    return syscall(__NR_io_destroy, ctx);
+}
+
+static inline int io_submit(aio_context_t ctx, long nr, struct iocb** iocbs)
+{
+    return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static inline int io_cancel(aio_context_t ctx, struct iocb* iocb, struct io_event* result)
+{
+    return syscall(__NR_io_cancel, ctx, iocb, result);
+}
+
+static inline int io_getevents(aio_context_t ctx, long min_nr, long max_nr,
+    struct io_event* events, struct timespec* timeout)
+{
+    return syscall(__NR_io_getevents, ctx, min_nr, max_nr, events, timeout);
+}
+
+// Prepare an iocb whose completion is signalled on the eventfd `resfd`.
+static inline void io_prep_ffs(struct iocb* iocb, int fd, uint16_t opcode, void* buf,
+    size_t len, int resfd)
+{
+    memset(iocb, 0, sizeof(*iocb));
+    iocb->aio_fildes = fd;
+    iocb->aio_lio_opcode = opcode;
+    iocb->aio_buf = (uint64_t)(uintptr_t)buf;
+    iocb->aio_nbytes = len;
+    iocb->aio_data = (uint64_t)(uintptr_t)iocb;
+    iocb->aio_flags = IOCB_FLAG_RESFD;
+    iocb->aio_resfd = resfd;
+}
+
+// Largest report either endpoint moves; matches wMaxPacketSize.
+#define FFS_AIO_REPORT_MAX 64
+#define FFS_AIO_MAX_DEPTH 8
+
+enum ffs_aio_direction {
+    FFS_AIO_IN, // device to host, ep1
+    FFS_AIO_OUT, // host to device, ep2
+};
+
+struct ffs_aio_slot_t {
+    struct iocb iocb;
+    enum ffs_aio_direction direction;
+    bool queued;
+    bool cancelling;
+    size_t length;
+    // What an IN report was built from, for age accounting.
+    uint32_t generation;
+    uint64_t stamp;
+    uint64_t sampled; // monotonic ns the report was filled
+    uint8_t buf[FFS_AIO_REPORT_MAX];
+};
+
+struct ffs_aio_engine_t;
+
+struct ffs_aio_ops_t {
+    // Fill slot->buf with the next IN report, return its length.
+    size_t (*fill_in)(void* user, struct ffs_aio_slot_t* slot);
+    // An IN report was sent (res == length) or cancelled/failed (res < 0).
+    void (*in_done)(void* user, const struct ffs_aio_slot_t* slot, long long res);
+    // An OUT report arrived (res bytes in slot->buf) or the read failed.
+    void (*out_done)(void* user, const struct ffs_aio_slot_t* slot, long long res);
+};
+
+// Keeps `in_depth` IN reports and `out_depth` OUT reads queued on the endpoints
+// at all times. Completions are reported through a single eventfd so any number
+// of endpoints is serviced from one poll()/epoll loop without a thread each.
+struct ffs_aio_engine_t {
+    aio_context_t ctx;
+    int eventfd;
+    int in_fd;
+    int out_fd;
+    size_t in_depth;
+    size_t out_depth;
+    struct ffs_aio_ops_t ops;
+    void* user;
+    struct ffs_aio_slot_t in_slots[FFS_AIO_MAX_DEPTH];
+    struct ffs_aio_slot_t out_slots[FFS_AIO_MAX_DEPTH];
+};
+
+// in_fd/out_fd may be -1 to leave that direction out. Returns false on failure.
+bool ffs_aio_engine_init(struct ffs_aio_engine_t* engine, int in_fd, size_t in_depth, int out_fd,
+    size_t out_depth, const struct ffs_aio_ops_t* ops, void* user);
+// Queue the initial IN reports and OUT reads.
+bool ffs_aio_engine_start(struct ffs_aio_engine_t* engine);
+// Reap whatever completed, hand it to the ops and requeue every slot with a
+// single io_submit. Returns false on an endpoint error (e.g. host gone).
+bool ffs_aio_engine_process(struct ffs_aio_engine_t* engine);
+// Pull back every queued IN report; they are refilled as their cancellations
+// complete, so the host gets whatever fill_in produces by then.
+void ffs_aio_engine_cancel_in(struct ffs_aio_engine_t* engine);
+// Cancels everything outstanding; does not close in_fd/out_fd.
+void ffs_aio_engine_destroy(struct ffs_aio_engine_t* engine);
@@ -0,0 +1,24 @@
+#include "frame_pool.h"
+
+void frame_pool_setup_socket(zsock_t* socket)
+{
+    zsock_set_sndhwm(socket, FRAME_POOL_HWM);
+}
+
+bool frame_pool_send(struct frame_pool_t* pool, zsock_t* socket, size_t size)
+{
+    zmq_msg_t msg;
+    zmq_msg_init_data(&msg, pool->buffers[pool->next], size, NULL, NULL);
+    if (zmq_msg_send(&msg, zsock_resolve(socket), ZMQ_DONTWAIT) < 0) {
+        zmq_msg_close(&msg);
+        return false;
+    }
+    pool->next = (pool->next + 1) % FRAME_POOL_SIZE;
+    return true;
+}
+
+size_t frame_recv(zsock_t* socket, uint8_t* buffer)
+{
+    int size = zmq_recv(zsock_resolve(socket), buffer, WIRE_MAX_FRAME, ZMQ_DONTWAIT);
+    return size < 0 || size > WIRE_MAX_FRAME ? 0 : (size_t)size;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <czmq.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "wire.h"
+
+// Allocation-free streaming of wire frames over a PAIR socket.
+//
+// zsock_send/zsock_recv parse a picture and build a zmsg of zframes for every
+// frame, and the receiver gets a malloc'd copy back. Here frames are encoded
+// straight into one of a ring of preallocated buffers and handed to ZMQ with
+// zmq_msg_init_data and no free function, which makes a constant message:
+// ZMQ neither copies nor allocates for it, nor frees it. Receiving is a raw
+// zmq_recv into the caller's buffer.
+//
+// A constant message's buffer has to outlive the message. The socket's send
+// high-water mark is set below the ring size, and sends never block, so by
+// the time the ring comes back round to a buffer its message has left the
+// pipe and been encoded by the I/O thread: at most FRAME_POOL_HWM messages
+// sit in the pipe and one in the engine. A send that finds the pipe full
+// drops the frame and says so.
+
+#define FRAME_POOL_HWM 64
+#define FRAME_POOL_SIZE (FRAME_POOL_HWM + 4)
+
+struct frame_pool_t {
+    uint8_t buffers[FRAME_POOL_SIZE][WIRE_MAX_FRAME];
+    unsigned next;
+};
+
+// Give a new socket the pool's high-water mark; call before binding or
+// connecting it, since a pipe keeps the mark it was created with.
+void frame_pool_setup_socket(zsock_t* socket);
+
+// The buffer to encode the next frame into.
+static inline uint8_t* frame_pool_buffer(struct frame_pool_t* pool)
+{
+    return pool->buffers[pool->next];
+}
+
+// Send the first `size` bytes of frame_pool_buffer(). False if the frame was
+// dropped because the peer isn't keeping up (or isn't there).
+bool frame_pool_send(struct frame_pool_t* pool, zsock_t* socket, size_t size);
+
+// Receive one frame of up to WIRE_MAX_FRAME bytes into `buffer` without
+// blocking. Returns its size; 0 when there was nothing to read, or the frame
+// was too big to be one of ours and got dropped.
+size_t frame_recv(zsock_t* socket, uint8_t* buffer);
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+// Joystick HID report structure. We have an input and an output.
+struct USB_JoystickReport_Input_t {
+    uint16_t Button; // 16 buttons; see JoystickButtons_t for bit mapping
+    uint8_t HAT; // HAT switch; one nibble w/ unused nibble
+    uint8_t LX; // Left  Stick X
+    uint8_t LY; // Left  Stick Y
+    uint8_t RX; // Right Stick X
+    uint8_t RY; // Right Stick Y
+    uint8_t VendorSpec;
+};
+
+#define HAT_TOP 0x00
+#define HAT_TOP_RIGHT 0x01
+#define HAT_RIGHT 0x02
+#define HAT_BOTTOM_RIGHT 0x03
+#define HAT_BOTTOM 0x04
+#define HAT_BOTTOM_LEFT 0x05
+#define HAT_LEFT 0x06
+#define HAT_TOP_LEFT 0x07
+#define HAT_CENTER 0x08
+
+// The output is structured as a mirror of the input.
+// This is based on initial observations of the Pokken Controller.
+struct USB_JoystickReport_Output_t {
+    uint16_t Button; // 16 buttons; see JoystickButtons_t for bit mapping
+    uint8_t HAT; // HAT switch; one nibble w/ unused nibble
+    uint8_t LX; // Left  Stick X
+    uint8_t LY; // Left  Stick Y
+    uint8_t RX; // Right Stick X
+    uint8_t RY; // Right Stick Y
+};
+
+// Controller state as handed from the input side to the USB side.
+struct joystick_state_t {
+    struct USB_JoystickReport_Input_t report;
+    uint32_t generation; // bumped on every input change
+    uint64_t stamp; // monotonic ns of the last input change
+};
+
+#define JOYSTICK_STATE_WORDS ((sizeof(struct joystick_state_t) + 7) / 8)
+
+// Single-writer seqlock around a joystick_state_t. The writer never waits and
+// holds nothing while it prepares the next state; a reader only retries when it
+// overlaps the handful of stores of a publish. The payload is kept as atomic
+// words so the racing copy is well defined.
+struct joystick_seqlock_t {
+    _Atomic uint32_t sequence;
+    _Atomic uint64_t words[JOYSTICK_STATE_WORDS];
+};
+
+static inline void joystick_seqlock_write(struct joystick_seqlock_t* lock,
+    const struct joystick_state_t* state)
+{
+    uint64_t words[JOYSTICK_STATE_WORDS] = { 0 };
+    memcpy(words, state, sizeof(*state));
+
+    uint32_t sequence = atomic_load_explicit(&lock->sequence, memory_order_relaxed);
+    atomic_store_explicit(&lock->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (size_t i = 0; i < JOYSTICK_STATE_WORDS; ++i) {
+        atomic_store_explicit(&lock->words[i], words[i], memory_order_relaxed);
+    }
+    atomic_store_explicit(&lock->sequence, sequence + 2, memory_order_release);
+}
+
+static inline void joystick_seqlock_read(struct joystick_seqlock_t* lock,
+    struct joystick_state_t* state)
+{
+    uint64_t words[JOYSTICK_STATE_WORDS];
+    uint32_t before, after;
+    do {
+        before = atomic_load_explicit(&lock->sequence, memory_order_acquire);
+        for (size_t i = 0; i < JOYSTICK_STATE_WORDS; ++i) {
+            words[i] = atomic_load_explicit(&lock->words[i], memory_order_relaxed);
+        }
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&lock->sequence, memory_order_relaxed);
+    } while ((before & 1) != 0 || before != after);
+    memcpy(state, words, sizeof(*state));
+}
@@ -0,0 +1,134 @@
+#include "latency.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <time.h>
+
+struct latency_histogram_t g_latency[LATENCY_STAGE_COUNT];
+
+static const char* const stage_names[LATENCY_STAGE_COUNT] = {
+    [LATENCY_PAD_TO_READ] = "pad->read",
+    [LATENCY_READ_TO_SEND] = "read->send",
+    [LATENCY_RUMBLE_APPLY] = "rumble apply",
+    [LATENCY_WIRE] = "wire (excess)",
+    [LATENCY_RECV_TO_PUBLISH] = "recv->publish",
+    [LATENCY_PUBLISH_TO_USB] = "publish->usb",
+    [LATENCY_SAMPLE_TO_USB] = "sample->usb",
+    [LATENCY_POLL_PERIOD] = "poll period",
+    [LATENCY_POLL_JITTER] = "poll jitter",
+    [LATENCY_RUMBLE_ROUND_TRIP] = "rumble rtt",
+    [LATENCY_SEND_TO_ACK] = "send->ack",
+};
+
+static unsigned bucket_index(uint64_t ns)
+{
+    if (ns < LATENCY_SUB_BUCKETS) {
+        return (unsigned)ns;
+    }
+    unsigned magnitude = 63 - __builtin_clzll(ns); // >= LATENCY_SUB_BITS
+    if (magnitude > LATENCY_MAX_BITS) {
+        return LATENCY_BUCKETS - 1;
+    }
+    unsigned shift = magnitude - LATENCY_SUB_BITS;
+    unsigned sub = (unsigned)(ns >> shift) - LATENCY_SUB_BUCKETS;
+    return (shift + 1) * LATENCY_SUB_BUCKETS + sub;
+}
+
+// Upper bound of the values a bucket holds.
+static uint64_t bucket_value(unsigned index)
+{
+    if (index < LATENCY_SUB_BUCKETS) {
+        return index;
+    }
+    unsigned shift = index / LATENCY_SUB_BUCKETS - 1;
+    uint64_t sub = index % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+void latency_record(enum latency_stage stage, uint64_t ns)
+{
+    atomic_fetch_add_explicit(&g_latency[stage].counts[bucket_index(ns)], 1, memory_order_relaxed);
+}
+
+void latency_record_offset(enum latency_stage stage, struct latency_offset_t* offset, int64_t raw_ns)
+{
+    if (!offset->valid || raw_ns < offset->min) {
+        offset->min = raw_ns;
+        offset->valid = true;
+    }
+    latency_record(stage, (uint64_t)(raw_ns - offset->min));
+}
+
+void latency_dump(void)
+{
+    static uint64_t counts[LATENCY_BUCKETS];
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    for (int stage = 0; stage < LATENCY_STAGE_COUNT; ++stage) {
+        uint64_t total = 0;
+        unsigned last = 0;
+        for (unsigned i = 0; i < LATENCY_BUCKETS; ++i) {
+            counts[i] = atomic_exchange_explicit(&g_latency[stage].counts[i], 0, memory_order_relaxed);
+            total += counts[i];
+            if (counts[i] != 0) {
+                last = i;
+            }
+        }
+        if (total == 0) {
+            continue;
+        }
+
+        double values[4];
+        uint64_t seen = 0;
+        unsigned q = 0;
+        for (unsigned i = 0; i < LATENCY_BUCKETS && q < 4; ++i) {
+            seen += counts[i];
+            while (q < 4 && seen >= quantiles[q] * total) {
+                values[q++] = bucket_value(i) / 1e6;
+            }
+        }
+        fprintf(stderr,
+            "latency %-14s n=%-8lu p50 %8.3f  p90 %8.3f  p99 %8.3f  p99.9 %8.3f  max %8.3f ms\n",
+            stage_names[stage], (unsigned long)total, values[0], values[1], values[2], values[3],
+            bucket_value(last) / 1e6);
+    }
+}
+
+static void* reporter(void* interval_void)
+{
+    unsigned interval_s = (unsigned)(uintptr_t)interval_void;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+
+    while (true) {
+        int signal;
+        if (interval_s == 0) {
+            signal = sigwaitinfo(&signals, NULL);
+        } else {
+            struct timespec timeout = { .tv_sec = interval_s };
+            signal = sigtimedwait(&signals, NULL, &timeout);
+        }
+        if (signal == SIGUSR1 || (signal < 0 && errno == EAGAIN)) {
+            latency_dump();
+        }
+    }
+    return NULL;
+}
+
+bool latency_start_reporter(unsigned interval_s)
+{
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, reporter, (void*)(uintptr_t)interval_s) != 0) {
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
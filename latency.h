@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Per-stage latency histograms for the input path, pad to USB bus.
+//
+// Buckets are log-linear like HdrHistogram: every power of two is split into
+// LATENCY_SUB_BUCKETS linear steps, so any value is kept to within ~3% with a
+// few KB per stage. Recording is one relaxed atomic increment and safe from
+// any thread; dumping swaps the counts out, so each dump covers the interval
+// since the previous one.
+
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS 37 // ~137 s in ns; larger values land in the last bucket
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 2) * LATENCY_SUB_BUCKETS)
+
+enum latency_stage {
+    // beacon_server
+    LATENCY_PAD_TO_READ, // pad event timestamp to our read(), above the fastest seen
+    LATENCY_READ_TO_SEND, // read() to the state frame leaving
+    LATENCY_RUMBLE_APPLY, // rumble frame received to the pad playing it
+    // device
+    LATENCY_WIRE, // server send to device receive, above the fastest seen
+    LATENCY_RECV_TO_PUBLISH, // frame received to state published
+    LATENCY_PUBLISH_TO_USB, // state published to the ep1 transfer carrying it completing
+    LATENCY_SAMPLE_TO_USB, // report sampled to its ep1 transfer completing
+    LATENCY_POLL_PERIOD, // between host polls of ep1, as measured from completions
+    LATENCY_POLL_JITTER, // host poll to where it was predicted, either way
+    LATENCY_RUMBLE_ROUND_TRIP, // host's rumble read off ep2 to the server's ack of it playing
+    // loadgen
+    LATENCY_SEND_TO_ACK, // frame sent to the device's ack of the report carrying it
+    LATENCY_STAGE_COUNT,
+};
+
+struct latency_histogram_t {
+    _Atomic uint64_t counts[LATENCY_BUCKETS];
+};
+
+extern struct latency_histogram_t g_latency[LATENCY_STAGE_COUNT];
+
+void latency_record(enum latency_stage stage, uint64_t ns);
+
+// Latency between two unsynchronised clocks: record how far each sample is
+// above the smallest one seen, which is the queueing/jitter part of the delay.
+struct latency_offset_t {
+    int64_t min;
+    bool valid;
+};
+
+void latency_record_offset(enum latency_stage stage, struct latency_offset_t* offset, int64_t raw_ns);
+
+// Print percentiles for every stage with samples and reset them.
+void latency_dump(void);
+
+// Dump on SIGUSR1 and, if interval_s is non-zero, every interval_s seconds.
+// Call from main before starting other threads: it blocks SIGUSR1 for the
+// calling thread so every thread created later inherits that.
+bool latency_start_reporter(unsigned interval_s);
@@ -0,0 +1,350 @@
+// Load generator for the device input path. Stands in for beacon_server: it
+// beacons and pairs the same way, then floods the device with synthetic pad
+// events at a fixed rate instead of reading /dev/input/js0.
+//
+// Events are generated on a timer tick and folded into one state frame per
+// tick, exactly like the server folds whatever the pad had queued. Patterns:
+//   sweep  both left stick axes tracing a diamond
+//   mash   every button toggled in turn
+//   hat    the d-pad rolled through all eight directions
+//   mixed  the three interleaved
+//
+// After pairing the device is asked for report acks: whenever a report with
+// new input reaches the USB host it sends back the seq of the newest frame in
+// it, plus its own counters. That gives send->ack latency (one network hop
+// more than input->report, which is negligible on a LAN) and shows where
+// input was coalesced: folded into a frame here, or overwritten on the
+// device before the host polled it. Without a host polling ep1 there are no
+// acks, and only the send side is reported.
+
+#include <czmq.h>
+#include <linux/joystick.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "frame_pool.h"
+#include "latency.h"
+#include "wire.h"
+
+// Upper bound on events folded into one frame, so a stalled loop sheds load
+// instead of sending one giant catch-up burst.
+#define LOADGEN_MAX_EVENTS_PER_TICK 4096
+#define LOADGEN_BUTTONS 11 // what device.c maps
+#define LOADGEN_AXES 8
+#define LOADGEN_HAT_X 6
+#define LOADGEN_HAT_Y 7
+#define LOADGEN_SEQS 65536
+
+enum loadgen_pattern {
+    PATTERN_SWEEP,
+    PATTERN_MASH,
+    PATTERN_HAT,
+    PATTERN_MIXED,
+};
+
+static const char* const pattern_names[] = {
+    [PATTERN_SWEEP] = "sweep",
+    [PATTERN_MASH] = "mash",
+    [PATTERN_HAT] = "hat",
+    [PATTERN_MIXED] = "mixed",
+};
+
+struct loadgen_t {
+    zsock_t* sock;
+    struct frame_pool_t pool;
+    uint8_t reply[WIRE_MAX_FRAME];
+    enum loadgen_pattern pattern;
+    unsigned rate;
+    uint32_t step;
+    struct wire_state_t state;
+    struct wire_encoder_t encoder;
+    uint64_t sent_ns[LOADGEN_SEQS]; // by frame seq, 0 once acked
+    uint64_t start_ns;
+    // counters
+    uint64_t events;
+    uint64_t shed;
+    uint64_t frames;
+    uint64_t blocked; // frames dropped at the high-water mark
+    uint64_t acks;
+    uint64_t keyframe_requests;
+    struct wire_report_ack_t last_ack;
+};
+
+// Full-scale triangle wave over a 16-bit phase.
+static int16_t triangle(uint32_t phase)
+{
+    int32_t ramp = phase & 0x8000 ? 0xffff - (phase & 0xffff) : phase & 0x7fff;
+    return (int16_t)(ramp * 2 - 32767);
+}
+
+static struct js_event next_event(struct loadgen_t* loadgen, enum loadgen_pattern pattern,
+    uint32_t step)
+{
+    struct js_event event = { .time = (uint32_t)(monotonic_ns() / 1000000) };
+    switch (pattern) {
+    case PATTERN_SWEEP: {
+        // x and y alternate, a quarter period apart; 64 events per lap
+        uint32_t phase = (step / 2) * 2048;
+        event.type = JS_EVENT_AXIS;
+        event.number = step & 1;
+        event.value = triangle(step & 1 ? phase + 0x4000 : phase);
+        break;
+    }
+    case PATTERN_MASH: {
+        uint8_t button = step % LOADGEN_BUTTONS;
+        event.type = JS_EVENT_BUTTON;
+        event.number = button;
+        event.value = !((loadgen->state.buttons >> button) & 1);
+        break;
+    }
+    case PATTERN_HAT: {
+        // clockwise from up, moving one hat axis per event
+        static const int8_t directions[8][2] = {
+            { 0, -1 }, { 1, -1 }, { 1, 0 }, { 1, 1 }, { 0, 1 }, { -1, 1 }, { -1, 0 }, { -1, -1 },
+        };
+        const int8_t* direction = directions[(step / 2) % 8];
+        event.type = JS_EVENT_AXIS;
+        event.number = step & 1 ? LOADGEN_HAT_Y : LOADGEN_HAT_X;
+        event.value = direction[step & 1] * 32767;
+        break;
+    }
+    case PATTERN_MIXED:
+        return next_event(loadgen, step % 3, step / 3);
+    }
+    return event;
+}
+
+int tick_handler(zloop_t* loop, int timer_id, void* loadgen_void)
+{
+    struct loadgen_t* loadgen = loadgen_void;
+    uint64_t now = monotonic_ns();
+    uint64_t due = (now - loadgen->start_ns) * loadgen->rate / 1000000000ull;
+    uint64_t owed = due - loadgen->events - loadgen->shed;
+    if (owed > LOADGEN_MAX_EVENTS_PER_TICK) {
+        loadgen->shed += owed - LOADGEN_MAX_EVENTS_PER_TICK;
+        owed = LOADGEN_MAX_EVENTS_PER_TICK;
+    }
+    for (uint64_t i = 0; i < owed; ++i) {
+        struct js_event event = next_event(loadgen, loadgen->pattern, loadgen->step++);
+        wire_state_apply_js_event(&loadgen->state, &event);
+    }
+    loadgen->events += owed;
+
+    uint8_t* frame = frame_pool_buffer(&loadgen->pool);
+    uint16_t seq = loadgen->encoder.seq;
+    size_t size = wire_encode_state(&loadgen->encoder, &loadgen->state, frame, WIRE_MAX_FRAME);
+    if (size > 0) {
+        loadgen->sent_ns[seq] = monotonic_ns();
+        if (frame_pool_send(&loadgen->pool, loadgen->sock, size)) {
+            ++loadgen->frames;
+        } else {
+            wire_encoder_request_keyframe(&loadgen->encoder); // as beacon_server does
+            ++loadgen->blocked;
+        }
+    }
+    return 0;
+}
+
+int device_message_handler(zloop_t* loop, zsock_t* reader, void* loadgen_void)
+{
+    struct loadgen_t* loadgen = loadgen_void;
+    const uint8_t* frame = loadgen->reply;
+    size_t size = frame_recv(reader, loadgen->reply);
+    if (size == 0) {
+        return 0;
+    }
+    uint64_t recv_ns = monotonic_ns();
+    struct wire_report_ack_t ack;
+    if (wire_decode_report_ack(frame, size, &ack)) {
+        uint64_t* sent_ns = &loadgen->sent_ns[ack.header.seq];
+        if (*sent_ns != 0) {
+            latency_record(LATENCY_SEND_TO_ACK, recv_ns - *sent_ns);
+            *sent_ns = 0;
+        }
+        loadgen->last_ack = ack;
+        ++loadgen->acks;
+    } else if (wire_frame_kind(frame, size) == WIRE_KEYFRAME_REQUEST) {
+        wire_encoder_request_keyframe(&loadgen->encoder);
+        ++loadgen->keyframe_requests;
+    }
+    return 0;
+}
+
+int monitor_handler(zloop_t* loop, zsock_t* reader, void* loadgen_void)
+{
+    char* msg = zstr_recv(reader);
+    bool disconnected = msg != NULL && strncmp(msg, "DISCONNECTED", strlen("DISCONNECTED")) == 0;
+    freen(msg);
+    if (disconnected) {
+        zsys_warning("device disconnected");
+        return -1;
+    }
+    return 0;
+}
+
+int end_handler(zloop_t* loop, int timer_id, void* loadgen_void)
+{
+    return -1;
+}
+
+// Beacon like beacon_server does and wait for the device to pair.
+zsock_t* beacon()
+{
+    zactor_t* beacon = zactor_new(zbeacon, NULL);
+    zsock_send(beacon, "si", "CONFIGURE", 9999);
+
+    zsock_t* listener = zsock_new(ZMQ_PAIR);
+    frame_pool_setup_socket(listener);
+    int port = zsock_bind(listener, "tcp://*:*");
+    char magic_port_str[20];
+    snprintf(magic_port_str, sizeof(magic_port_str), "SWITCHCON%i", port);
+    zsock_send(beacon, "ssi", "PUBLISH", magic_port_str, 1000);
+    zsys_info("beaconing %s, waiting for the device", magic_port_str);
+
+    while (true) {
+        char* response_magic = NULL;
+        if (zsock_recv(listener, "s", &response_magic) != 0) {
+            if (errno == EINTR) {
+                zsock_destroy(&listener);
+                break;
+            }
+            continue;
+        }
+        bool paired = strncmp(response_magic, "MITCHPURDY", strlen("MITCHPURDY")) == 0;
+        if (paired && strstr(response_magic, " UDP") != NULL) {
+            zsys_info("device asked for UDP; load is sent over PAIR regardless");
+        }
+        freen(response_magic);
+        if (paired) {
+            break;
+        }
+    }
+
+    zstr_sendx(beacon, "SILENCE", NULL);
+    zactor_destroy(&beacon);
+    return listener;
+}
+
+void print_summary(const struct loadgen_t* loadgen)
+{
+    double elapsed_s = (monotonic_ns() - loadgen->start_ns) / 1e9;
+    printf("pattern %s, %u events/s requested, %.1f s\n", pattern_names[loadgen->pattern],
+        loadgen->rate, elapsed_s);
+    printf("sent      %lu events (%.0f/s sustained), %lu shed, %lu frames (%.0f/s)\n",
+        (unsigned long)loadgen->events, loadgen->events / elapsed_s, (unsigned long)loadgen->shed,
+        (unsigned long)loadgen->frames, loadgen->frames / elapsed_s);
+    printf("coalesced %lu events folded into shared frames, %lu frames dropped at the HWM\n",
+        (unsigned long)(loadgen->events - loadgen->frames - loadgen->blocked),
+        (unsigned long)loadgen->blocked);
+    if (loadgen->acks == 0) {
+        printf("device    no report acks; is a USB host polling ep1?\n");
+        return;
+    }
+    const struct wire_report_ack_t* ack = &loadgen->last_ack;
+    printf("device    %u frames received, %u dropped, %u keyframe requests\n", ack->frames,
+        ack->dropped, (unsigned)loadgen->keyframe_requests);
+    printf("device    %u input changes published, %u reached the host, %u overwritten first\n",
+        ack->published, ack->reports, ack->published - ack->reports);
+}
+
+void usage(const char* argv0)
+{
+    fprintf(stderr,
+        "usage: %s [-r events/s] [-p pattern] [-t tick ms] [-d seconds] [-i seconds]\n"
+        "  -r  synthetic pad events per second (default 1000)\n"
+        "  -p  sweep, mash, hat or mixed (default mixed)\n"
+        "  -t  fold and send one frame every tick (default 1 ms)\n"
+        "  -d  run time once paired (default 10 s)\n"
+        "  -i  dump send->ack histograms every interval (always on SIGUSR1)\n",
+        argv0);
+}
+
+int main(int argc, char** argv)
+{
+    struct loadgen_t* loadgen = calloc(1, sizeof(struct loadgen_t));
+    loadgen->rate = 1000;
+    loadgen->pattern = PATTERN_MIXED;
+    unsigned tick_ms = 1;
+    unsigned duration_s = 10;
+    unsigned stats_interval = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:p:t:d:i:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            loadgen->rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'p': {
+            size_t n = 0;
+            while (n < sizeof(pattern_names) / sizeof(pattern_names[0])
+                && strcmp(optarg, pattern_names[n]) != 0) {
+                ++n;
+            }
+            if (n == sizeof(pattern_names) / sizeof(pattern_names[0])) {
+                usage(argv[0]);
+                return 1;
+            }
+            loadgen->pattern = n;
+            break;
+        }
+        case 't':
+            tick_ms = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            duration_s = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            stats_interval = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (loadgen->rate == 0 || tick_ms == 0 || duration_s == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    latency_start_reporter(stats_interval);
+    zsys_set_logstream(stderr);
+
+    loadgen->sock = beacon();
+    if (loadgen->sock == NULL) {
+        return 1;
+    }
+    zactor_t* monitor = zactor_new(zmonitor, loadgen->sock);
+    zstr_sendx(monitor, "LISTEN", "DISCONNECTED", NULL);
+    zstr_sendx(monitor, "START", NULL);
+
+    loadgen->state.button_count = LOADGEN_BUTTONS;
+    loadgen->state.axis_count = LOADGEN_AXES;
+    wire_encoder_init(&loadgen->encoder);
+    uint8_t request[WIRE_MAX_FRAME];
+    zsock_send(loadgen->sock, "b", request, wire_encode_session(request, sizeof(request), 1));
+    zsock_send(loadgen->sock, "b", request, wire_encode_ack_request(request, sizeof(request)));
+
+    zsys_info("paired, sending %s at %u events/s for %u s", pattern_names[loadgen->pattern],
+        loadgen->rate, duration_s);
+    zloop_t* loop = zloop_new();
+    zloop_reader(loop, (zsock_t*)monitor, monitor_handler, loadgen);
+    zloop_reader(loop, loadgen->sock, device_message_handler, loadgen);
+    zloop_timer(loop, tick_ms, 0, tick_handler, loadgen);
+    zloop_timer(loop, duration_s * 1000, 1, end_handler, loadgen);
+    loadgen->start_ns = monotonic_ns();
+    zloop_start(loop);
+
+    print_summary(loadgen);
+    latency_dump();
+
+    zloop_destroy(&loop);
+    zactor_destroy(&monitor);
+    zsock_destroy(&loadgen->sock);
+    free(loadgen);
+    return 0;
+}
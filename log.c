@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+#include "log.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define LOG_RING_SIZE 1024 // records per thread, power of two
+#define LOG_DRAIN_INTERVAL_NS 10000000
+
+struct log_entry_t {
+    uint64_t ns;
+    const char* fmt;
+    uint8_t level;
+    uint8_t nargs;
+    uint64_t args[LOG_MAX_ARGS];
+};
+
+// Single producer (the owning thread), single consumer (the drain thread).
+// When a thread exits its ring is released and reused by the next new thread,
+// so there are never more rings than threads alive at once.
+struct log_ring_t {
+    _Atomic uint32_t head; // written by the producer
+    _Atomic uint32_t tail; // written by the consumer
+    _Atomic uint64_t dropped;
+    _Atomic bool in_use;
+    struct log_ring_t* next; // immutable once published
+    struct log_entry_t entries[LOG_RING_SIZE];
+};
+
+int g_log_level = LOG_LEVEL_INFO;
+
+static _Atomic(struct log_ring_t*) g_log_rings;
+static _Thread_local struct log_ring_t* t_log_ring;
+static pthread_key_t g_log_ring_key;
+static pthread_once_t g_log_once = PTHREAD_ONCE_INIT;
+
+static void release_ring(void* ring_void)
+{
+    struct log_ring_t* ring = ring_void;
+    atomic_store_explicit(&ring->in_use, false, memory_order_release);
+}
+
+static void create_key(void)
+{
+    pthread_key_create(&g_log_ring_key, release_ring);
+}
+
+// Slow path, once per thread.
+static struct log_ring_t* acquire_ring(void)
+{
+    pthread_once(&g_log_once, create_key);
+
+    struct log_ring_t* ring = atomic_load_explicit(&g_log_rings, memory_order_acquire);
+    for (; ring != NULL; ring = ring->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&ring->in_use, &expected, true)) {
+            break;
+        }
+    }
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(struct log_ring_t));
+        if (ring == NULL) {
+            return NULL;
+        }
+        atomic_init(&ring->in_use, true);
+        ring->next = atomic_load_explicit(&g_log_rings, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(
+            &g_log_rings, &ring->next, ring, memory_order_release, memory_order_relaxed)) {
+        }
+    }
+    pthread_setspecific(g_log_ring_key, ring);
+    t_log_ring = ring;
+    return ring;
+}
+
+void log_record(int level, const char* fmt, unsigned nargs, const uint64_t* args)
+{
+    struct log_ring_t* ring = t_log_ring;
+    if (ring == NULL && (ring = acquire_ring()) == NULL) {
+        return;
+    }
+
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    struct log_entry_t* entry = &ring->entries[head % LOG_RING_SIZE];
+    // The coarse clock is a plain vDSO read, a few times cheaper than the
+    // precise one; tick resolution is plenty for log timestamps.
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    entry->ns = now.tv_sec * 1000000000ull + now.tv_nsec;
+    entry->fmt = fmt;
+    entry->level = level;
+    entry->nargs = nargs < LOG_MAX_ARGS ? nargs : LOG_MAX_ARGS;
+    memcpy(entry->args, args, entry->nargs * sizeof(uint64_t));
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Format one conversion, `spec` being "%...X", with the argument read back as
+// the type the spec names.
+static void format_arg(FILE* out, const char* spec, uint64_t arg)
+{
+    char conversion = spec[strlen(spec) - 1];
+    int longs = 0;
+    bool size = false;
+    for (const char* c = spec; *c != '\0'; ++c) {
+        longs += *c == 'l';
+        size |= *c == 'z';
+    }
+
+    switch (conversion) {
+    case 'd':
+    case 'i':
+        if (size) {
+            fprintf(out, spec, (ssize_t)arg);
+        } else if (longs == 2) {
+            fprintf(out, spec, (long long)arg);
+        } else if (longs == 1) {
+            fprintf(out, spec, (long)arg);
+        } else {
+            fprintf(out, spec, (int)arg);
+        }
+        break;
+    case 'u':
+    case 'x':
+    case 'X':
+    case 'o':
+        if (size) {
+            fprintf(out, spec, (size_t)arg);
+        } else if (longs == 2) {
+            fprintf(out, spec, (unsigned long long)arg);
+        } else if (longs == 1) {
+            fprintf(out, spec, (unsigned long)arg);
+        } else {
+            fprintf(out, spec, (unsigned)arg);
+        }
+        break;
+    case 'c':
+        fprintf(out, spec, (int)arg);
+        break;
+    case 's':
+        fprintf(out, spec, arg != 0 ? (const char*)(uintptr_t)arg : "(null)");
+        break;
+    case 'p':
+        fprintf(out, spec, (void*)(uintptr_t)arg);
+        break;
+    case 'e':
+    case 'f':
+    case 'g': {
+        double value;
+        memcpy(&value, &arg, sizeof(value));
+        fprintf(out, spec, value);
+        break;
+    }
+    default:
+        fputs(spec, out);
+    }
+}
+
+static void print_entry(FILE* out, const struct log_entry_t* entry)
+{
+    static const char levels[] = { 'D', 'I', 'W', 'E' };
+    unsigned long long us = entry->ns / 1000;
+    fprintf(out, "%c: %llu.%06llu ", levels[entry->level & 3], us / 1000000, us % 1000000);
+
+    unsigned arg = 0;
+    for (const char* c = entry->fmt; *c != '\0';) {
+        if (*c != '%') {
+            size_t literal = strcspn(c, "%");
+            fwrite(c, 1, literal, out);
+            c += literal;
+            continue;
+        }
+        if (c[1] == '%') {
+            fputc('%', out);
+            c += 2;
+            continue;
+        }
+        size_t length = 1 + strcspn(c + 1, "diuxXocspefg");
+        char spec[32];
+        snprintf(spec, sizeof(spec), "%.*s", (int)(length + 1), c);
+        format_arg(out, spec, arg < entry->nargs ? entry->args[arg] : 0);
+        ++arg;
+        c += c[length] != '\0' ? length + 1 : length;
+    }
+    size_t fmt_length = strlen(entry->fmt);
+    if (fmt_length == 0 || entry->fmt[fmt_length - 1] != '\n') {
+        fputc('\n', out);
+    }
+}
+
+static bool drain_ring(FILE* out, struct log_ring_t* ring)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    bool printed = tail != head;
+    for (; tail != head; ++tail) {
+        print_entry(out, &ring->entries[tail % LOG_RING_SIZE]);
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    uint64_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+    if (dropped > 0) {
+        fprintf(out, "W: %llu log records dropped, ring full\n", (unsigned long long)dropped);
+    }
+    return printed || dropped > 0;
+}
+
+static void* drain_thread(void* data)
+{
+    (void)data;
+    while (true) {
+        bool printed = false;
+        struct log_ring_t* ring = atomic_load_explicit(&g_log_rings, memory_order_acquire);
+        for (; ring != NULL; ring = ring->next) {
+            printed |= drain_ring(stderr, ring);
+        }
+        if (printed) {
+            fflush(stderr);
+        }
+        struct timespec interval = { .tv_nsec = LOG_DRAIN_INTERVAL_NS };
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+void log_start(void)
+{
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, drain_thread, NULL) == 0) {
+        pthread_detach(thread);
+    } else {
+        perror("log drain thread");
+    }
+}
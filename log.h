@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Logging for the hot paths. A log site copies its format pointer, its
+// arguments and a timestamp into a ring owned by the calling thread; a
+// background thread formats and prints them. Nothing on the calling side
+// locks, allocates (after a thread's first record) or makes a syscall, and a
+// full ring drops the record and counts it rather than wait.
+//
+// Formatting is deferred, so the format must be a string literal and %s
+// arguments must outlive the call: literals and static tables only.
+// Supported conversions are d i u x X o c s p e f g with the h, l, ll and z
+// length modifiers, at most LOG_MAX_ARGS of them.
+//
+// Sites below LOG_MIN_LEVEL are compiled out; g_log_level filters the rest at
+// run time.
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARNING 2
+#define LOG_LEVEL_ERROR 3
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_MAX_ARGS 6
+
+extern int g_log_level;
+
+// Start the drain thread; records logged before this wait in their rings.
+void log_start(void);
+
+void log_record(int level, const char* fmt, unsigned nargs, const uint64_t* args);
+
+static inline uint64_t log_arg_int(int64_t value)
+{
+    return (uint64_t)value;
+}
+
+static inline uint64_t log_arg_pointer(const void* value)
+{
+    return (uintptr_t)value;
+}
+
+static inline uint64_t log_arg_double(double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+#define LOG_ARG(x) _Generic((x),             \
+    float: log_arg_double,                   \
+    double: log_arg_double,                  \
+    char*: log_arg_pointer,                  \
+    const char*: log_arg_pointer,            \
+    void*: log_arg_pointer,                  \
+    const void*: log_arg_pointer,            \
+    default: log_arg_int)(x)
+
+#define LOG_COUNT(...) LOG_COUNT_(__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0, _)
+#define LOG_COUNT_(fmt, a, b, c, d, e, f, n, ...) n
+#define LOG_CAT(a, b) LOG_CAT_(a, b)
+#define LOG_CAT_(a, b) a##b
+
+#define LOG_ARGS_0(fmt) fmt, 0, NULL
+#define LOG_ARGS_1(fmt, a) fmt, 1, (const uint64_t[]) { LOG_ARG(a) }
+#define LOG_ARGS_2(fmt, a, b) fmt, 2, (const uint64_t[]) { LOG_ARG(a), LOG_ARG(b) }
+#define LOG_ARGS_3(fmt, a, b, c) fmt, 3, (const uint64_t[]) { LOG_ARG(a), LOG_ARG(b), LOG_ARG(c) }
+#define LOG_ARGS_4(fmt, a, b, c, d) \
+    fmt, 4, (const uint64_t[]) { LOG_ARG(a), LOG_ARG(b), LOG_ARG(c), LOG_ARG(d) }
+#define LOG_ARGS_5(fmt, a, b, c, d, e) \
+    fmt, 5, (const uint64_t[]) { LOG_ARG(a), LOG_ARG(b), LOG_ARG(c), LOG_ARG(d), LOG_ARG(e) }
+#define LOG_ARGS_6(fmt, a, b, c, d, e, f) \
+    fmt, 6, (const uint64_t[]) { LOG_ARG(a), LOG_ARG(b), LOG_ARG(c), LOG_ARG(d), LOG_ARG(e), LOG_ARG(f) }
+
+// The dead printf only lets the compiler check the format against the arguments.
+#define LOG_AT(level, ...)                                                               \
+    do {                                                                                 \
+        if ((level) >= LOG_MIN_LEVEL && (level) >= g_log_level) {                        \
+            log_record((level), LOG_CAT(LOG_ARGS_, LOG_COUNT(__VA_ARGS__))(__VA_ARGS__)); \
+        }                                                                                \
+        if (0) {                                                                         \
+            printf(__VA_ARGS__);                                                         \
+        }                                                                                \
+    } while (0)
+
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARNING(...) LOG_AT(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
@@ -0,0 +1,180 @@
+#define _GNU_SOURCE
+#include "macro.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Report button bits by name, as in profiles/xbox_pokken.map.
+static const char* const button_names[] = {
+    "y", "b", "a", "x", "l", "r", "zl", "zr",
+    "minus", "plus", "lstick", "rstick", "home", "capture",
+};
+
+static const struct {
+    const char* name;
+    uint8_t hat;
+} hat_names[] = {
+    { "up", HAT_TOP },
+    { "up-right", HAT_TOP_RIGHT },
+    { "right", HAT_RIGHT },
+    { "down-right", HAT_BOTTOM_RIGHT },
+    { "down", HAT_BOTTOM },
+    { "down-left", HAT_BOTTOM_LEFT },
+    { "left", HAT_LEFT },
+    { "up-left", HAT_TOP_LEFT },
+};
+
+static bool parse_number(const char* text, unsigned max, unsigned* value)
+{
+    char* end;
+    unsigned long number = text != NULL ? strtoul(text, &end, 10) : 0;
+    if (text == NULL || *text == '\0' || *end != '\0' || number > max) {
+        return false;
+    }
+    *value = number;
+    return true;
+}
+
+static bool parse_button(const char* name, uint16_t* mask)
+{
+    for (size_t n = 0; n < sizeof(button_names) / sizeof(button_names[0]); ++n) {
+        if (strcmp(name, button_names[n]) == 0) {
+            *mask = 1u << n;
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint8_t* stick(struct USB_JoystickReport_Input_t* report, const char* name)
+{
+    if (strcmp(name, "lx") == 0) {
+        return &report->LX;
+    } else if (strcmp(name, "ly") == 0) {
+        return &report->LY;
+    } else if (strcmp(name, "rx") == 0) {
+        return &report->RX;
+    } else if (strcmp(name, "ry") == 0) {
+        return &report->RY;
+    }
+    return NULL;
+}
+
+// One step, or a repeat line; false if the line makes no sense.
+static bool parse_line(struct macro_t* macro, const char* text)
+{
+    char line[256];
+    snprintf(line, sizeof(line), "%s", text);
+    char* save;
+    const char* word = strtok_r(line, " \t\r", &save);
+    if (strcmp(word, "repeat") == 0) {
+        return parse_number(strtok_r(NULL, " \t\r", &save), 1000000, &macro->repeat);
+    }
+
+    unsigned polls;
+    if (macro->step_count == MACRO_MAX_STEPS || !parse_number(word, UINT32_MAX, &polls)
+        || polls == 0) {
+        return false;
+    }
+    struct macro_step_t step = {
+        .report = { .HAT = HAT_CENTER, .LX = 128, .LY = 128, .RX = 128, .RY = 128 },
+        .polls = polls,
+    };
+
+    while ((word = strtok_r(NULL, " \t\r", &save)) != NULL) {
+        uint16_t mask;
+        uint8_t* axis;
+        unsigned value;
+        if (parse_button(word, &mask)) {
+            step.report.Button |= mask;
+        } else if (strcmp(word, "button") == 0) {
+            if (!parse_number(strtok_r(NULL, " \t\r", &save), 15, &value)) {
+                return false;
+            }
+            step.report.Button |= 1u << value;
+        } else if ((axis = stick(&step.report, word)) != NULL) {
+            if (!parse_number(strtok_r(NULL, " \t\r", &save), 255, &value)) {
+                return false;
+            }
+            *axis = value;
+        } else if (strcmp(word, "hat") == 0) {
+            const char* name = strtok_r(NULL, " \t\r", &save);
+            size_t n = 0;
+            while (name != NULL && n < sizeof(hat_names) / sizeof(hat_names[0])
+                && strcmp(name, hat_names[n].name) != 0) {
+                ++n;
+            }
+            if (name == NULL || n == sizeof(hat_names) / sizeof(hat_names[0])) {
+                return false;
+            }
+            step.report.HAT = hat_names[n].hat;
+        } else if (strcmp(word, "turbo") == 0) {
+            const char* name = strtok_r(NULL, " \t\r", &save);
+            unsigned on, off;
+            if (name == NULL || !parse_button(name, &mask)
+                || !parse_number(strtok_r(NULL, " \t\r", &save), 1000, &on)
+                || !parse_number(strtok_r(NULL, " \t\r", &save), 1000, &off) || on == 0) {
+                return false;
+            }
+            // buttons mashed in the same step share one rate
+            if (step.turbo_period != 0 && (on != step.turbo_on || on + off != step.turbo_period)) {
+                return false;
+            }
+            step.turbo_mask |= mask;
+            step.turbo_on = on;
+            step.turbo_period = on + off;
+        } else {
+            return false;
+        }
+    }
+
+    macro->steps[macro->step_count++] = step;
+    return true;
+}
+
+bool macro_parse(struct macro_t* macro, const char* text, const char* name)
+{
+    macro->step_count = 0;
+    macro->repeat = 1;
+
+    unsigned line_number = 0;
+    while (*text != '\0') {
+        size_t length = strcspn(text, "\n");
+        char line[256];
+        snprintf(line, sizeof(line), "%.*s", (int)length, text);
+        text += length + (text[length] == '\n');
+        ++line_number;
+
+        line[strcspn(line, "#")] = '\0';
+        if (line[strspn(line, " \t\r")] == '\0') {
+            continue;
+        }
+        if (!parse_line(macro, line)) {
+            fprintf(stderr, "%s:%u: bad macro line: %s\n", name, line_number, line);
+            return false;
+        }
+    }
+    if (macro->step_count == 0) {
+        fprintf(stderr, "%s: no steps\n", name);
+        return false;
+    }
+    return true;
+}
+
+bool macro_load(struct macro_t* macro, const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+    char* text = NULL;
+    size_t size = 0;
+    ssize_t length = getdelim(&text, &size, '\0', file);
+    fclose(file);
+    bool ok = macro_parse(macro, length >= 0 ? text : "", path);
+    free(text);
+    return ok;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "joystick_state.h"
+
+// Precompiled input sequences played by the device itself, timed in host
+// polls rather than wall-clock time. The output side asks the player for the
+// report of every IN transfer it hands the host, so step n of a sequence is
+// exactly what the host samples on its nth poll after the macro started,
+// whatever the pad, the network or the scheduler are doing meanwhile.
+//
+// Macro format, one step per line, '#' starts a comment:
+//   <polls> [held]...          the report for the next <polls> polls
+// where each held item is one of
+//   y b a x l r zl zr minus plus lstick rstick home capture
+//   button <bit>               any report button
+//   lx|ly|rx|ry <0..255>       a stick position; unset sticks are centered
+//   hat up|up-right|right|down-right|down|down-left|left|up-left
+//   turbo <button> <on> <off>  the button pressed for <on> polls, then
+//                              released for <off>, from the start of the step
+// A step holding nothing is a neutral report. One more line
+//   repeat <count>             plays the sequence count times; 0 loops forever
+// may appear anywhere; the default is once.
+
+#define MACRO_MAX_STEPS 256
+
+struct macro_step_t {
+    struct USB_JoystickReport_Input_t report;
+    uint32_t polls;
+    uint16_t turbo_mask;
+    uint16_t turbo_on;
+    uint16_t turbo_period; // on + off; 0 without turbo
+};
+
+struct macro_t {
+    struct macro_step_t steps[MACRO_MAX_STEPS];
+    unsigned step_count;
+    unsigned repeat;
+};
+
+// Compile macro text; reports the first bad line and returns false.
+bool macro_parse(struct macro_t* macro, const char* text, const char* name);
+bool macro_load(struct macro_t* macro, const char* path);
+
+// Where a sequence is at; owned by the output thread.
+struct macro_player_t {
+    const struct macro_t* macro;
+    unsigned step;
+    uint32_t poll; // within the step
+    unsigned pass;
+    bool running;
+};
+
+static inline void macro_start(struct macro_player_t* player, const struct macro_t* macro)
+{
+    *player = (struct macro_player_t) {
+        .macro = macro,
+        .running = macro != NULL && macro->step_count > 0,
+    };
+}
+
+// Take the report for the next poll and move on by one poll. Returns false,
+// leaving `report` alone, when no sequence is running.
+static inline bool macro_next(struct macro_player_t* player,
+    struct USB_JoystickReport_Input_t* report)
+{
+    if (!player->running) {
+        return false;
+    }
+    const struct macro_t* macro = player->macro;
+    const struct macro_step_t* step = &macro->steps[player->step];
+    *report = step->report;
+    if (step->turbo_period != 0 && player->poll % step->turbo_period < step->turbo_on) {
+        report->Button |= step->turbo_mask;
+    }
+
+    if (++player->poll == step->polls) {
+        player->poll = 0;
+        if (++player->step == macro->step_count) {
+            player->step = 0;
+            ++player->pass;
+            player->running = macro->repeat == 0 || player->pass < macro->repeat;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include "mapping.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char* const mapping_default_profile = "button 0 button 1 # B\n"
+                                            "button 1 button 2 # A\n"
+                                            "button 2 button 0 # Y\n"
+                                            "button 3 button 3 # X\n"
+                                            "button 4 button 4 # LB -> L\n"
+                                            "button 5 button 5 # RB -> R\n"
+                                            "button 6 button 8 # back -> minus\n"
+                                            "button 7 button 9 # start -> plus\n"
+                                            "button 8 button 12 # guide -> home\n"
+                                            "button 9 button 10 # left stick click\n"
+                                            "button 10 button 11 # right stick click\n"
+                                            "axis 0 stick lx\n"
+                                            "axis 1 stick ly\n"
+                                            "axis 2 button 6 -29000 # LT -> ZL\n"
+                                            "axis 3 stick rx\n"
+                                            "axis 4 stick ry\n"
+                                            "axis 5 button 7 -29000 # RT -> ZR\n"
+                                            "axis 6 hat x 32766\n"
+                                            "axis 7 hat y 32766\n";
+
+// d-pad mask -> HAT value; opposite directions cancel.
+static const uint8_t dpad_hats[16] = {
+    HAT_CENTER, // none
+    HAT_TOP, // up
+    HAT_BOTTOM, // down
+    HAT_CENTER, // up down
+    HAT_LEFT, // left
+    HAT_TOP_LEFT, // up left
+    HAT_BOTTOM_LEFT, // down left
+    HAT_LEFT, // up down left
+    HAT_RIGHT, // right
+    HAT_TOP_RIGHT, // up right
+    HAT_BOTTOM_RIGHT, // down right
+    HAT_RIGHT, // up down right
+    HAT_CENTER, // left right
+    HAT_TOP, // up left right
+    HAT_BOTTOM, // down left right
+    HAT_CENTER, // all
+};
+
+static void apply_none(struct mapping_output_t* output, const struct mapping_rule_t* rule,
+    int32_t value)
+{
+    (void)output;
+    (void)rule;
+    (void)value;
+}
+
+static void apply_button(struct mapping_output_t* output, const struct mapping_rule_t* rule,
+    int32_t value)
+{
+    uint16_t pressed = -(uint16_t)(value != 0);
+    output->report.Button = (output->report.Button & ~rule->mask) | (pressed & rule->mask);
+}
+
+static void apply_axis_button(struct mapping_output_t* output, const struct mapping_rule_t* rule,
+    int32_t value)
+{
+    uint16_t pressed = -(uint16_t)(value > rule->threshold);
+    output->report.Button = (output->report.Button & ~rule->mask) | (pressed & rule->mask);
+}
+
+static void apply_stick(struct mapping_output_t* output, const struct mapping_rule_t* rule,
+    int32_t value)
+{
+    ((uint8_t*)&output->report)[rule->offset] = (value + 32768) >> 8;
+}
+
+// HAT axes and d-pad buttons alike: a button is an axis that only goes positive.
+static void apply_dpad(struct mapping_output_t* output, const struct mapping_rule_t* rule,
+    int32_t value)
+{
+    uint8_t negative = -(uint8_t)(value < -rule->threshold) & rule->dpad_negative;
+    uint8_t positive = -(uint8_t)(value > rule->threshold) & rule->dpad_positive;
+    uint8_t held = output->dpad & ~(rule->dpad_negative | rule->dpad_positive);
+    output->dpad = held | negative | positive;
+    output->report.HAT = dpad_hats[output->dpad & 0xf];
+}
+
+static bool parse_stick(const char* name, uint8_t* offset)
+{
+    static const struct {
+        const char* name;
+        uint8_t offset;
+    } sticks[] = {
+        { "lx", offsetof(struct USB_JoystickReport_Input_t, LX) },
+        { "ly", offsetof(struct USB_JoystickReport_Input_t, LY) },
+        { "rx", offsetof(struct USB_JoystickReport_Input_t, RX) },
+        { "ry", offsetof(struct USB_JoystickReport_Input_t, RY) },
+    };
+    for (size_t n = 0; n < sizeof(sticks) / sizeof(sticks[0]); ++n) {
+        if (strcmp(name, sticks[n].name) == 0) {
+            *offset = sticks[n].offset;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parse_direction(const char* name, uint8_t* bit)
+{
+    static const struct {
+        const char* name;
+        uint8_t bit;
+    } directions[] = {
+        { "up", MAPPING_DPAD_UP },
+        { "down", MAPPING_DPAD_DOWN },
+        { "left", MAPPING_DPAD_LEFT },
+        { "right", MAPPING_DPAD_RIGHT },
+    };
+    for (size_t n = 0; n < sizeof(directions) / sizeof(directions[0]); ++n) {
+        if (strcmp(name, directions[n].name) == 0) {
+            *bit = directions[n].bit;
+            return true;
+        }
+    }
+    return false;
+}
+
+// One rule; false if the line makes no sense.
+static bool parse_rule(struct mapping_t* mapping, const char* line)
+{
+    char kind_name[16], action[16], target[16];
+    unsigned number;
+    int32_t threshold;
+    int fields
+        = sscanf(line, "%15s %u %15s %15s %d", kind_name, &number, action, target, &threshold);
+    if (fields < 4 || number >= MAPPING_INPUTS) {
+        return false;
+    }
+
+    enum mapping_kind kind;
+    if (strcmp(kind_name, "button") == 0) {
+        kind = MAPPING_BUTTON;
+    } else if (strcmp(kind_name, "axis") == 0) {
+        kind = MAPPING_AXIS;
+    } else {
+        return false;
+    }
+    struct mapping_rule_t rule = { .apply = apply_none };
+
+    if (strcmp(action, "button") == 0) {
+        unsigned bit;
+        if (sscanf(target, "%u", &bit) != 1 || bit >= 16) {
+            return false;
+        }
+        rule.mask = 1u << bit;
+        if (kind == MAPPING_BUTTON) {
+            rule.apply = apply_button;
+        } else {
+            rule.apply = apply_axis_button;
+            rule.threshold = fields == 5 ? threshold : 0;
+        }
+    } else if (strcmp(action, "stick") == 0 && kind == MAPPING_AXIS) {
+        if (!parse_stick(target, &rule.offset)) {
+            return false;
+        }
+        rule.apply = apply_stick;
+    } else if (strcmp(action, "hat") == 0 && kind == MAPPING_AXIS) {
+        if (strcmp(target, "x") == 0) {
+            rule.dpad_negative = MAPPING_DPAD_LEFT;
+            rule.dpad_positive = MAPPING_DPAD_RIGHT;
+        } else if (strcmp(target, "y") == 0) {
+            rule.dpad_negative = MAPPING_DPAD_UP;
+            rule.dpad_positive = MAPPING_DPAD_DOWN;
+        } else {
+            return false;
+        }
+        rule.apply = apply_dpad;
+        rule.threshold = fields == 5 ? threshold : 16384;
+    } else if (strcmp(action, "dpad") == 0 && kind == MAPPING_BUTTON) {
+        if (!parse_direction(target, &rule.dpad_positive)) {
+            return false;
+        }
+        rule.apply = apply_dpad;
+    } else {
+        return false;
+    }
+
+    mapping->rules[kind][number] = rule;
+    return true;
+}
+
+bool mapping_parse(struct mapping_t* mapping, const char* text, const char* name)
+{
+    for (size_t kind = 0; kind < MAPPING_KINDS; ++kind) {
+        for (size_t number = 0; number < MAPPING_INPUTS; ++number) {
+            mapping->rules[kind][number] = (struct mapping_rule_t) { .apply = apply_none };
+        }
+    }
+
+    unsigned line_number = 0;
+    while (*text != '\0') {
+        size_t length = strcspn(text, "\n");
+        char line[256];
+        snprintf(line, sizeof(line), "%.*s", (int)length, text);
+        text += length + (text[length] == '\n');
+        ++line_number;
+
+        line[strcspn(line, "#")] = '\0';
+        if (line[strspn(line, " \t\r")] == '\0') {
+            continue;
+        }
+        if (!parse_rule(mapping, line)) {
+            fprintf(stderr, "%s:%u: bad mapping rule: %s\n", name, line_number, line);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool mapping_load(struct mapping_t* mapping, const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+    char* text = NULL;
+    size_t size = 0;
+    ssize_t length = getdelim(&text, &size, '\0', file);
+    fclose(file);
+    bool ok = mapping_parse(mapping, length >= 0 ? text : "", path);
+    free(text);
+    return ok;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "joystick_state.h"
+
+// Pad input -> report mapping, loaded from a profile at startup and compiled
+// into a flat table. Applying an input is one indexed load and an indirect
+// call; the handlers write the report with masks rather than branches.
+//
+// Profile format, one rule per line, '#' starts a comment:
+//   button <n> button <bit>              button n drives report button bit
+//   axis <n> button <bit> [threshold]    pressed while the axis is above threshold
+//   axis <n> stick lx|ly|rx|ry           axis n drives a stick, scaled to 0..255
+//   axis <n> hat x|y [threshold]         the HAT, left/up below -threshold,
+//                                        right/down above it (default 16384)
+//   button <n> dpad up|down|left|right   one HAT direction
+// Inputs without a rule are ignored.
+//
+// HAT rules only set or clear their bits in a 4-bit d-pad mask; the HAT value
+// is then looked up from the whole mask. Updates don't depend on the previous
+// HAT value or on the order the inputs arrive in, and opposite directions
+// held together cancel out.
+
+#define MAPPING_INPUTS 32 // per kind; input numbers wrap at this
+
+enum mapping_kind {
+    MAPPING_BUTTON,
+    MAPPING_AXIS,
+    MAPPING_KINDS,
+};
+
+#define MAPPING_DPAD_UP (1u << 0)
+#define MAPPING_DPAD_DOWN (1u << 1)
+#define MAPPING_DPAD_LEFT (1u << 2)
+#define MAPPING_DPAD_RIGHT (1u << 3)
+
+// What the rules write: the report plus the d-pad mask behind its HAT.
+struct mapping_output_t {
+    struct USB_JoystickReport_Input_t report;
+    uint8_t dpad;
+};
+
+// Neutral: sticks centered, nothing pressed.
+#define MAPPING_OUTPUT_INIT \
+    { .report = { .HAT = HAT_CENTER, .LX = 128, .LY = 128, .RX = 128, .RY = 128 } }
+
+struct mapping_rule_t;
+typedef void (*mapping_apply_fn)(struct mapping_output_t* output, const struct mapping_rule_t* rule,
+    int32_t value);
+
+struct mapping_rule_t {
+    mapping_apply_fn apply;
+    uint16_t mask; // button bit
+    uint8_t offset; // stick byte within the report
+    // d-pad bits set below -threshold and above threshold
+    uint8_t dpad_negative;
+    uint8_t dpad_positive;
+    int32_t threshold;
+};
+
+struct mapping_t {
+    struct mapping_rule_t rules[MAPPING_KINDS][MAPPING_INPUTS];
+};
+
+// The Xbox pad -> Pokken controller mapping device.c has always used; the same
+// rules as profiles/xbox_pokken.map. Its HAT threshold of 32766 keeps the old
+// exact +-32767 match. Button 11, which the old 11-entry table read past into
+// Y, is no longer mapped.
+extern const char* const mapping_default_profile;
+
+// Compile profile text; reports the first bad line and returns false.
+bool mapping_parse(struct mapping_t* mapping, const char* text, const char* name);
+bool mapping_load(struct mapping_t* mapping, const char* path);
+
+static inline void mapping_apply(const struct mapping_t* mapping, struct mapping_output_t* output,
+    enum mapping_kind kind, uint8_t number, int32_t value)
+{
+    const struct mapping_rule_t* rule = &mapping->rules[kind][number % MAPPING_INPUTS];
+    rule->apply(output, rule, value);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "joystick_state.h"
+#include "macro.h"
+
+// Where the reports go. device.c publishes each controller's state into its
+// output_channel_t from the input side; a backend delivers it. Backends run on
+// their own thread the same way the endpoint threads do: setup_fn gets &data,
+// which holds the channel on entry and the backend's own state on return,
+// loop_fn runs until it returns false, cleanup_fn gets &data again.
+struct output_backend_t {
+    const char* name;
+    // Wants the channel's state_eventfd signalled on every input change.
+    bool needs_state_events;
+    bool (*setup_fn)(void*);
+    bool (*loop_fn)(void*);
+    void (*cleanup_fn)(void*);
+};
+
+// FunctionFS gadget, the real thing (device.c).
+extern const struct output_backend_t g_ffs_backend;
+// Virtual gamepad through /dev/uinput (output_uinput.c).
+extern const struct output_backend_t g_uinput_backend;
+// Simulated USB host polling at a fixed interval (output_mock.c).
+extern const struct output_backend_t g_mock_backend;
+
+struct output_config_t {
+    // mock: append an output_record_t per poll here; a file or a FIFO
+    const char* record_path;
+    // mock: host polling interval, us
+    unsigned poll_us;
+    // mock: the queued report follows every input change, as -l's AIO
+    // resubmission does, instead of being the one sampled after the last poll
+    bool latest_state;
+};
+
+extern struct output_config_t g_output_config;
+
+// One report as the mock host saw it.
+struct output_record_t {
+    uint64_t poll_ns; // CLOCK_MONOTONIC
+    uint64_t stamp; // joystick_state_t.stamp of the state it carried
+    uint32_t generation;
+    struct USB_JoystickReport_Input_t report;
+} __attribute__((packed));
+
+#define CACHE_LINE_SIZE 64
+
+// One emulated controller as its backend sees it. Fields are grouped by the
+// thread writing them, each group on its own cache lines, so the input side
+// and the output side of a controller only share the lines they hand state
+// across, and two controllers share none.
+struct output_channel_t {
+    // Set before the threads start, read-only afterwards.
+    unsigned index;
+    int state_eventfd; // signalled on every input change; -1 unless wanted
+    int uplink_eventfd; // wakes the input side when acks or rumble are due
+    const char* record_path; // mock
+
+    // Written by the input side.
+    _Alignas(CACHE_LINE_SIZE) struct joystick_seqlock_t state;
+    _Atomic bool report_acks;
+
+    // Written by the output side.
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t delivered_generation;
+    _Atomic uint32_t reports_delivered;
+    // The host's rumble, latest wins: strong << 16 | weak as FF_RUMBLE takes
+    // them, when the OUT report changing it came in, and how many changes
+    // there were; see output_received.
+    _Atomic uint32_t rumble;
+    _Atomic uint64_t rumble_ns;
+    _Atomic uint32_t rumble_changes;
+    struct macro_player_t macro; // started before the threads, at the first poll
+};
+
+// The state to hand the host on its next poll (device.c). While a macro is
+// running its step replaces the report and the poll counts as carrying no new
+// input, so report_delivered() only sees published changes.
+void next_report(struct output_channel_t* channel, uint32_t delivered_generation,
+    struct joystick_state_t* state);
+
+// Called by a backend whenever a report reached the host (device.c).
+void report_delivered(struct output_channel_t* channel, uint32_t* delivered_generation,
+    uint32_t generation, uint64_t stamp);
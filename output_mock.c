@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "output.h"
+
+// Stands in for a USB host: takes the queued report every poll_us, like an
+// interrupt IN endpoint being polled, and records it with its timestamps.
+// The queue behaves like ep1's: by default the report is sampled as soon as
+// the previous poll completes, as the blocking write does, so it waits a poll
+// period; with latest_state it is the current state at the poll.
+// Records are streamed to record_path when one is given, so a FIFO reader
+// sees every report live; otherwise only the latency histograms and the
+// counters printed at cleanup are kept.
+
+struct mock_data_t {
+    struct output_channel_t* channel;
+    int record_fd;
+    struct timespec next_poll;
+    struct joystick_state_t queued; // sampled after the previous poll
+    uint32_t delivered_generation;
+    // counters
+    uint64_t polls;
+    uint64_t changes;
+};
+
+bool mock_setup(void* data)
+{
+    struct mock_data_t** mock_data_ptr = data;
+    struct output_channel_t* channel = *(struct output_channel_t**)data;
+    printf("mock host %u polling every %u us\n", channel->index, g_output_config.poll_us);
+
+    int record_fd = -1;
+    if (channel->record_path != NULL) {
+        record_fd = open(channel->record_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (record_fd < 0) {
+            perror(channel->record_path);
+            return false;
+        }
+    }
+
+    struct mock_data_t* mock_data = calloc(1, sizeof(struct mock_data_t));
+    mock_data->channel = channel;
+    mock_data->record_fd = record_fd;
+    clock_gettime(CLOCK_MONOTONIC, &mock_data->next_poll);
+    next_report(channel, mock_data->delivered_generation, &mock_data->queued);
+    *mock_data_ptr = mock_data;
+    return true;
+}
+
+void mock_cleanup(void* data)
+{
+    struct mock_data_t** mock_data_ptr = data;
+    struct mock_data_t* mock_data = *mock_data_ptr;
+    if (mock_data == NULL) {
+        return;
+    }
+    printf("mock host %u: %lu polls, %lu carried new input\n", mock_data->channel->index,
+        (unsigned long)mock_data->polls, (unsigned long)mock_data->changes);
+    if (mock_data->record_fd >= 0) {
+        close(mock_data->record_fd);
+    }
+    free(mock_data);
+    *mock_data_ptr = NULL;
+}
+
+bool mock_loop(void* mock_data_void)
+{
+    struct mock_data_t* mock_data = mock_data_void;
+
+    // Absolute deadlines, so the polling rate doesn't drift with our own cost.
+    struct timespec* next = &mock_data->next_poll;
+    next->tv_nsec += (long)g_output_config.poll_us * 1000;
+    while (next->tv_nsec >= 1000000000) {
+        next->tv_nsec -= 1000000000;
+        ++next->tv_sec;
+    }
+    int r = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL);
+    if (r != 0 && r != EINTR) {
+        return false;
+    }
+
+    struct output_record_t record = { .poll_ns = monotonic_ns() };
+    struct joystick_state_t state = mock_data->queued;
+    if (g_output_config.latest_state) {
+        next_report(mock_data->channel, mock_data->delivered_generation, &state);
+    }
+    record.stamp = state.stamp;
+    record.generation = state.generation;
+    record.report = state.report;
+
+    ++mock_data->polls;
+    if (state.generation != mock_data->delivered_generation) {
+        ++mock_data->changes;
+    }
+    report_delivered(
+        mock_data->channel, &mock_data->delivered_generation, state.generation, state.stamp);
+    if (!g_output_config.latest_state) {
+        next_report(mock_data->channel, mock_data->delivered_generation, &mock_data->queued);
+    }
+
+    if (mock_data->record_fd >= 0
+        && write(mock_data->record_fd, &record, sizeof(record)) != (ssize_t)sizeof(record)) {
+        perror("mock record");
+        return false;
+    }
+    return true;
+}
+
+const struct output_backend_t g_mock_backend = {
+    .name = "mock",
+    .needs_state_events = false,
+    .setup_fn = mock_setup,
+    .loop_fn = mock_loop,
+    .cleanup_fn = mock_cleanup,
+};
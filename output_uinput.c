@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/uinput.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "output.h"
+
+// A virtual gamepad: every published state is turned into evdev events for
+// whatever changed, closed with a SYN_REPORT, as soon as it is published.
+// Sticks keep the report's 0..255 range, the HAT becomes ABS_HAT0X/Y.
+
+// Report Button bit -> key code.
+static const uint16_t button_codes[] = {
+    BTN_WEST, // Y
+    BTN_SOUTH, // B
+    BTN_EAST, // A
+    BTN_NORTH, // X
+    BTN_TL, // L
+    BTN_TR, // R
+    BTN_TL2, // ZL
+    BTN_TR2, // ZR
+    BTN_SELECT, // -
+    BTN_START, // +
+    BTN_THUMBL,
+    BTN_THUMBR,
+    BTN_MODE, // home
+    KEY_RECORD, // capture
+};
+
+#define BUTTON_COUNT (sizeof(button_codes) / sizeof(button_codes[0]))
+
+// HAT value -> x, y. Anything past HAT_CENTER is centered too.
+static const int8_t hat_axes[HAT_CENTER + 1][2] = {
+    [HAT_TOP] = { 0, -1 },
+    [HAT_TOP_RIGHT] = { 1, -1 },
+    [HAT_RIGHT] = { 1, 0 },
+    [HAT_BOTTOM_RIGHT] = { 1, 1 },
+    [HAT_BOTTOM] = { 0, 1 },
+    [HAT_BOTTOM_LEFT] = { -1, 1 },
+    [HAT_LEFT] = { -1, 0 },
+    [HAT_TOP_LEFT] = { -1, -1 },
+    [HAT_CENTER] = { 0, 0 },
+};
+
+struct uinput_data_t {
+    struct output_channel_t* channel;
+    int fd;
+    struct USB_JoystickReport_Input_t sent;
+    uint32_t delivered_generation;
+    // one report's worth: every button, 6 axes and the SYN
+    struct input_event events[BUTTON_COUNT + 7];
+    size_t event_count;
+};
+
+static bool setup_abs(int fd, uint16_t code, int32_t minimum, int32_t maximum)
+{
+    struct uinput_abs_setup abs = {
+        .code = code,
+        .absinfo = { .minimum = minimum, .maximum = maximum },
+    };
+    return ioctl(fd, UI_SET_ABSBIT, code) == 0 && ioctl(fd, UI_ABS_SETUP, &abs) == 0;
+}
+
+static void queue_event(struct uinput_data_t* uinput_data, uint16_t type, uint16_t code, int32_t value)
+{
+    uinput_data->events[uinput_data->event_count++] = (struct input_event) {
+        .type = type,
+        .code = code,
+        .value = value,
+    };
+}
+
+static void queue_axis(struct uinput_data_t* uinput_data, uint16_t code, uint8_t value, uint8_t sent)
+{
+    if (value != sent) {
+        queue_event(uinput_data, EV_ABS, code, value);
+    }
+}
+
+static bool uinput_write(struct uinput_data_t* uinput_data, const struct USB_JoystickReport_Input_t* report)
+{
+    const struct USB_JoystickReport_Input_t* sent = &uinput_data->sent;
+    uinput_data->event_count = 0;
+    uint16_t toggled = report->Button ^ sent->Button;
+    for (size_t n = 0; n < BUTTON_COUNT; ++n) {
+        if ((toggled >> n) & 1) {
+            queue_event(uinput_data, EV_KEY, button_codes[n], (report->Button >> n) & 1);
+        }
+    }
+    queue_axis(uinput_data, ABS_X, report->LX, sent->LX);
+    queue_axis(uinput_data, ABS_Y, report->LY, sent->LY);
+    queue_axis(uinput_data, ABS_RX, report->RX, sent->RX);
+    queue_axis(uinput_data, ABS_RY, report->RY, sent->RY);
+    const int8_t* hat = hat_axes[report->HAT <= HAT_CENTER ? report->HAT : HAT_CENTER];
+    const int8_t* sent_hat = hat_axes[sent->HAT <= HAT_CENTER ? sent->HAT : HAT_CENTER];
+    if (hat[0] != sent_hat[0]) {
+        queue_event(uinput_data, EV_ABS, ABS_HAT0X, hat[0]);
+    }
+    if (hat[1] != sent_hat[1]) {
+        queue_event(uinput_data, EV_ABS, ABS_HAT0Y, hat[1]);
+    }
+    if (uinput_data->event_count == 0) {
+        return true;
+    }
+    queue_event(uinput_data, EV_SYN, SYN_REPORT, 0);
+
+    size_t size = uinput_data->event_count * sizeof(struct input_event);
+    if (write(uinput_data->fd, uinput_data->events, size) != (ssize_t)size) {
+        perror("uinput write");
+        return false;
+    }
+    uinput_data->sent = *report;
+    return true;
+}
+
+bool uinput_setup(void* data)
+{
+    struct uinput_data_t** uinput_data_ptr = data;
+    struct output_channel_t* channel = *(struct output_channel_t**)data;
+    printf("uinput setup %u\n", channel->index);
+
+    int fd = open("/dev/uinput", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("/dev/uinput");
+        return false;
+    }
+
+    bool ok = ioctl(fd, UI_SET_EVBIT, EV_KEY) == 0 && ioctl(fd, UI_SET_EVBIT, EV_ABS) == 0;
+    for (size_t n = 0; n < BUTTON_COUNT && ok; ++n) {
+        ok = ioctl(fd, UI_SET_KEYBIT, button_codes[n]) == 0;
+    }
+    ok = ok && setup_abs(fd, ABS_X, 0, 255) && setup_abs(fd, ABS_Y, 0, 255)
+        && setup_abs(fd, ABS_RX, 0, 255) && setup_abs(fd, ABS_RY, 0, 255)
+        && setup_abs(fd, ABS_HAT0X, -1, 1) && setup_abs(fd, ABS_HAT0Y, -1, 1);
+
+    struct uinput_setup setup = {
+        .id = { .bustype = BUS_VIRTUAL, .vendor = 0x0f0d, .product = 0x0092, .version = 1 },
+        .name = "fake_joycon",
+    };
+    ok = ok && ioctl(fd, UI_DEV_SETUP, &setup) == 0 && ioctl(fd, UI_DEV_CREATE) == 0;
+    if (!ok) {
+        perror("uinput device setup");
+        close(fd);
+        return false;
+    }
+
+    struct uinput_data_t* uinput_data = calloc(1, sizeof(struct uinput_data_t));
+    uinput_data->channel = channel;
+    uinput_data->fd = fd;
+    uinput_data->sent.HAT = HAT_CENTER;
+    uinput_data->sent.LX = uinput_data->sent.LY = 128;
+    uinput_data->sent.RX = uinput_data->sent.RY = 128;
+    *uinput_data_ptr = uinput_data;
+    return true;
+}
+
+void uinput_cleanup(void* data)
+{
+    printf("uinput cleanup\n");
+    struct uinput_data_t** uinput_data_ptr = data;
+    struct uinput_data_t* uinput_data = *uinput_data_ptr;
+    if (uinput_data == NULL) {
+        return;
+    }
+    ioctl(uinput_data->fd, UI_DEV_DESTROY);
+    close(uinput_data->fd);
+    free(uinput_data);
+    *uinput_data_ptr = NULL;
+}
+
+bool uinput_loop(void* uinput_data_void)
+{
+    struct uinput_data_t* uinput_data = uinput_data_void;
+
+    struct output_channel_t* channel = uinput_data->channel;
+    struct pollfd fd = { .fd = channel->state_eventfd, .events = POLLIN };
+    if (poll(&fd, 1, -1) < 0) {
+        return errno == EINTR;
+    }
+    eventfd_t changes;
+    eventfd_read(channel->state_eventfd, &changes);
+
+    struct joystick_state_t state;
+    joystick_seqlock_read(&channel->state, &state);
+    if (!uinput_write(uinput_data, &state.report)) {
+        return false;
+    }
+    report_delivered(channel, &uinput_data->delivered_generation, state.generation, state.stamp);
+    return true;
+}
+
+const struct output_backend_t g_uinput_backend = {
+    .name = "uinput",
+    .needs_state_events = true,
+    .setup_fn = uinput_setup,
+    .loop_fn = uinput_loop,
+    .cleanup_fn = uinput_cleanup,
+};
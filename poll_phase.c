@@ -0,0 +1,66 @@
+#include "poll_phase.h"
+
+#include "latency.h"
+
+// Intervals at the start that only seed the period, with the shortest taken
+// so that early misses don't double it.
+#define POLL_PHASE_WARMUP 16
+// EWMA weights, as shifts: 1/16 for the period, 1/8 for the jitter.
+#define POLL_PHASE_PERIOD_SHIFT 4
+#define POLL_PHASE_JITTER_SHIFT 3
+// Sample this many mean deviations ahead of the lead.
+#define POLL_PHASE_JITTER_MARGIN 4
+
+void poll_phase_init(struct poll_phase_t* phase)
+{
+    *phase = (struct poll_phase_t) { .warmup = POLL_PHASE_WARMUP };
+}
+
+void poll_phase_complete(struct poll_phase_t* phase, uint64_t ns)
+{
+    uint64_t last = phase->last_ns;
+    phase->last_ns = ns;
+    ++phase->polls;
+    if (last == 0 || ns <= last) {
+        return;
+    }
+    uint64_t interval = ns - last;
+
+    if (phase->warmup > 0) {
+        --phase->warmup;
+        if (phase->period_ns == 0 || interval < phase->period_ns) {
+            phase->period_ns = interval;
+        }
+        return;
+    }
+
+    uint64_t period = phase->period_ns;
+    uint64_t polls = (interval + period / 2) / period;
+    if (polls == 0) {
+        polls = 1; // an early completion still marks one poll
+    }
+    phase->missed += polls - 1;
+
+    // only the last poll of the gap is timed, against the one predicted before it
+    uint64_t measured = interval - (polls - 1) * period;
+    int64_t error = (int64_t)(measured - period);
+    uint64_t deviation = error < 0 ? -error : error;
+    phase->period_ns = period + (error >> POLL_PHASE_PERIOD_SHIFT);
+    int64_t spread = (int64_t)deviation - (int64_t)phase->jitter_ns;
+    phase->jitter_ns += spread >> POLL_PHASE_JITTER_SHIFT;
+
+    latency_record(LATENCY_POLL_PERIOD, measured);
+    latency_record(LATENCY_POLL_JITTER, deviation);
+}
+
+uint64_t poll_phase_sample_at(const struct poll_phase_t* phase, uint64_t lead_ns)
+{
+    if (phase->warmup > 0 || phase->period_ns == 0) {
+        return 0;
+    }
+    uint64_t margin = lead_ns + POLL_PHASE_JITTER_MARGIN * phase->jitter_ns;
+    if (margin >= phase->period_ns) {
+        return 0;
+    }
+    return phase->last_ns + phase->period_ns - margin;
+}
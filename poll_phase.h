@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The host's real ep1 poll cadence, learned from transfer completions.
+//
+// bInterval only bounds how often the host may poll; the actual period and
+// where the polls fall are up to the host controller. Every completed IN
+// transfer marks a poll. The estimator keeps a smoothed period and a
+// smoothed deviation of each poll from where it was predicted, and from those
+// says when the next poll is due, so the report can be sampled just ahead of
+// it rather than a whole period early.
+//
+// A gap spanning several periods (the report was queued after a poll went by,
+// or the bus was suspended) is counted as that many polls, and only the last
+// of them is used to correct the estimate.
+
+struct poll_phase_t {
+    uint64_t last_ns; // previous completion; 0 before the first
+    uint64_t period_ns; // 0 until measured
+    uint64_t jitter_ns; // mean absolute deviation from the predicted poll
+    unsigned warmup; // intervals left during which the shortest one wins
+    uint64_t polls;
+    uint64_t missed; // polls that went by without a report of ours
+};
+
+void poll_phase_init(struct poll_phase_t* phase);
+
+// A transfer completed at `ns`; records the poll period and jitter stats.
+void poll_phase_complete(struct poll_phase_t* phase, uint64_t ns);
+
+// When to sample the report for the next poll: `lead_ns` plus a margin for
+// the measured jitter ahead of it. 0 while the cadence is still unknown.
+uint64_t poll_phase_sample_at(const struct poll_phase_t* phase, uint64_t lead_ns);
@@ -0,0 +1,479 @@
+#define _GNU_SOURCE
+#include "procon.h"
+
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "clock.h"
+
+const uint8_t procon_report_descriptor[PROCON_REPORT_DESCRIPTOR_SIZE] = {
+    0x05, 0x01,                    // Usage Page (Generic Desktop Ctrls)
+    0x15, 0x00,                    // Logical Minimum (0)
+    0x09, 0x04,                    // Usage (Joystick)
+    0xa1, 0x01,                    // Collection (Application)
+    0x85, 0x30,                    //   Report ID (0x30)
+    0x05, 0x01,                    //   Usage Page (Generic Desktop Ctrls)
+    0x05, 0x09,                    //   Usage Page (Button)
+    0x19, 0x01,                    //   Usage Minimum (0x01)
+    0x29, 0x0a,                    //   Usage Maximum (0x0A)
+    0x15, 0x00,                    //   Logical Minimum (0)
+    0x25, 0x01,                    //   Logical Maximum (1)
+    0x75, 0x01,                    //   Report Size (1)
+    0x95, 0x0a,                    //   Report Count (10)
+    0x55, 0x00,                    //   Unit Exponent (0)
+    0x65, 0x00,                    //   Unit (None)
+    0x81, 0x02,                    //   Input (Data,Var,Abs)
+    0x05, 0x09,                    //   Usage Page (Button)
+    0x19, 0x0b,                    //   Usage Minimum (0x0B)
+    0x29, 0x0e,                    //   Usage Maximum (0x0E)
+    0x15, 0x00,                    //   Logical Minimum (0)
+    0x25, 0x01,                    //   Logical Maximum (1)
+    0x75, 0x01,                    //   Report Size (1)
+    0x95, 0x04,                    //   Report Count (4)
+    0x81, 0x02,                    //   Input (Data,Var,Abs)
+    0x75, 0x01,                    //   Report Size (1)
+    0x95, 0x02,                    //   Report Count (2)
+    0x81, 0x03,                    //   Input (Const,Var,Abs)
+    0x0b, 0x01, 0x00, 0x01, 0x00,  //   Usage (0x010001)
+    0xa1, 0x00,                    //   Collection (Physical)
+    0x0b, 0x30, 0x00, 0x01, 0x00,  //     Usage (0x010030)
+    0x0b, 0x31, 0x00, 0x01, 0x00,  //     Usage (0x010031)
+    0x0b, 0x32, 0x00, 0x01, 0x00,  //     Usage (0x010032)
+    0x0b, 0x35, 0x00, 0x01, 0x00,  //     Usage (0x010035)
+    0x15, 0x00,                    //     Logical Minimum (0)
+    0x27, 0xff, 0xff, 0x00, 0x00,  //     Logical Maximum (65534)
+    0x75, 0x10,                    //     Report Size (16)
+    0x95, 0x04,                    //     Report Count (4)
+    0x81, 0x02,                    //     Input (Data,Var,Abs)
+    0xc0,                          //   End Collection
+    0x0b, 0x39, 0x00, 0x01, 0x00,  //   Usage (0x010039)
+    0x15, 0x00,                    //   Logical Minimum (0)
+    0x25, 0x07,                    //   Logical Maximum (7)
+    0x35, 0x00,                    //   Physical Minimum (0)
+    0x46, 0x3b, 0x01,              //   Physical Maximum (315)
+    0x65, 0x14,                    //   Unit (System: English Rotation, Length: Centimeter)
+    0x75, 0x04,                    //   Report Size (4)
+    0x95, 0x01,                    //   Report Count (1)
+    0x81, 0x02,                    //   Input (Data,Var,Abs)
+    0x05, 0x09,                    //   Usage Page (Button)
+    0x19, 0x0f,                    //   Usage Minimum (0x0F)
+    0x29, 0x12,                    //   Usage Maximum (0x12)
+    0x15, 0x00,                    //   Logical Minimum (0)
+    0x25, 0x01,                    //   Logical Maximum (1)
+    0x75, 0x01,                    //   Report Size (1)
+    0x95, 0x04,                    //   Report Count (4)
+    0x81, 0x02,                    //   Input (Data,Var,Abs)
+    0x75, 0x08,                    //   Report Size (8)
+    0x95, 0x34,                    //   Report Count (52)
+    0x81, 0x03,                    //   Input (Const,Var,Abs)
+    0x06, 0x00, 0xff,              //   Usage Page (Vendor Defined 0xFF00)
+    0x85, 0x21,                    //   Report ID (0x21)
+    0x09, 0x01,                    //   Usage (0x01)
+    0x75, 0x08,                    //   Report Size (8)
+    0x95, 0x3f,                    //   Report Count (63)
+    0x81, 0x03,                    //   Input (Const,Var,Abs)
+    0x85, 0x81,                    //   Report ID (0x81)
+    0x09, 0x02,                    //   Usage (0x02)
+    0x75, 0x08,                    //   Report Size (8)
+    0x95, 0x3f,                    //   Report Count (63)
+    0x81, 0x03,                    //   Input (Const,Var,Abs)
+    0x85, 0x01,                    //   Report ID (0x01)
+    0x09, 0x03,                    //   Usage (0x03)
+    0x75, 0x08,                    //   Report Size (8)
+    0x95, 0x3f,                    //   Report Count (63)
+    0x91, 0x83,                    //   Output (Const,Var,Abs,Volatile)
+    0x85, 0x10,                    //   Report ID (0x10)
+    0x09, 0x04,                    //   Usage (0x04)
+    0x75, 0x08,                    //   Report Size (8)
+    0x95, 0x3f,                    //   Report Count (63)
+    0x91, 0x83,                    //   Output (Const,Var,Abs,Volatile)
+    0x85, 0x80,                    //   Report ID (0x80)
+    0x09, 0x05,                    //   Usage (0x05)
+    0x75, 0x08,                    //   Report Size (8)
+    0x95, 0x3f,                    //   Report Count (63)
+    0x91, 0x83,                    //   Output (Const,Var,Abs,Volatile)
+    0x85, 0x82,                    //   Report ID (0x82)
+    0x09, 0x06,                    //   Usage (0x06)
+    0x75, 0x08,                    //   Report Size (8)
+    0x95, 0x3f,                    //   Report Count (63)
+    0x91, 0x83,                    //   Output (Const,Var,Abs,Volatile)
+    0xc0,                          // End Collection
+};
+
+// Input report bytes: id, timer, battery and connection, three button
+// bytes, two 12-bit stick pairs, the vibrator report, then the 0x21 reply.
+#define REPORT_TIMER 1
+#define REPORT_POWER 2
+#define REPORT_BUTTONS 3
+#define REPORT_LEFT_STICK 6
+#define REPORT_RIGHT_STICK 9
+#define REPLY_ACK 13
+#define REPLY_SUBCOMMAND 14
+#define REPLY_DATA 15
+
+// Full battery, charging, powered over USB.
+#define POWER_USB_FULL 0x91
+
+// Output report bytes: id, packet counter, rumble, then the subcommand.
+#define OUTPUT_RUMBLE_LEFT 2
+#define OUTPUT_RUMBLE_RIGHT 6
+#define OUTPUT_SUBCOMMAND 10
+#define OUTPUT_ARGS 11
+
+// Two 12-bit values in three bytes, as the sticks and their calibration are.
+#define STICK12(x, y) (x) & 0xff, ((x) >> 8) | (((y)&0x0f) << 4), (y) >> 4
+
+#define STICK_PARAMETERS                                                                          \
+    0x0f, 0x30, 0x61, 0x96, 0x30, 0xf3, 0xd4, 0x14, 0x54, 0x41, 0x15, 0x54, 0xc7, 0x79, 0x9c,     \
+        0x33, 0x36, 0x63
+
+// What the host reads of the SPI flash; everything else reads as erased,
+// which for the serial number and the user calibration means "none".
+static const struct {
+    uint32_t address;
+    uint8_t size;
+    uint8_t bytes[25];
+} spi_regions[] = {
+    // 6-axis factory calibration: accelerometer origin and sensitivity,
+    // gyro origin and sensitivity, int16 x/y/z each
+    { 0x6020, 24,
+        { 0, 0, 0, 0, 0, 0, 0x00, 0x40, 0x00, 0x40, 0x00, 0x40, 0, 0, 0, 0, 0, 0, 0x3b, 0x34, 0x3b,
+            0x34, 0x3b, 0x34 } },
+    // factory stick calibration, left (above, center, below) and right
+    // (center, below, above); the full 12-bit range procon_pack produces;
+    // then the body and button colors
+    { 0x603d, 25,
+        { STICK12(0x7ff, 0x7ff), STICK12(0x800, 0x800), STICK12(0x800, 0x800),
+            STICK12(0x800, 0x800), STICK12(0x800, 0x800), STICK12(0x7ff, 0x7ff), 0xff, 0x32,
+            0x32, 0x32, 0xff, 0xff, 0xff } },
+    // grip colors
+    { 0x6056, 6, { 0x32, 0x32, 0x32, 0x32, 0x32, 0x32 } },
+    // 6-axis horizontal offsets, then the left stick's parameters
+    { 0x6080, 24, { 0x50, 0xfd, 0x00, 0x00, 0xc6, 0x0f, STICK_PARAMETERS } },
+    // the right stick's parameters
+    { 0x6098, 18, { STICK_PARAMETERS } },
+};
+
+static void spi_read(uint32_t address, uint8_t size, uint8_t* out)
+{
+    memset(out, 0xff, size);
+    for (size_t n = 0; n < sizeof(spi_regions) / sizeof(spi_regions[0]); ++n) {
+        uint32_t start = spi_regions[n].address;
+        uint32_t end = start + spi_regions[n].size;
+        for (uint32_t at = address; at < address + size; ++at) {
+            if (at >= start && at < end) {
+                out[at - address] = spi_regions[n].bytes[at - start];
+            }
+        }
+    }
+}
+
+// CRC-8, polynomial 0x07, over the MCU's reply data.
+static uint8_t crc8(const uint8_t* data, size_t size)
+{
+    uint8_t crc = 0;
+    for (size_t n = 0; n < size; ++n) {
+        crc ^= data[n];
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+// HAT -> left button byte d-pad bits: down 0x01, up 0x02, right 0x04, left 0x08.
+static const uint8_t hat_dpad[16] = {
+    [HAT_TOP] = 0x02,
+    [HAT_TOP_RIGHT] = 0x06,
+    [HAT_RIGHT] = 0x04,
+    [HAT_BOTTOM_RIGHT] = 0x05,
+    [HAT_BOTTOM] = 0x01,
+    [HAT_BOTTOM_LEFT] = 0x09,
+    [HAT_LEFT] = 0x08,
+    [HAT_TOP_LEFT] = 0x0a,
+};
+
+static inline void pack_stick(uint8_t x, uint8_t y, uint8_t* out)
+{
+    uint16_t x12 = x << 4 | x >> 4;
+    uint16_t y12 = 0xfff - (y << 4 | y >> 4);
+    out[0] = x12 & 0xff;
+    out[1] = (x12 >> 8) | (y12 & 0x0f) << 4;
+    out[2] = y12 >> 4;
+}
+
+size_t procon_pack(const struct USB_JoystickReport_Input_t* input, uint8_t* out)
+{
+    // Report bits y b a x l r zl zr minus plus lstick rstick home capture,
+    // moved to the right byte (y x b a . . r zr), the shared byte (minus plus
+    // rstick lstick home capture) and the left byte (d-pad . . l zl).
+    uint16_t b = input->Button;
+    out[REPORT_BUTTONS] = (b & 0x01) | (b >> 2 & 0x02) | (b << 1 & 0x0c) | (b << 1 & 0x40)
+        | (b & 0x80);
+    out[REPORT_BUTTONS + 1] = (b >> 8 & 0x03) | (b >> 9 & 0x04) | (b >> 7 & 0x08) | (b >> 8 & 0x30);
+    out[REPORT_BUTTONS + 2] = hat_dpad[input->HAT & 0x0f] | (b << 2 & 0x40) | (b << 1 & 0x80);
+    pack_stick(input->LX, input->LY, out + REPORT_LEFT_STICK);
+    pack_stick(input->RX, input->RY, out + REPORT_RIGHT_STICK);
+    return PROCON_REPORT_SIZE;
+}
+
+bool procon_init(struct procon_t* procon, unsigned index)
+{
+    memset(procon, 0, sizeof(*procon));
+    procon->report[0] = 0x30;
+    procon->report[REPORT_POWER] = POWER_USB_FULL;
+    static const struct USB_JoystickReport_Input_t neutral
+        = { .HAT = HAT_CENTER, .LX = 128, .LY = 128, .RX = 128, .RY = 128 };
+    procon_pack(&neutral, procon->report);
+
+    // Nintendo's OUI; the instance in the last byte
+    const uint8_t mac[6] = { 0x98, 0xb6, 0xe9, 0x00, 0x00, index + 1 };
+    memcpy(procon->mac, mac, sizeof(mac));
+    procon->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return procon->eventfd >= 0;
+}
+
+void procon_destroy(struct procon_t* procon)
+{
+    if (procon->eventfd >= 0) {
+        close(procon->eventfd);
+        procon->eventfd = -1;
+    }
+}
+
+// The next free reply slot, cleared; NULL if the ep1 side is that far behind.
+static uint8_t* reply_begin(struct procon_t* procon, uint8_t id)
+{
+    unsigned head = atomic_load_explicit(&procon->reply_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&procon->reply_tail, memory_order_acquire);
+    if (head - tail == PROCON_REPLIES) {
+        return NULL;
+    }
+    uint8_t* reply = procon->replies[head % PROCON_REPLIES];
+    memset(reply, 0, PROCON_REPORT_SIZE);
+    reply[0] = id;
+    return reply;
+}
+
+static void reply_commit(struct procon_t* procon)
+{
+    unsigned head = atomic_load_explicit(&procon->reply_head, memory_order_relaxed);
+    atomic_store_explicit(&procon->reply_head, head + 1, memory_order_release);
+    eventfd_write(procon->eventfd, 1);
+}
+
+static void usb_command(struct procon_t* procon, uint8_t command)
+{
+    switch (command) {
+    case 0x01: // status: connected, Pro Controller, MAC least significant byte first
+    case 0x02: // handshake
+    case 0x03: // 3 Mbit baud rate
+    {
+        uint8_t* reply = reply_begin(procon, 0x81);
+        if (reply == NULL) {
+            return;
+        }
+        reply[1] = command;
+        if (command == 0x01) {
+            reply[3] = 0x03;
+            for (int n = 0; n < 6; ++n) {
+                reply[4 + n] = procon->mac[5 - n];
+            }
+        }
+        reply_commit(procon);
+        break;
+    }
+    case 0x04: // USB only, no timeout: input reports from here on
+        atomic_store(&procon->streaming, true);
+        eventfd_write(procon->eventfd, 1);
+        break;
+    case 0x05: // back to Bluetooth
+        atomic_store(&procon->streaming, false);
+        break;
+    }
+}
+
+static void subcommand(struct procon_t* procon, const uint8_t* data, size_t size)
+{
+    uint8_t* reply = reply_begin(procon, 0x21);
+    if (reply == NULL) {
+        return;
+    }
+    uint8_t id = data[OUTPUT_SUBCOMMAND];
+    const uint8_t* args = data + OUTPUT_ARGS;
+    reply[REPORT_POWER] = POWER_USB_FULL;
+    reply[REPLY_ACK] = 0x80;
+    reply[REPLY_SUBCOMMAND] = id;
+    uint8_t* out = reply + REPLY_DATA;
+
+    switch (id) {
+    case 0x01: // Bluetooth pairing
+        reply[REPLY_ACK] = 0x81;
+        out[0] = 0x03;
+        break;
+    case 0x02: // device info: firmware 3.139, Pro Controller, MAC, colors in SPI
+        reply[REPLY_ACK] = 0x82;
+        out[0] = 0x03;
+        out[1] = 0x8b;
+        out[2] = 0x03;
+        out[3] = 0x02;
+        memcpy(out + 4, procon->mac, 6);
+        out[10] = 0x01;
+        out[11] = 0x01;
+        break;
+    case 0x04: // trigger buttons elapsed time: never pressed
+        reply[REPLY_ACK] = 0x83;
+        break;
+    case 0x10: { // SPI flash read: address, size, then the bytes
+        uint8_t length = size >= OUTPUT_ARGS + 5 ? args[4] : 0;
+        if (length > PROCON_REPORT_SIZE - REPLY_DATA - 5) {
+            length = PROCON_REPORT_SIZE - REPLY_DATA - 5;
+        }
+        reply[REPLY_ACK] = 0x90;
+        memcpy(out, args, 4);
+        out[4] = length;
+        spi_read(args[0] | args[1] << 8 | args[2] << 16 | (uint32_t)args[3] << 24, length,
+            out + 5);
+        break;
+    }
+    case 0x21: // NFC/IR MCU configuration: the MCU's state report
+        reply[REPLY_ACK] = 0xa0;
+        out[0] = 0x01;
+        out[2] = 0xff;
+        out[4] = 0x08;
+        out[6] = 0x1b;
+        out[7] = 0x01;
+        out[33] = crc8(out, 33);
+        break;
+    default:
+        // input mode (0x03), shipment mode (0x08), player and home lights
+        // (0x30, 0x38), IMU (0x40, 0x41), vibration (0x48), MCU state (0x22):
+        // a plain ack
+        break;
+    }
+    reply_commit(procon);
+}
+
+// HD rumble amplitude codes, 0..100 in either band, as FF_RUMBLE
+// magnitudes: the controller's own curve, 2^(code / 32) / 8.7 from code 32,
+// 2^(code / 16) / 17 from 16 and linear below, scaled to 0xffff.
+static const uint16_t rumble_magnitude[101] = {
+    0, 482, 964, 1446, 1928, 2409, 2891, 3373, 3855, 4337,
+    4819, 5301, 5782, 6264, 6746, 7228, 7710, 8051, 8408, 8780,
+    9169, 9575, 9999, 10441, 10904, 11386, 11890, 12417, 12967, 13541,
+    14140, 14766, 15066, 15395, 15733, 16077, 16429, 16789, 17156, 17532,
+    17916, 18308, 18709, 19119, 19538, 19965, 20403, 20849, 21306, 21772,
+    22249, 22736, 23234, 23743, 24263, 24794, 25337, 25892, 26459, 27038,
+    27630, 28235, 28854, 29485, 30131, 30791, 31465, 32154, 32858, 33578,
+    34313, 35064, 35832, 36617, 37418, 38238, 39075, 39931, 40805, 41699,
+    42612, 43545, 44498, 45473, 46468, 47486, 48526, 49588, 50674, 51784,
+    52918, 54076, 55261, 56471, 57707, 58971, 60262, 61582, 62930, 64308,
+    65535,
+};
+
+static inline uint16_t amplitude(unsigned code)
+{
+    return rumble_magnitude[code < 100 ? code : 100];
+}
+
+// One side's four rumble bytes: the high band's amplitude is the top seven
+// bits of byte 1, the low band's is byte 3 less 0x40, shifted up one, with
+// the top bit of byte 2 below it. Both bands shake the one motor, so it
+// rumbles with the stronger of the two.
+static uint16_t rumble_side(const uint8_t* side)
+{
+    uint16_t high = amplitude(side[1] >> 1);
+    uint16_t low = side[3] < 0x40 ? 0 : amplitude(((side[3] - 0x40) << 1) | (side[2] >> 7));
+    return high > low ? high : low;
+}
+
+bool procon_rumble(const uint8_t* data, size_t size, uint16_t* strong, uint16_t* weak)
+{
+    if (size < OUTPUT_SUBCOMMAND || (data[0] != 0x01 && data[0] != 0x10)) {
+        return false;
+    }
+    *strong = rumble_side(data + OUTPUT_RUMBLE_LEFT);
+    *weak = rumble_side(data + OUTPUT_RUMBLE_RIGHT);
+    return true;
+}
+
+void procon_output(struct procon_t* procon, const uint8_t* data, size_t size)
+{
+    if (size < 2) {
+        return;
+    }
+    switch (data[0]) {
+    case 0x80:
+        usb_command(procon, data[1]);
+        break;
+    case 0x01: // rumble and a subcommand
+        if (size > OUTPUT_SUBCOMMAND) {
+            subcommand(procon, data, size);
+        }
+        break;
+    case 0x10: // rumble only
+        break;
+    }
+}
+
+bool procon_wait(struct procon_t* procon, uint64_t deadline_ns)
+{
+    for (;;) {
+        if (atomic_load_explicit(&procon->reply_head, memory_order_acquire)
+            != atomic_load_explicit(&procon->reply_tail, memory_order_relaxed)) {
+            return true;
+        }
+        uint64_t now = monotonic_ns();
+        uint64_t wake = deadline_ns;
+        if (atomic_load(&procon->streaming)) {
+            if (procon->next_report_ns == 0) {
+                procon->next_report_ns = now;
+            }
+            if (now >= procon->next_report_ns) {
+                return true;
+            }
+            if (wake == 0 || procon->next_report_ns < wake) {
+                wake = procon->next_report_ns;
+            }
+        } else {
+            procon->next_report_ns = 0;
+        }
+        if (deadline_ns != 0 && now >= deadline_ns) {
+            return false;
+        }
+
+        struct pollfd pollfd = { .fd = procon->eventfd, .events = POLLIN };
+        struct timespec timeout = { (wake - now) / 1000000000, (wake - now) % 1000000000 };
+        if (ppoll(&pollfd, 1, wake != 0 ? &timeout : NULL, NULL) > 0) {
+            eventfd_t count;
+            eventfd_read(procon->eventfd, &count);
+        }
+    }
+}
+
+const uint8_t* procon_input(struct procon_t* procon,
+    const struct USB_JoystickReport_Input_t* input)
+{
+    unsigned tail = atomic_load_explicit(&procon->reply_tail, memory_order_relaxed);
+    if (atomic_load_explicit(&procon->reply_head, memory_order_acquire) != tail) {
+        memcpy(procon->sending, procon->replies[tail % PROCON_REPLIES], PROCON_REPORT_SIZE);
+        atomic_store_explicit(&procon->reply_tail, tail + 1, memory_order_release);
+        if (procon->sending[0] == 0x21) {
+            procon->sending[REPORT_TIMER] = procon->timer++;
+            procon_pack(input, procon->sending);
+        }
+        return procon->sending;
+    }
+
+    procon->report[REPORT_TIMER] = procon->timer++;
+    procon_pack(input, procon->report);
+    // Keep the cadence; after a stall start over rather than catch up.
+    uint64_t now = monotonic_ns();
+    procon->next_report_ns += PROCON_REPORT_PERIOD_NS;
+    if (procon->next_report_ns <= now) {
+        procon->next_report_ns = now + PROCON_REPORT_PERIOD_NS;
+    }
+    return procon->report;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "joystick_state.h"
+
+// Switch Pro Controller protocol, for the procon profile.
+//
+// Over USB the host first talks to the controller with 0x80 commands on ep2:
+// 0x80 0x01 (status and MAC), 0x02 (handshake), 0x03 (high baud rate), each
+// answered with the matching 0x81 report on ep1, then 0x80 0x04 (USB only,
+// no timeout), after which the controller streams 0x30 full input reports on
+// its own, one per PROCON_REPORT_PERIOD_NS, until 0x80 0x05. Meanwhile 0x01
+// output reports carry subcommands (device info, SPI flash reads, input mode,
+// player lights, IMU and vibration enables), each answered with a 0x21 reply
+// that also carries the current input.
+//
+// Two sides, each single-threaded: the ep2 side hands every OUT report to
+// procon_output(), which queues replies; the ep1 side waits in procon_wait()
+// for a reply or the next report slot and sends what procon_input() returns.
+// The 0x30 report is a preformatted template: per report only the timer,
+// buttons and sticks are patched in place, and the template itself is sent.
+//
+// Inputs map from a USB_JoystickReport_Input_t: the 14 buttons to their Pro
+// counterparts, the HAT to the d-pad, and the 8-bit sticks to 12 bits, Y
+// flipped to point up. Factory calibration in the emulated SPI flash matches
+// that range.
+
+#define PROCON_REPORT_SIZE 64
+#define PROCON_REPORT_DESCRIPTOR_SIZE 203
+// The Pro Controller's own input report cadence over USB.
+#define PROCON_REPORT_PERIOD_NS 8000000ull
+// Replies queued from the ep2 side; the host waits for each before the next.
+#define PROCON_REPLIES 8
+
+extern const uint8_t procon_report_descriptor[PROCON_REPORT_DESCRIPTOR_SIZE];
+
+struct procon_t {
+    // The 0x30 report, patched in place and sent as is.
+    uint8_t report[PROCON_REPORT_SIZE];
+    // Replies, produced by procon_output and consumed by procon_input.
+    uint8_t replies[PROCON_REPLIES][PROCON_REPORT_SIZE];
+    _Atomic unsigned reply_head;
+    _Atomic unsigned reply_tail;
+    // The reply being sent, with the input patched in.
+    uint8_t sending[PROCON_REPORT_SIZE];
+    // Set by 0x80 0x04, cleared by 0x80 0x05.
+    atomic_bool streaming;
+    uint64_t next_report_ns; // ep1 side: when the next 0x30 report is due
+    uint8_t timer;
+    uint8_t mac[6];
+    int eventfd; // wakes procon_wait when a reply is queued or streaming starts
+};
+
+// `index` tells the instances' MAC addresses apart.
+bool procon_init(struct procon_t* procon, unsigned index);
+void procon_destroy(struct procon_t* procon);
+
+// ep2 side: one OUT report from the host.
+void procon_output(struct procon_t* procon, const uint8_t* data, size_t size);
+
+// ep1 side: block until there's a reply to send or the next 0x30 report is
+// due. False if `deadline_ns` (0 for none) passed first.
+bool procon_wait(struct procon_t* procon, uint64_t deadline_ns);
+
+// ep1 side, after procon_wait: the next IN report, PROCON_REPORT_SIZE bytes
+// with `input` in it. A queued reply goes first.
+const uint8_t* procon_input(struct procon_t* procon,
+    const struct USB_JoystickReport_Input_t* input);
+
+// The rumble of a 0x01 or 0x10 OUT report, as FF_RUMBLE magnitudes: the left
+// grip's motor as the strong one, the right's as the weak. False for reports
+// without rumble.
+bool procon_rumble(const uint8_t* data, size_t size, uint16_t* strong, uint16_t* weak);
+
+// Writes the buttons and sticks of `input` into a 0x30 or 0x21 report and
+// leaves the rest of it alone; returns PROCON_REPORT_SIZE.
+size_t procon_pack(const struct USB_JoystickReport_Input_t* input, uint8_t* out);
@@ -0,0 +1,283 @@
+// Scripted stand-in for the Switch, driving the Pro Controller protocol of
+// procon.c the way device's ep threads do, and checking what comes back.
+//
+// A device-side thread runs the procon ep1 loop against one end of a
+// SOCK_SEQPACKET socketpair in place of ep1, taking its input from a seqlock
+// as from the comm thread. The script plays the host: OUT reports go straight
+// to procon_output() as from ep2, IN reports are read off the other end.
+//
+// Script lines, '#' starts a comment:
+//   send <hex>...       an OUT report, zero-padded to 64 bytes
+//   expect <hex|..>...  the next IN report that isn't a 0x30 starts with
+//                       these bytes; .. matches any
+//   report <hex|..>...  a 0x30 report like this comes within a second
+//   stream <count>      past the reports already sent, count 0x30 reports
+//                       in a row, timer counting up, at the native cadence
+//   quiet <ms>          past the reports already sent, none for that long
+//   input <buttons> <hat> <lx> <ly> <rx> <ry>
+//                       the input from here on, as a report: buttons in hex
+// Exits non-zero at the first line that doesn't hold, printing it.
+
+#define _GNU_SOURCE
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "joystick_state.h"
+#include "procon.h"
+
+#define REPLY_TIMEOUT_MS 1000
+
+struct host_t {
+    struct procon_t procon;
+    struct joystick_seqlock_t input;
+    int device_fd; // the device thread's ep1
+    int host_fd;
+    atomic_bool stop;
+};
+
+static void* device_ep1(void* host_void)
+{
+    struct host_t* host = host_void;
+    while (!atomic_load(&host->stop)) {
+        if (!procon_wait(&host->procon, monotonic_ns() + 20000000)) {
+            continue;
+        }
+        struct joystick_state_t state;
+        joystick_seqlock_read(&host->input, &state);
+        const uint8_t* report = procon_input(&host->procon, &state.report);
+        if (write(host->device_fd, report, PROCON_REPORT_SIZE) != PROCON_REPORT_SIZE) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+// One IN report within timeout_ms; false if none came.
+static bool receive(struct host_t* host, uint8_t* report, int timeout_ms)
+{
+    struct pollfd pollfd = { .fd = host->host_fd, .events = POLLIN };
+    if (poll(&pollfd, 1, timeout_ms) != 1) {
+        return false;
+    }
+    return read(host->host_fd, report, PROCON_REPORT_SIZE) == PROCON_REPORT_SIZE;
+}
+
+// Skip the reports sent while the script was busy elsewhere.
+static void drain(struct host_t* host)
+{
+    uint8_t report[PROCON_REPORT_SIZE];
+    while (receive(host, report, 0)) {
+    }
+}
+
+static void print_report(const char* what, const uint8_t* report)
+{
+    printf("  %s:", what);
+    for (int n = 0; n < 32; ++n) {
+        printf(" %02x", report[n]);
+    }
+    printf(" ...\n");
+}
+
+// Hex bytes, or -1 for "..", from the rest of the line.
+static size_t parse_bytes(char** save, int* bytes, bool wildcards)
+{
+    size_t count = 0;
+    for (char* word = strtok_r(NULL, " \t\r", save); word != NULL && count < PROCON_REPORT_SIZE;
+         word = strtok_r(NULL, " \t\r", save)) {
+        bytes[count++] = wildcards && strcmp(word, "..") == 0 ? -1 : (int)strtoul(word, NULL, 16);
+    }
+    return count;
+}
+
+static bool matches(const uint8_t* report, const int* pattern, size_t count)
+{
+    for (size_t n = 0; n < count; ++n) {
+        if (pattern[n] >= 0 && report[n] != pattern[n]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool expect(struct host_t* host, const int* pattern, size_t count)
+{
+    uint8_t report[PROCON_REPORT_SIZE];
+    do {
+        if (!receive(host, report, REPLY_TIMEOUT_MS)) {
+            printf("  no reply\n");
+            return false;
+        }
+    } while (report[0] == 0x30);
+    if (!matches(report, pattern, count)) {
+        print_report("got", report);
+        return false;
+    }
+    return true;
+}
+
+static bool report(struct host_t* host, const int* pattern, size_t count)
+{
+    uint8_t report[PROCON_REPORT_SIZE] = { 0 };
+    uint64_t deadline = monotonic_ns() + REPLY_TIMEOUT_MS * 1000000ull;
+    while (monotonic_ns() < deadline) {
+        if (!receive(host, report, REPLY_TIMEOUT_MS)) {
+            break;
+        }
+        if (report[0] == 0x30 && matches(report, pattern, count)) {
+            return true;
+        }
+    }
+    print_report("last", report);
+    return false;
+}
+
+static bool stream(struct host_t* host, unsigned count)
+{
+    uint8_t report[PROCON_REPORT_SIZE];
+    uint64_t first_ns = 0, previous_ns = 0;
+    uint64_t shortest = UINT64_MAX, longest = 0;
+    uint8_t timer = 0;
+    drain(host);
+    for (unsigned n = 0; n < count; ++n) {
+        if (!receive(host, report, REPLY_TIMEOUT_MS) || report[0] != 0x30) {
+            printf("  report %u: %s\n", n, report[0] != 0x30 ? "not a 0x30" : "none");
+            return false;
+        }
+        uint64_t now = monotonic_ns();
+        if (n > 0) {
+            if (report[1] != (uint8_t)(timer + 1)) {
+                printf("  report %u: timer %u after %u\n", n, report[1], timer);
+                return false;
+            }
+            uint64_t interval = now - previous_ns;
+            shortest = interval < shortest ? interval : shortest;
+            longest = interval > longest ? interval : longest;
+        } else {
+            first_ns = now;
+        }
+        timer = report[1];
+        previous_ns = now;
+    }
+    if (count < 2) {
+        return true;
+    }
+    double period = (double)(previous_ns - first_ns) / (count - 1);
+    printf("  %u reports every %.3f ms (%.3f..%.3f)\n", count, period / 1e6, shortest / 1e6,
+        longest / 1e6);
+    return period > PROCON_REPORT_PERIOD_NS * 0.95 && period < PROCON_REPORT_PERIOD_NS * 1.05
+        && shortest > PROCON_REPORT_PERIOD_NS / 4; // no catching up in bursts
+}
+
+static bool run_line(struct host_t* host, char* line)
+{
+    char* save;
+    const char* command = strtok_r(line, " \t\r", &save);
+    int bytes[PROCON_REPORT_SIZE];
+    if (strcmp(command, "send") == 0) {
+        size_t count = parse_bytes(&save, bytes, false);
+        uint8_t output[PROCON_REPORT_SIZE] = { 0 };
+        for (size_t n = 0; n < count; ++n) {
+            output[n] = bytes[n];
+        }
+        procon_output(&host->procon, output, sizeof(output));
+        return true;
+    } else if (strcmp(command, "expect") == 0) {
+        size_t count = parse_bytes(&save, bytes, true);
+        return expect(host, bytes, count);
+    } else if (strcmp(command, "report") == 0) {
+        size_t count = parse_bytes(&save, bytes, true);
+        return report(host, bytes, count);
+    } else if (strcmp(command, "stream") == 0) {
+        const char* count = strtok_r(NULL, " \t\r", &save);
+        return count != NULL && stream(host, strtoul(count, NULL, 0));
+    } else if (strcmp(command, "quiet") == 0) {
+        const char* ms = strtok_r(NULL, " \t\r", &save);
+        uint8_t report[PROCON_REPORT_SIZE];
+        drain(host);
+        return ms != NULL && !receive(host, report, strtoul(ms, NULL, 0));
+    } else if (strcmp(command, "input") == 0) {
+        unsigned values[6];
+        for (int n = 0; n < 6; ++n) {
+            const char* word = strtok_r(NULL, " \t\r", &save);
+            if (word == NULL) {
+                return false;
+            }
+            values[n] = strtoul(word, NULL, n == 0 ? 16 : 10);
+        }
+        struct joystick_state_t state = {
+            .report = { .Button = values[0], .HAT = values[1], .LX = values[2],
+                .LY = values[3], .RX = values[4], .RY = values[5] },
+        };
+        joystick_seqlock_write(&host->input, &state);
+        return true;
+    }
+    printf("  unknown command %s\n", command);
+    return false;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s script (e.g. procon/switch_usb.script)\n", argv[0]);
+        return 1;
+    }
+    FILE* script = fopen(argv[1], "r");
+    if (script == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    static struct host_t host;
+    int fds[2];
+    if (!procon_init(&host.procon, 0) || socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0) {
+        perror("setup");
+        return 1;
+    }
+    host.device_fd = fds[0];
+    host.host_fd = fds[1];
+    struct joystick_state_t neutral = {
+        .report = { .HAT = HAT_CENTER, .LX = 128, .LY = 128, .RX = 128, .RY = 128 },
+    };
+    joystick_seqlock_write(&host.input, &neutral);
+    pthread_t device;
+    pthread_create(&device, NULL, device_ep1, &host);
+
+    bool ok = true;
+    char* line = NULL;
+    size_t capacity = 0;
+    unsigned number = 0;
+    while (ok && getline(&line, &capacity, script) > 0) {
+        ++number;
+        size_t length = strcspn(line, "#\n");
+        while (length > 0 && strchr(" \t\r", line[length - 1]) != NULL) {
+            --length;
+        }
+        line[length] = '\0';
+        if (length == 0) {
+            continue;
+        }
+        char text[256];
+        snprintf(text, sizeof(text), "%s", line);
+        ok = run_line(&host, line);
+        printf("%s %u: %s\n", ok ? "ok  " : "FAIL", number, text);
+    }
+    free(line);
+    fclose(script);
+
+    atomic_store(&host.stop, true);
+    close(host.host_fd);
+    pthread_join(device, NULL);
+    close(host.device_fd);
+    procon_destroy(&host.procon);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,228 @@
+#include "profile.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "procon.h"
+
+// Where a profile's IN report keeps each control, in bytes from its start.
+struct profile_layout_t {
+    size_t size;
+    size_t buttons; // little-endian 16 bits
+    uint16_t button_mask; // the buttons the descriptor declares
+    size_t hat; // low nibble; the high one is padding
+    size_t lx, ly, rx, ry;
+    size_t vendor;
+    bool has_vendor; // the vendor byte is data rather than padding
+};
+
+// Only ever called with one of the constant layouts below, and inlined into
+// that profile's packer, so every offset and mask is an immediate and the
+// tests on the layout fold away.
+static inline __attribute__((always_inline)) size_t pack_layout(
+    const struct profile_layout_t* layout, const struct USB_JoystickReport_Input_t* report,
+    uint8_t* out)
+{
+    memset(out, 0, layout->size);
+    uint16_t buttons = report->Button & layout->button_mask;
+    out[layout->buttons] = buttons & 0xff;
+    out[layout->buttons + 1] = buttons >> 8;
+    out[layout->hat] = report->HAT & 0x0f;
+    out[layout->lx] = report->LX;
+    out[layout->ly] = report->LY;
+    out[layout->rx] = report->RX;
+    out[layout->ry] = report->RY;
+    if (layout->has_vendor) {
+        out[layout->vendor] = report->VendorSpec;
+    }
+    return layout->size;
+}
+
+// HORIPAD S: 14 buttons and two padding bits, the HAT, four 8-bit axes and a
+// padding byte.
+static const uint8_t horipad_report_descriptor[] = {
+    0x05, 0x01,                    // USAGE_PAGE (Generic Desktop)
+    0x09, 0x05,                    // USAGE (Game Pad)
+    0xa1, 0x01,                    // COLLECTION (Application)
+    0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+    0x25, 0x01,                    //   LOGICAL_MAXIMUM (1)
+    0x35, 0x00,                    //   PHYSICAL_MINIMUM (0)
+    0x45, 0x01,                    //   PHYSICAL_MAXIMUM (1)
+    0x75, 0x01,                    //   REPORT_SIZE (1)
+    0x95, 0x0e,                    //   REPORT_COUNT (14)
+    0x05, 0x09,                    //   USAGE_PAGE (Button)
+    0x19, 0x01,                    //   USAGE_MINIMUM (Button 1)
+    0x29, 0x0e,                    //   USAGE_MAXIMUM (Button 14)
+    0x81, 0x02,                    //   INPUT (Data,Var,Abs)
+    0x95, 0x02,                    //   REPORT_COUNT (2)
+    0x81, 0x01,                    //   INPUT (Cnst,Ary,Abs)
+    0x05, 0x01,                    //   USAGE_PAGE (Generic Desktop)
+    0x25, 0x07,                    //   LOGICAL_MAXIMUM (7)
+    0x46, 0x3b, 0x01,              //   PHYSICAL_MAXIMUM (315)
+    0x75, 0x04,                    //   REPORT_SIZE (4)
+    0x95, 0x01,                    //   REPORT_COUNT (1)
+    0x65, 0x14,                    //   UNIT (Eng Rot:Angular Pos)
+    0x09, 0x39,                    //   USAGE (Hat switch)
+    0x81, 0x42,                    //   INPUT (Data,Var,Abs,Null)
+    0x65, 0x00,                    //   UNIT (None)
+    0x95, 0x01,                    //   REPORT_COUNT (1)
+    0x81, 0x01,                    //   INPUT (Cnst,Ary,Abs)
+    0x26, 0xff, 0x00,              //   LOGICAL_MAXIMUM (255)
+    0x46, 0xff, 0x00,              //   PHYSICAL_MAXIMUM (255)
+    0x09, 0x30,                    //   USAGE (X)
+    0x09, 0x31,                    //   USAGE (Y)
+    0x09, 0x32,                    //   USAGE (Z)
+    0x09, 0x35,                    //   USAGE (Rz)
+    0x75, 0x08,                    //   REPORT_SIZE (8)
+    0x95, 0x04,                    //   REPORT_COUNT (4)
+    0x81, 0x02,                    //   INPUT (Data,Var,Abs)
+    0x75, 0x08,                    //   REPORT_SIZE (8)
+    0x95, 0x01,                    //   REPORT_COUNT (1)
+    0x81, 0x01,                    //   INPUT (Cnst,Ary,Abs)
+    0xc0                           // END_COLLECTION
+};
+
+static const struct profile_layout_t horipad_layout = {
+    .size = 8,
+    .buttons = 0,
+    .button_mask = 0x3fff,
+    .hat = 2,
+    .lx = 3,
+    .ly = 4,
+    .rx = 5,
+    .ry = 6,
+    .has_vendor = false,
+};
+
+static size_t pack_horipad(const struct USB_JoystickReport_Input_t* report, uint8_t* out)
+{
+    return pack_layout(&horipad_layout, report, out);
+}
+
+const struct profile_t g_profile_horipad = {
+    .name = "horipad",
+    .vendor_id = 0x0f0d,
+    .product_id = 0x00c1,
+    .bcd_device = 0x0572,
+    .manufacturer = "HORI CO.,LTD.",
+    .product = "HORIPAD S",
+    .serial = NULL,
+    .report_descriptor = horipad_report_descriptor,
+    .report_descriptor_size = sizeof(horipad_report_descriptor),
+    .protocol = PROFILE_PROTOCOL_HID,
+    .pack = pack_horipad,
+    .rumble = NULL,
+};
+
+// PowerA Core (Plus): 16 buttons, the HAT, four 8-bit axes and a vendor
+// byte, plus an 8-byte output report.
+static const uint8_t core_plus_report_descriptor[] = {
+    0x05, 0x01,                    // Usage Page (Generic Desktop Ctrls)
+    0x09, 0x04,                    // Usage (Joystick)
+    0xa1, 0x01,                    // Collection (Application)
+    0x15, 0x00,                    //   Logical Minimum (0)
+    0x25, 0x01,                    //   Logical Maximum (1)
+    0x35, 0x00,                    //   Physical Minimum (0)
+    0x45, 0x01,                    //   Physical Maximum (1)
+    0x75, 0x01,                    //   Report Size (1)
+    0x95, 0x10,                    //   Report Count (16)
+    0x05, 0x09,                    //   Usage Page (Button)
+    0x19, 0x01,                    //   Usage Minimum (0x01)
+    0x29, 0x10,                    //   Usage Maximum (0x10)
+    0x81, 0x02,                    //   Input (Data,Var,Abs)
+    0x05, 0x01,                    //   Usage Page (Generic Desktop Ctrls)
+    0x25, 0x07,                    //   Logical Maximum (7)
+    0x46, 0x3b, 0x01,              //   Physical Maximum (315)
+    0x75, 0x04,                    //   Report Size (4)
+    0x95, 0x01,                    //   Report Count (1)
+    0x65, 0x14,                    //   Unit (System: English Rotation, Length: Centimeter)
+    0x09, 0x39,                    //   Usage (Hat switch)
+    0x81, 0x42,                    //   Input (Data,Var,Abs,Null State)
+    0x65, 0x00,                    //   Unit (None)
+    0x95, 0x01,                    //   Report Count (1)
+    0x81, 0x01,                    //   Input (Const,Array,Abs)
+    0x26, 0xff, 0x00,              //   Logical Maximum (255)
+    0x46, 0xff, 0x00,              //   Physical Maximum (255)
+    0x09, 0x30,                    //   Usage (X)
+    0x09, 0x31,                    //   Usage (Y)
+    0x09, 0x32,                    //   Usage (Z)
+    0x09, 0x35,                    //   Usage (Rz)
+    0x75, 0x08,                    //   Report Size (8)
+    0x95, 0x04,                    //   Report Count (4)
+    0x81, 0x02,                    //   Input (Data,Var,Abs)
+    0x06, 0x00, 0xff,              //   Usage Page (Vendor Defined 0xFF00)
+    0x09, 0x20,                    //   Usage (0x20)
+    0x95, 0x01,                    //   Report Count (1)
+    0x81, 0x02,                    //   Input (Data,Var,Abs)
+    0x0a, 0x21, 0x26,              //   Usage (0x2621)
+    0x95, 0x08,                    //   Report Count (8)
+    0x91, 0x02,                    //   Output (Data,Var,Abs)
+    0xc0,                          // End Collection
+};
+
+static const struct profile_layout_t core_plus_layout = {
+    .size = 8,
+    .buttons = 0,
+    .button_mask = 0xffff,
+    .hat = 2,
+    .lx = 3,
+    .ly = 4,
+    .rx = 5,
+    .ry = 6,
+    .vendor = 7,
+    .has_vendor = true,
+};
+
+static size_t pack_core_plus(const struct USB_JoystickReport_Input_t* report, uint8_t* out)
+{
+    return pack_layout(&core_plus_layout, report, out);
+}
+
+static const struct profile_t profile_core_plus = {
+    .name = "core-plus",
+    .vendor_id = 0x20d6,
+    .product_id = 0xa711,
+    .bcd_device = 0x0200,
+    .manufacturer = "Bensussen Deutsch & Associates,Inc.(BDA)",
+    .product = "Core (Plus) Wired Controller",
+    .serial = "000000000001",
+    .report_descriptor = core_plus_report_descriptor,
+    .report_descriptor_size = sizeof(core_plus_report_descriptor),
+    .protocol = PROFILE_PROTOCOL_HID,
+    .pack = pack_core_plus,
+    .rumble = NULL, // the output report's layout is unknown
+};
+
+// Switch Pro Controller; the reports and the protocol are in procon.c.
+static const struct profile_t profile_procon = {
+    .name = "procon",
+    .vendor_id = 0x057e,
+    .product_id = 0x2009,
+    .bcd_device = 0x0200,
+    .manufacturer = "Nintendo Co., Ltd.",
+    .product = "Pro Controller",
+    .serial = "000000000001",
+    .report_descriptor = procon_report_descriptor,
+    .report_descriptor_size = PROCON_REPORT_DESCRIPTOR_SIZE,
+    .protocol = PROFILE_PROTOCOL_PROCON,
+    .pack = procon_pack,
+    .rumble = procon_rumble,
+};
+
+const struct profile_t* const g_profiles[] = {
+    &g_profile_horipad,
+    &profile_core_plus,
+    &profile_procon,
+};
+
+const size_t g_profile_count = sizeof(g_profiles) / sizeof(g_profiles[0]);
+
+const struct profile_t* profile_find(const char* name)
+{
+    for (size_t n = 0; n < g_profile_count; ++n) {
+        if (strcmp(name, g_profiles[n]->name) == 0) {
+            return g_profiles[n];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "joystick_state.h"
+
+// The controllers the gadget can pass for. A profile is everything the host
+// sees of one: the gadget IDs and strings setup.sh writes to configfs (device
+// -G prints them), the HID report descriptor ep0 hands out, and the layout of
+// the IN reports on ep1.
+//
+// Inside the device every report is a USB_JoystickReport_Input_t, whatever
+// the profile; mapping, macros, captures and the mock and uinput backends all
+// work on that. Only the FunctionFS endpoints pack it into the profile's
+// layout. Each profile's packer is its own function with the layout folded in
+// at compile time, picked once at startup, so the packer neither branches on
+// the profile nor looks anything up.
+
+// wMaxPacketSize of ep1; no profile's report is bigger.
+#define PROFILE_MAX_REPORT 64
+
+// How the IN reports come about.
+enum profile_protocol {
+    // One report per host poll, nothing but input in it.
+    PROFILE_PROTOCOL_HID,
+    // The Pro Controller's handshake, subcommands and own report cadence;
+    // see procon.h.
+    PROFILE_PROTOCOL_PROCON,
+};
+
+typedef size_t (*profile_pack_fn)(const struct USB_JoystickReport_Input_t* report, uint8_t* out);
+typedef bool (*profile_rumble_fn)(const uint8_t* data, size_t size, uint16_t* strong,
+    uint16_t* weak);
+
+struct profile_t {
+    const char* name;
+    uint16_t vendor_id;
+    uint16_t product_id;
+    uint16_t bcd_device;
+    const char* manufacturer;
+    const char* product;
+    const char* serial; // NULL: none
+    const uint8_t* report_descriptor;
+    uint16_t report_descriptor_size;
+    enum profile_protocol protocol;
+    // Writes one IN report of the profile's layout, returns its length. The
+    // Pro Controller's only writes the input fields into its template.
+    profile_pack_fn pack;
+    // Reads the rumble out of one OUT report from ep2, as FF_RUMBLE motor
+    // magnitudes; false if that report has none. NULL: the host never
+    // rumbles this profile.
+    profile_rumble_fn rumble;
+};
+
+extern const struct profile_t* const g_profiles[];
+extern const size_t g_profile_count;
+
+// The profile device uses unless told otherwise (-C).
+extern const struct profile_t g_profile_horipad;
+
+// NULL if there is no profile by that name.
+const struct profile_t* profile_find(const char* name);
@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+#include "rt.h"
+
+#include <alloca.h>
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/capability.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Left untouched at the far end of a prefaulted stack, for the thread's own
+// frames above the prefault and whatever glibc keeps there.
+#define RT_STACK_RESERVE (64 * 1024)
+
+struct rt_config_t g_rt_config = {
+    .enabled = false,
+    .roles = {
+        [RT_ROLE_IO] = { SCHED_FIFO, 80 },
+        [RT_ROLE_CONTROL] = { SCHED_FIFO, 50 },
+        [RT_ROLE_COMM] = { SCHED_FIFO, 70 },
+    },
+    .stack_size = 256 * 1024,
+    .heap_prefault = 8 * 1024 * 1024,
+};
+
+static const char* const role_names[RT_ROLE_COUNT] = {
+    [RT_ROLE_IO] = "io",
+    [RT_ROLE_CONTROL] = "control",
+    [RT_ROLE_COMM] = "comm",
+};
+
+static const struct {
+    const char* name;
+    int policy;
+} policy_names[] = {
+    { "fifo", SCHED_FIFO },
+    { "rr", SCHED_RR },
+    { "other", SCHED_OTHER },
+};
+
+static bool parse_policy(const char* text, struct rt_policy_t* policy)
+{
+    size_t length = strcspn(text, ":");
+    for (size_t n = 0; n < sizeof(policy_names) / sizeof(policy_names[0]); ++n) {
+        if (strlen(policy_names[n].name) != length
+            || strncmp(text, policy_names[n].name, length) != 0) {
+            continue;
+        }
+        int min = sched_get_priority_min(policy_names[n].policy);
+        int max = sched_get_priority_max(policy_names[n].policy);
+        policy->policy = policy_names[n].policy;
+        policy->priority = (min + max) / 2;
+        if (text[length] == ':') {
+            char* end;
+            policy->priority = strtol(text + length + 1, &end, 10);
+            if (*end != '\0') {
+                return false;
+            }
+        }
+        return policy->priority >= min && policy->priority <= max;
+    }
+    return false;
+}
+
+bool rt_parse(struct rt_config_t* config, const char* spec)
+{
+    config->enabled = true;
+    if (strcmp(spec, "on") == 0) {
+        return true;
+    }
+    char* copy = strdup(spec);
+    char* save;
+    bool ok = true;
+    for (char* item = strtok_r(copy, ",", &save); item != NULL && ok;
+         item = strtok_r(NULL, ",", &save)) {
+        struct rt_policy_t policy;
+        char* equals = strchr(item, '=');
+        if (equals == NULL) {
+            ok = parse_policy(item, &policy);
+            for (int role = 0; ok && role < RT_ROLE_COUNT; ++role) {
+                config->roles[role] = policy;
+            }
+            continue;
+        }
+        *equals = '\0';
+        int role = 0;
+        while (role < RT_ROLE_COUNT && strcmp(item, role_names[role]) != 0) {
+            ++role;
+        }
+        ok = role < RT_ROLE_COUNT && parse_policy(equals + 1, &policy);
+        if (ok) {
+            config->roles[role] = policy;
+        }
+    }
+    free(copy);
+    return ok;
+}
+
+// Whether every mapping the process will ever make can be locked: with
+// CAP_IPC_LOCK, or once the soft RLIMIT_MEMLOCK is raised to an unlimited hard
+// one. Reports the soft limit otherwise.
+static bool memlock_unlimited(rlim_t* limit)
+{
+    struct __user_cap_header_struct header = { .version = _LINUX_CAPABILITY_VERSION_3 };
+    struct __user_cap_data_struct caps[_LINUX_CAPABILITY_U32S_3];
+    if (syscall(SYS_capget, &header, caps) == 0
+        && (caps[CAP_TO_INDEX(CAP_IPC_LOCK)].effective & CAP_TO_MASK(CAP_IPC_LOCK))) {
+        *limit = RLIM_INFINITY;
+        return true;
+    }
+    struct rlimit memlock;
+    if (getrlimit(RLIMIT_MEMLOCK, &memlock) < 0) {
+        *limit = 0;
+        return false;
+    }
+    if (memlock.rlim_cur != memlock.rlim_max) {
+        memlock.rlim_cur = memlock.rlim_max;
+        setrlimit(RLIMIT_MEMLOCK, &memlock);
+    }
+    *limit = memlock.rlim_cur;
+    return memlock.rlim_cur == RLIM_INFINITY;
+}
+
+void rt_setup_process(const struct rt_config_t* config)
+{
+    if (!config->enabled) {
+        return;
+    }
+    for (int role = 0; role < RT_ROLE_COUNT; ++role) {
+        const struct rt_policy_t* policy = &config->roles[role];
+        printf("rt: %s threads %s:%i\n", role_names[role],
+            policy->policy == SCHED_FIFO ? "fifo" : policy->policy == SCHED_RR ? "rr" : "other",
+            policy->priority);
+    }
+
+    // Before the lock, so the arena it prefaults stays ours: freed memory is
+    // kept rather than trimmed, and big blocks come from the heap too.
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    // MCL_FUTURE charges every later mapping against RLIMIT_MEMLOCK, thread
+    // stacks and ZMQ's buffers included; under a finite limit mmap and
+    // pthread_create fail with EAGAIN once it's used up. So everything is
+    // locked only when nothing limits it, and otherwise just the heap below.
+    rlim_t limit;
+    bool lock_all = memlock_unlimited(&limit);
+    if (lock_all && mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        fprintf(stderr, "rt: mlockall: %s; memory stays pageable\n", strerror(errno));
+    }
+
+    volatile uint8_t* heap = malloc(config->heap_prefault);
+    if (heap == NULL) {
+        fprintf(stderr, "rt: can't prefault %zu bytes of heap\n", config->heap_prefault);
+        return;
+    }
+    long page = sysconf(_SC_PAGESIZE);
+    for (size_t offset = 0; offset < config->heap_prefault; offset += page) {
+        heap[offset] = 0;
+    }
+    if (!lock_all) {
+        // whole pages only: the block's ragged ends could tip it over the limit
+        uintptr_t start = ((uintptr_t)heap + page - 1) & ~(uintptr_t)(page - 1);
+        uintptr_t end = ((uintptr_t)heap + config->heap_prefault) & ~(uintptr_t)(page - 1);
+        bool heap_locked = end > start && mlock((void*)start, end - start) == 0;
+        fprintf(stderr, "rt: RLIMIT_MEMLOCK is %llu bytes; %s\n", (unsigned long long)limit,
+            heap_locked ? "only the prefaulted heap is locked" : "memory stays pageable");
+    }
+    free((void*)heap);
+}
+
+struct rt_start_t {
+    void* (*body)(void*);
+    void* arg;
+    size_t prefault;
+};
+
+static __attribute__((noinline)) void prefault_stack(size_t size)
+{
+    volatile uint8_t* stack = alloca(size);
+    long page = sysconf(_SC_PAGESIZE);
+    for (size_t offset = 0; offset < size; offset += page) {
+        stack[offset] = 0;
+    }
+}
+
+static void* rt_thread_body(void* start_void)
+{
+    struct rt_start_t start = *(struct rt_start_t*)start_void;
+    free(start_void);
+    if (start.prefault > 0) {
+        prefault_stack(start.prefault);
+    }
+    return start.body(start.arg);
+}
+
+bool rt_thread_start(const struct rt_config_t* config, pthread_t* thread, void* (*body)(void*),
+    void* arg, int cpu, enum rt_role role)
+{
+    static atomic_bool warned;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+    if (!config->enabled) {
+        int error = pthread_create(thread, &attr, body, arg);
+        pthread_attr_destroy(&attr);
+        if (error != 0) {
+            fprintf(stderr, "thread on cpu %i: %s\n", cpu, strerror(error));
+            return false;
+        }
+        return true;
+    }
+
+    struct rt_start_t* start = malloc(sizeof(*start));
+    *start = (struct rt_start_t) { .body = body, .arg = arg };
+    if (config->stack_size > RT_STACK_RESERVE) {
+        start->prefault = config->stack_size - RT_STACK_RESERVE;
+    }
+    pthread_attr_setstacksize(&attr, config->stack_size);
+    struct sched_param param = { .sched_priority = config->roles[role].priority };
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, config->roles[role].policy);
+    pthread_attr_setschedparam(&attr, &param);
+
+    int error = pthread_create(thread, &attr, rt_thread_body, start);
+    if (error == EPERM) {
+        if (!atomic_exchange(&warned, true)) {
+            fprintf(stderr, "rt: no permission for real-time policies; threads keep the default\n");
+        }
+        pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        error = pthread_create(thread, &attr, rt_thread_body, start);
+    }
+    pthread_attr_destroy(&attr);
+    if (error != 0) {
+        fprintf(stderr, "%s thread on cpu %i: %s\n", role_names[role], cpu, strerror(error));
+        free(start);
+        return false;
+    }
+    return true;
+}
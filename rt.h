@@ -0,0 +1,55 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Real-time execution for the device's threads. Off by default, when threads
+// get default attributes plus their CPU pin. Enabled:
+// - rt_setup_process() tells malloc never to trim the heap or serve blocks
+//   with mmap, then touches and frees heap_prefault bytes, so later
+//   allocations come from resident memory. With CAP_IPC_LOCK or an unlimited
+//   RLIMIT_MEMLOCK it locks all current and future memory; under a finite
+//   limit only that heap, since locking future mappings would make thread
+//   creation fail once the limit is reached;
+// - every thread is created with its role's policy and priority and a
+//   stack_size stack, which it touches before running its body.
+// Each step that lacks privilege (CAP_SYS_NICE or RLIMIT_RTPRIO for the
+// policies, RLIMIT_MEMLOCK for the lock) warns once and carries on the
+// default way, so the same command line works unprivileged.
+
+enum rt_role {
+    // ep1/ep2, the AIO engine, the output backends and the reactor, which
+    // services ep1 itself: what the host waits on
+    RT_ROLE_IO,
+    RT_ROLE_CONTROL, // ep0
+    RT_ROLE_COMM, // the server session, replay
+    RT_ROLE_COUNT,
+};
+
+struct rt_policy_t {
+    int policy; // SCHED_FIFO, SCHED_RR or SCHED_OTHER
+    int priority;
+};
+
+struct rt_config_t {
+    bool enabled;
+    struct rt_policy_t roles[RT_ROLE_COUNT];
+    size_t stack_size;
+    size_t heap_prefault;
+};
+
+extern struct rt_config_t g_rt_config;
+
+// Enable real-time mode from a spec: "on" for the defaults, or a
+// comma-separated list of policies, each either for every role ("fifo:80")
+// or for one ("io=fifo:80", "control=rr:40", "comm=other").
+bool rt_parse(struct rt_config_t* config, const char* spec);
+
+// Lock and prefault memory. Call once from main, before starting threads.
+void rt_setup_process(const struct rt_config_t* config);
+
+// Start a thread the way `config` says for `role`, pinned to `cpu` unless it
+// is negative.
+bool rt_thread_start(const struct rt_config_t* config, pthread_t* thread, void* (*body)(void*),
+    void* arg, int cpu, enum rt_role role);
@@ -1,5 +1,14 @@
 #!/bin/bash
 [ "$UID" -eq 0 ] || exec sudo -E bash "$0" "$@"
+# setup.sh [count] [controller]: one FunctionFS function per controller, for
+# device -n count -C controller. Function n > 0 is ffs.hid<n>, mounted at
+# /tmp/mount_point<n>. The gadget IDs and strings are the controller profile's,
+# as printed by device -G; $DEVICE overrides the device binary.
+count=${1:-1}
+controller=${2:-horipad}
+device=${DEVICE:-$(dirname "$0")/build/device}
+gadget=$("$device" -C "$controller" -G) || exit 1
+eval "$gadget"
 modprobe libcomposite
 modprobe usb_f_fs
 cd /sys/kernel/config/usb_gadget
@@ -9,9 +18,9 @@ cd /sys/kernel/config/usb_gadget
 #    exit 0
 #fi
 mkdir -p fakejoycon; cd fakejoycon
-echo "0x0f0d" > idVendor  # put actual vendor ID here
-echo "0x00c1" > idProduct # put actual product ID here
-echo "0x0572" > bcdDevice # put actual product ID here
+echo "$vendor_id" > idVendor
+echo "$product_id" > idProduct
+echo "$bcd_device" > bcdDevice
 echo "0x0200" > bcdUSB # put actual product ID here
 echo "0" > bDeviceClass
 echo "0" > bDeviceSubClass
@@ -23,10 +32,13 @@ echo "500" > configs/c.1/MaxPower
 mkdir -p configs/c.1/strings/0x409
 #echo "" > configs/c.1/strings/0x409/configuration
 mkdir -p strings/0x409
-echo "HORI CO.,LTD." > strings/0x409/manufacturer
-echo "HORIPAD S" > strings/0x409/product
-#echo "69420" > strings/0x409/serialnumber
-mkdir -p functions/ffs.hid
-ln -s functions/ffs.hid configs/c.1/
-mkdir -p /tmp/mount_point
-mount hid -t functionfs /tmp/mount_point
+echo "$manufacturer" > strings/0x409/manufacturer
+echo "$product" > strings/0x409/product
+[ -z "$serial" ] || echo "$serial" > strings/0x409/serialnumber
+for n in $(seq 0 $((count - 1))); do
+    suffix=$([ "$n" -eq 0 ] || echo "$n")
+    mkdir -p functions/ffs.hid$suffix
+    ln -s functions/ffs.hid$suffix configs/c.1/
+    mkdir -p /tmp/mount_point$suffix
+    mount hid$suffix -t functionfs /tmp/mount_point$suffix
+done
@@ -0,0 +1,299 @@
+#include "wire.h"
+
+#include "clock.h"
+
+#include <linux/joystick.h>
+#include <string.h>
+
+void wire_state_apply_js_event(struct wire_state_t* state, const struct js_event* event)
+{
+    state->time = event->time;
+    switch (event->type & ~JS_EVENT_INIT) {
+    case JS_EVENT_BUTTON:
+        if (event->number < state->button_count) {
+            if (event->value)
+                state->buttons |= 1u << event->number;
+            else
+                state->buttons &= ~(1u << event->number);
+        }
+        break;
+    case JS_EVENT_AXIS:
+        if (event->number < state->axis_count) {
+            state->axes[event->number] = event->value;
+        }
+        break;
+    }
+}
+
+void wire_encoder_init(struct wire_encoder_t* encoder)
+{
+    memset(encoder, 0, sizeof(*encoder));
+    encoder->keyframe_requested = true;
+}
+
+void wire_encoder_request_keyframe(struct wire_encoder_t* encoder)
+{
+    encoder->keyframe_requested = true;
+}
+
+static uint32_t changed_fields(const struct wire_state_t* a, const struct wire_state_t* b)
+{
+    uint32_t fields = a->buttons != b->buttons ? WIRE_FIELD_BUTTONS : 0;
+    for (uint8_t n = 0; n < b->axis_count; ++n) {
+        if (a->axes[n] != b->axes[n]) {
+            fields |= WIRE_FIELD_AXIS(n);
+        }
+    }
+    return fields;
+}
+
+static uint32_t all_fields(uint8_t axis_count)
+{
+    return WIRE_FIELD_BUTTONS | (WIRE_FIELD_AXIS(axis_count) - WIRE_FIELD_AXIS(0));
+}
+
+size_t wire_encode_state(struct wire_encoder_t* encoder, const struct wire_state_t* state,
+    uint8_t* buf, size_t len)
+{
+    bool keyframe = encoder->keyframe_requested
+        || encoder->frames_since_keyframe + 1 >= WIRE_KEYFRAME_INTERVAL
+        || state->button_count != encoder->sent.button_count
+        || state->axis_count != encoder->sent.axis_count;
+    uint32_t fields = keyframe ? all_fields(state->axis_count) : changed_fields(&encoder->sent, state);
+    if (fields == 0) {
+        return 0;
+    }
+
+    uint8_t frame[WIRE_MAX_FRAME];
+    struct wire_state_header_t header = {
+        .header = {
+            .version = WIRE_VERSION,
+            .kind = keyframe ? WIRE_KEYFRAME : WIRE_DELTA,
+            .seq = encoder->seq,
+        },
+        .time = state->time,
+        .sent_us = (uint32_t)(monotonic_ns() / 1000),
+        .fields = fields,
+    };
+    size_t used = sizeof(header);
+    memcpy(frame, &header, sizeof(header));
+    if (keyframe) {
+        frame[used++] = state->button_count;
+        frame[used++] = state->axis_count;
+    }
+    if (fields & WIRE_FIELD_BUTTONS) {
+        memcpy(frame + used, &state->buttons, sizeof(state->buttons));
+        used += sizeof(state->buttons);
+    }
+    for (uint8_t n = 0; n < state->axis_count; ++n) {
+        if (fields & WIRE_FIELD_AXIS(n)) {
+            memcpy(frame + used, &state->axes[n], sizeof(state->axes[n]));
+            used += sizeof(state->axes[n]);
+        }
+    }
+    if (used > len) {
+        return 0;
+    }
+    memcpy(buf, frame, used);
+
+    encoder->sent = *state;
+    ++encoder->seq;
+    encoder->frames_since_keyframe = keyframe ? 0 : encoder->frames_since_keyframe + 1;
+    encoder->keyframe_requested = false;
+    return used;
+}
+
+void wire_decoder_init(struct wire_decoder_t* decoder)
+{
+    memset(decoder, 0, sizeof(*decoder));
+}
+
+uint8_t wire_frame_kind(const uint8_t* buf, size_t len)
+{
+    struct wire_header_t header;
+    if (len < sizeof(header)) {
+        return 0;
+    }
+    memcpy(&header, buf, sizeof(header));
+    return header.version == WIRE_VERSION ? header.kind : 0;
+}
+
+enum wire_result wire_decode_state(struct wire_decoder_t* decoder, const uint8_t* buf, size_t len)
+{
+    struct wire_state_header_t header;
+    uint8_t kind = wire_frame_kind(buf, len);
+    if ((kind != WIRE_KEYFRAME && kind != WIRE_DELTA) || len < sizeof(header)) {
+        return WIRE_MALFORMED;
+    }
+    memcpy(&header, buf, sizeof(header));
+    size_t used = sizeof(header);
+
+    ++decoder->frames;
+    int16_t distance = (int16_t)(header.header.seq - decoder->next_seq);
+    if (decoder->synced && distance < 0) {
+        ++decoder->dropped;
+        return WIRE_IGNORED; // reordered or duplicated
+    }
+    if (decoder->synced && distance > 0) {
+        ++decoder->gaps;
+        decoder->synced = false;
+    }
+    if (kind == WIRE_DELTA && !decoder->synced) {
+        ++decoder->dropped;
+        return WIRE_NEED_KEYFRAME;
+    }
+
+    struct wire_state_t state = decoder->state;
+    if (kind == WIRE_KEYFRAME) {
+        if (len < used + 2) {
+            return WIRE_MALFORMED;
+        }
+        state.button_count = buf[used++];
+        state.axis_count = buf[used++];
+        if (state.button_count > WIRE_MAX_BUTTONS || state.axis_count > WIRE_MAX_AXES) {
+            return WIRE_MALFORMED;
+        }
+    }
+    if (header.fields & ~all_fields(state.axis_count)) {
+        return WIRE_MALFORMED;
+    }
+    if (header.fields & WIRE_FIELD_BUTTONS) {
+        if (len < used + sizeof(state.buttons)) {
+            return WIRE_MALFORMED;
+        }
+        memcpy(&state.buttons, buf + used, sizeof(state.buttons));
+        used += sizeof(state.buttons);
+    }
+    for (uint8_t n = 0; n < state.axis_count; ++n) {
+        if (header.fields & WIRE_FIELD_AXIS(n)) {
+            if (len < used + sizeof(state.axes[n])) {
+                return WIRE_MALFORMED;
+            }
+            memcpy(&state.axes[n], buf + used, sizeof(state.axes[n]));
+            used += sizeof(state.axes[n]);
+        }
+    }
+    if (used != len) {
+        return WIRE_MALFORMED;
+    }
+
+    state.time = header.time;
+    decoder->state = state;
+    decoder->sent_us = header.sent_us;
+    decoder->next_seq = header.header.seq + 1;
+    decoder->synced = true;
+    return WIRE_APPLIED;
+}
+
+static size_t encode_control(uint8_t* buf, size_t len, uint8_t kind, uint16_t value)
+{
+    struct wire_header_t header = {
+        .version = WIRE_VERSION,
+        .kind = kind,
+        .seq = value,
+    };
+    if (len < sizeof(header)) {
+        return 0;
+    }
+    memcpy(buf, &header, sizeof(header));
+    return sizeof(header);
+}
+
+size_t wire_encode_keyframe_request(uint8_t* buf, size_t len)
+{
+    return encode_control(buf, len, WIRE_KEYFRAME_REQUEST, 0);
+}
+
+// Control frames are a bare header; the offer carries its port in `seq`.
+size_t wire_encode_udp_offer(uint8_t* buf, size_t len, uint16_t port)
+{
+    return encode_control(buf, len, WIRE_UDP_OFFER, port);
+}
+
+bool wire_decode_udp_offer(const uint8_t* buf, size_t len, uint16_t* port)
+{
+    struct wire_header_t header;
+    if (wire_frame_kind(buf, len) != WIRE_UDP_OFFER || len != sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, buf, sizeof(header));
+    *port = header.seq;
+    return true;
+}
+
+size_t wire_encode_udp_hello(uint8_t* buf, size_t len)
+{
+    return encode_control(buf, len, WIRE_UDP_HELLO, 0);
+}
+
+size_t wire_encode_ack_request(uint8_t* buf, size_t len)
+{
+    return encode_control(buf, len, WIRE_ACK_REQUEST, 0);
+}
+
+size_t wire_encode_report_ack(uint8_t* buf, size_t len, const struct wire_report_ack_t* ack)
+{
+    if (len < sizeof(*ack)) {
+        return 0;
+    }
+    struct wire_report_ack_t frame = *ack;
+    frame.header.version = WIRE_VERSION;
+    frame.header.kind = WIRE_REPORT_ACK;
+    memcpy(buf, &frame, sizeof(frame));
+    return sizeof(frame);
+}
+
+bool wire_decode_report_ack(const uint8_t* buf, size_t len, struct wire_report_ack_t* ack)
+{
+    if (wire_frame_kind(buf, len) != WIRE_REPORT_ACK || len != sizeof(*ack)) {
+        return false;
+    }
+    memcpy(ack, buf, sizeof(*ack));
+    return true;
+}
+
+size_t wire_encode_rumble(
+    uint8_t* buf, size_t len, uint8_t kind, const struct wire_rumble_t* rumble)
+{
+    if (len < sizeof(*rumble)) {
+        return 0;
+    }
+    struct wire_rumble_t frame = *rumble;
+    frame.header.version = WIRE_VERSION;
+    frame.header.kind = kind;
+    memcpy(buf, &frame, sizeof(frame));
+    return sizeof(frame);
+}
+
+size_t wire_encode_session(uint8_t* buf, size_t len, uint32_t token)
+{
+    struct wire_session_t frame = {
+        .header = { .version = WIRE_VERSION, .kind = WIRE_SESSION },
+        .token = token,
+    };
+    if (len < sizeof(frame)) {
+        return 0;
+    }
+    memcpy(buf, &frame, sizeof(frame));
+    return sizeof(frame);
+}
+
+bool wire_decode_session(const uint8_t* buf, size_t len, uint32_t* token)
+{
+    struct wire_session_t frame;
+    if (wire_frame_kind(buf, len) != WIRE_SESSION || len != sizeof(frame)) {
+        return false;
+    }
+    memcpy(&frame, buf, sizeof(frame));
+    *token = frame.token;
+    return true;
+}
+
+bool wire_decode_rumble(const uint8_t* buf, size_t len, uint8_t kind, struct wire_rumble_t* rumble)
+{
+    if (wire_frame_kind(buf, len) != kind || len != sizeof(*rumble)) {
+        return false;
+    }
+    memcpy(rumble, buf, sizeof(*rumble));
+    return true;
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Controller state as it travels from beacon_server to device. The server
+// folds every pad event it has pending into a wire_state_t and sends it as one
+// frame, so the device applies a batch atomically.
+//
+// Frames are versioned and sequenced. A keyframe carries the complete state;
+// a delta carries only the fields that changed since the previous frame, so
+// size and parse cost follow what changed rather than how many events were
+// folded. The device drops deltas it can't apply (gap, reordering) and asks
+// for a keyframe; the server also sends one periodically. Fields are
+// little-endian, which is what both ends run on.
+
+#define WIRE_VERSION 3
+
+#define WIRE_MAX_BUTTONS 32
+#define WIRE_MAX_AXES 16
+#define WIRE_MAX_FRAME 64
+
+// Send a keyframe at least this often, even on a steady stream of deltas.
+#define WIRE_KEYFRAME_INTERVAL 128
+
+// Both ends of the PAIR connection ping each other this often (ZMTP
+// heartbeats) and drop it after this long without hearing anything. A peer
+// that vanished without closing (power loss, a dead link) is noticed either
+// way, and the server frees its seat so the device can come back.
+#define WIRE_HEARTBEAT_IVL_MS 250
+#define WIRE_HEARTBEAT_TIMEOUT_MS 1000
+
+struct wire_state_t {
+    uint32_t time; // js_event.time of the newest folded event, ms
+    uint8_t button_count;
+    uint8_t axis_count;
+    uint32_t buttons; // bit n set while button n is pressed
+    int16_t axes[WIRE_MAX_AXES];
+};
+
+enum wire_kind {
+    WIRE_KEYFRAME = 1,
+    WIRE_DELTA = 2,
+    WIRE_KEYFRAME_REQUEST = 3, // device to server
+    WIRE_UDP_OFFER = 4, // server to device over PAIR: u16 port to send WIRE_UDP_HELLO to
+    WIRE_UDP_HELLO = 5, // device to server datagram, tells the server where to stream
+    WIRE_ACK_REQUEST = 6, // server to device: send a WIRE_REPORT_ACK per delivered report
+    WIRE_REPORT_ACK = 7, // device to server, see wire_report_ack_t
+    WIRE_RUMBLE = 8, // device to server, see wire_rumble_t
+    WIRE_RUMBLE_ACK = 9, // server to device: that wire_rumble_t is playing, echoed back
+    WIRE_SESSION = 10, // server to device, see wire_session_t
+};
+
+struct wire_header_t {
+    uint8_t version;
+    uint8_t kind;
+    uint16_t seq;
+} __attribute__((packed));
+
+// Followed by: keyframes, u8 button_count and u8 axis_count; then u32 buttons
+// if field bit 0 is set and an i16 per axis n whose field bit n + 1 is set.
+struct wire_state_header_t {
+    struct wire_header_t header;
+    uint32_t time;
+    uint32_t sent_us; // sender's CLOCK_MONOTONIC at encode, us, for latency accounting
+    uint32_t fields;
+} __attribute__((packed));
+
+// Sent by the device, once asked to, whenever a report carrying new input
+// reaches the USB host. `header.seq` is the seq of the newest frame folded into
+// that report; the counters are the device's totals for the session, so a lost
+// or coalesced ack costs nothing.
+struct wire_report_ack_t {
+    struct wire_header_t header;
+    uint32_t frames; // state frames received
+    uint32_t dropped; // of those, stale or unusable
+    uint32_t published; // input changes published to the USB side
+    uint32_t reports; // of those, changes that reached the host
+} __attribute__((packed));
+
+// Sent by the device when the host changes the rumble, as the two motor
+// magnitudes of an FF_RUMBLE effect. `header.seq` counts the changes; the
+// server echoes the frame back as a WIRE_RUMBLE_ACK once the pad plays it, so
+// `sent_us`, the device's CLOCK_MONOTONIC when the host's report came in, gives
+// the round trip on the device's own clock.
+struct wire_rumble_t {
+    struct wire_header_t header;
+    uint16_t strong;
+    uint16_t weak;
+    uint32_t sent_us;
+} __attribute__((packed));
+
+// The server's first frame on every connection, before any state. A device
+// that lost its connection presents the token again when it pairs; if the
+// seat still holds that session, the server answers with the same token and
+// carries on with the same sequence, so state resumes with a delta instead of
+// a re-pair. A different token is a new session, starting with a keyframe.
+struct wire_session_t {
+    struct wire_header_t header;
+    uint32_t token; // never 0
+} __attribute__((packed));
+
+#define WIRE_FIELD_BUTTONS (1u << 0)
+#define WIRE_FIELD_AXIS(n) (1u << ((n) + 1))
+
+struct wire_encoder_t {
+    struct wire_state_t sent;
+    uint16_t seq;
+    unsigned frames_since_keyframe;
+    bool keyframe_requested;
+};
+
+struct wire_decoder_t {
+    struct wire_state_t state;
+    uint32_t sent_us; // of the last applied frame
+    uint16_t next_seq;
+    bool synced;
+    // counters
+    uint64_t frames;
+    uint64_t gaps;
+    uint64_t dropped;
+};
+
+enum wire_result {
+    WIRE_APPLIED, // decoder->state updated
+    WIRE_IGNORED, // stale or duplicate, nothing to do
+    WIRE_NEED_KEYFRAME, // out of sync, ask the server for a keyframe
+    WIRE_MALFORMED,
+};
+
+struct js_event;
+// Fold one pad event into the full controller state.
+void wire_state_apply_js_event(struct wire_state_t* state, const struct js_event* event);
+
+void wire_encoder_init(struct wire_encoder_t* encoder);
+// Make the next encoded frame a keyframe.
+void wire_encoder_request_keyframe(struct wire_encoder_t* encoder);
+// Encode `state` as a keyframe or a delta against the last encoded state.
+// Returns the frame length, or 0 when there is nothing new to send.
+size_t wire_encode_state(struct wire_encoder_t* encoder, const struct wire_state_t* state,
+    uint8_t* buf, size_t len);
+
+void wire_decoder_init(struct wire_decoder_t* decoder);
+enum wire_result wire_decode_state(struct wire_decoder_t* decoder, const uint8_t* buf, size_t len);
+
+size_t wire_encode_keyframe_request(uint8_t* buf, size_t len);
+// UDP transport setup. Over UDP every state frame is a keyframe, so a lost
+// datagram costs one update and never stalls the ones behind it.
+size_t wire_encode_udp_offer(uint8_t* buf, size_t len, uint16_t port);
+bool wire_decode_udp_offer(const uint8_t* buf, size_t len, uint16_t* port);
+size_t wire_encode_udp_hello(uint8_t* buf, size_t len);
+
+// Report acknowledgements, for measuring input-to-report latency end to end.
+size_t wire_encode_ack_request(uint8_t* buf, size_t len);
+size_t wire_encode_report_ack(uint8_t* buf, size_t len, const struct wire_report_ack_t* ack);
+bool wire_decode_report_ack(const uint8_t* buf, size_t len, struct wire_report_ack_t* ack);
+
+// Rumble, host to pad; `kind` is WIRE_RUMBLE or WIRE_RUMBLE_ACK.
+size_t wire_encode_rumble(
+    uint8_t* buf, size_t len, uint8_t kind, const struct wire_rumble_t* rumble);
+bool wire_decode_rumble(const uint8_t* buf, size_t len, uint8_t kind, struct wire_rumble_t* rumble);
+
+size_t wire_encode_session(uint8_t* buf, size_t len, uint32_t token);
+bool wire_decode_session(const uint8_t* buf, size_t len, uint32_t* token);
+
+// Returns the kind of a well-formed frame of this version, 0 otherwise.
+uint8_t wire_frame_kind(const uint8_t* buf, size_t len);